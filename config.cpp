@@ -117,6 +117,50 @@ ImGuiKeyChord config_get_key(enum config_id id)
 	}
 }
 
+struct config_snapshot config_snapshot;
+
+static void resolve(bool* dst, const struct cval* v)
+{
+	*dst = config_get_bool((enum config_id)(v - cvals));
+}
+
+static void resolve(float* dst, const struct cval* v)
+{
+	*dst = config_get_float((enum config_id)(v - cvals));
+}
+
+static void resolve(ImGuiKeyChord* dst, const struct cval* v)
+{
+	*dst = config_get_key((enum config_id)(v - cvals));
+}
+
+static void resolve(struct config_color* dst, const struct cval* v)
+{
+	dst->v4 = config_get_color((enum config_id)(v - cvals));
+	dst->u32 = ImGui::ColorConvertFloat4ToU32(dst->v4);
+}
+
+static void resolve(struct config_coltx* dst, const struct cval* v)
+{
+	const ImVec4 zero(0,0,0,0), one(1,1,1,1);
+	switch (v->t) {
+	case T_COLOR_ADD: dst->mul = one; dst->add = v->v4; break;
+	case T_COLOR_SUB: dst->mul = one; dst->add = imvec4_sub(zero, v->v4); break;
+	case T_COLOR_MUL: dst->mul = v->v4; dst->add = zero; break;
+	default: assert(!"not color transform type");
+	}
+}
+
+void config_snapshot_update(void)
+{
+	const uint64_t hash = config_hash();
+	if (hash == config_snapshot.hash) return;
+	#define C(NAME,TYPE) resolve(&config_snapshot.NAME, &cvals[CN(NAME)]);
+	EMIT_CONFIGS
+	#undef C
+	config_snapshot.hash = hash;
+}
+
 static int n_keyjazz_keymaps;
 static struct keyjazz_keymap keyjazz_keymaps[1<<8];
 
@@ -150,6 +194,7 @@ char** sf2_arr;
 void config_install(const struct cval* x)
 {
 	memcpy(cvals, x, sizeof(cvals));
+	config_snapshot_update();
 }
 
 void config_set_to_defaults(void)
@@ -214,6 +259,11 @@ bool config_is_defaults(void)
 	return config_compar(DEFAULT_CVALS) == 0;
 }
 
+uint64_t config_hash(void)
+{
+	return fnv1a64(FNV1A64_INIT, cvals, sizeof(cvals));
+}
+
 static void read_int(FILE* in, int* i)
 {
 	fscanf(in, "%d", i);
@@ -325,6 +375,8 @@ void config_load(void)
 	#undef BOOL
 
 	fclose(in);
+
+	config_snapshot_update();
 }
 
 static void write_f32(FILE* out, float f)
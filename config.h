@@ -1,5 +1,7 @@
 #ifndef CONFIG_H
 
+#include <stdint.h>
+
 #include "imgui.h"
 
 //  key                                   type/default
@@ -9,6 +11,7 @@ C(  gui_size                            , PX(20)                        ) \
 C(  wheel_sensitivity                   , SLIDE(0.2)                    ) \
 C(  time_fit_padding                    , SLIDE(0.6)                    ) \
 C(  note_fit_padding                    , SLIDE(0.3)                    ) \
+C(  header_max_height                   , SLIDE(0.4)                    ) \
 C(  label_active_color                  , RGB(0xffeedd)                 ) \
 C(  label_inactive_color                , RGB(0xaa9988)                 ) \
 C(  blinkbox_active0_color              , RGB(0xffeedd)                 ) \
@@ -43,8 +46,18 @@ C(  pianoroll_note_color1               , RGBA(0xff80ffff)              ) \
 C(  pianoroll_note_border_color         , RGBA(0x00000077)              ) \
 C(  pianoroll_note_border_size          , PX(1)                         ) \
 C(  pianoroll_note_other_track_coltx    , MUL_RGBA(0x4080ff80)          ) \
+C(  pianoroll_note_hover_color          , RGBA(0xffffffc0)              ) \
 C(  percussion_line_width               , PX(3)                         ) \
 C(  percussion_dot_radius               , PX(5)                         ) \
+C(  curve_lane_color                    , RGBA(0x000000a0)              ) \
+C(  curve_color                         , RGB(0x80ffff)                 ) \
+C(  curve_stroke_color                  , RGB(0xffffff)                 ) \
+C(  curve_line_width                    , PX(1.5)                       ) \
+C(  seq_cursor_color                    , RGBA(0x80ff80c0)              ) \
+C(  seq_step_coltx                      , MUL_RGBA(0xffffff30)          ) \
+C(  play_cursor_color                   , RGB(0x80ff80)                 ) \
+C(  play_cursor_size                    , PX(2.0)                       ) \
+C(  play_follow                         , BOOL(true)                    ) \
 C(  toggle_keyjazz_tester_key           , KEY(ImGuiKey_GraveAccent)     )
 
 #define CONFIG_MAX_TOOLS (100)
@@ -98,13 +111,75 @@ ImVec4 config_get_color(enum config_id);
 ImVec4 config_color_transform(ImVec4 x, enum config_id);
 ImGuiKeyChord config_get_key(enum config_id);
 struct cval* config_get_cval(enum config_id);
+uint64_t config_hash(void);
+
+struct config_color {
+	ImVec4 v4;
+	ImU32 u32; // packed without ImGuiStyle::Alpha
+};
+
+// add/sub/mul transform as x*mul + add
+struct config_coltx {
+	ImVec4 mul;
+	ImVec4 add;
+};
+
+// every config resolved to a plain typed field, so that per-note loops
+// don't go through config_get_cval() and its type switch. refreshed by
+// config_snapshot_update()
+struct config_snapshot {
+	#define BOOL(X)     bool
+	#define PX(X)       float
+	#define SLIDE(X)    float
+	#define KEY(X)      ImGuiKeyChord
+	#define RGB(X)      struct config_color
+	#define RGBA(X)     struct config_color
+	#define ADD_RGB(X)  struct config_coltx
+	#define ADD_RGBA(X) struct config_coltx
+	#define SUB_RGB(X)  struct config_coltx
+	#define SUB_RGBA(X) struct config_coltx
+	#define MUL_RGB(X)  struct config_coltx
+	#define MUL_RGBA(X) struct config_coltx
+	#define C(NAME,TYPE) TYPE NAME;
+	EMIT_CONFIGS
+	#undef C
+	#undef MUL_RGBA
+	#undef MUL_RGB
+	#undef SUB_RGBA
+	#undef SUB_RGB
+	#undef ADD_RGBA
+	#undef ADD_RGB
+	#undef RGBA
+	#undef RGB
+	#undef KEY
+	#undef SLIDE
+	#undef PX
+	#undef BOOL
+	uint64_t hash; // config_hash() it was resolved from
+};
 
-#define CBOOL(NAME)           config_get_bool(CN(NAME))
-#define CFLOAT(NAME)          config_get_float(CN(NAME))
-#define CCOL(NAME)            config_get_color(CN(NAME))
-#define CCOLTX(VALUE,NAME)    config_color_transform(VALUE,CN(NAME))
-#define CCOL32(NAME)          ImGui::GetColorU32(CCOL(NAME))
-#define CKEY(NAME)            config_get_key(CN(NAME))
+extern struct config_snapshot config_snapshot;
+
+// re-resolves config_snapshot if the config changed since the last call.
+// the config setters call it; call it once per frame to also pick up
+// in-place edits through config_get_cval()
+void config_snapshot_update(void);
+
+static inline ImVec4 config_coltx_apply(ImVec4 x, const struct config_coltx& tx)
+{
+	return ImVec4(
+		x.x*tx.mul.x + tx.add.x,
+		x.y*tx.mul.y + tx.add.y,
+		x.z*tx.mul.z + tx.add.z,
+		x.w*tx.mul.w + tx.add.w);
+}
+
+#define CBOOL(NAME)           (config_snapshot.NAME)
+#define CFLOAT(NAME)          (config_snapshot.NAME)
+#define CCOL(NAME)            (config_snapshot.NAME.v4)
+#define CCOLTX(VALUE,NAME)    config_coltx_apply(VALUE,config_snapshot.NAME)
+#define CCOL32(NAME)          (config_snapshot.NAME.u32)
+#define CKEY(NAME)            (config_snapshot.NAME)
 #define CKEYPRESS(NAME)       ImGui::IsKeyChordPressed(CKEY(NAME))
 
 
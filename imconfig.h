@@ -108,6 +108,13 @@
 // Read about ImGuiBackendFlags_RendererHasVtxOffset for details.
 #define ImDrawIdx unsigned int
 
+//---- miid: the font atlas is rebuilt on a worker thread (see miid.cpp). with a
+// thread-local current context, ImGui's allocation hooks on that thread do not
+// write to the main thread's context. defined in miid.cpp
+struct ImGuiContext;
+extern thread_local ImGuiContext* MiidImGuiTLS;
+#define GImGui MiidImGuiTLS
+
 //---- Override ImDrawCallback signature (will need to modify renderer backends accordingly)
 //struct ImDrawList;
 //struct ImDrawCmd;
@@ -55,15 +55,129 @@ static Uint32 get_event_window_id(SDL_Event* e)
 	assert(!"UNREACHABLE");
 }
 
+struct layer {
+	GLuint fbo[2];
+	GLuint tex[2];
+	int    width;
+	int    height;
+	int    front;
+};
+
 struct window {
 	SDL_Window*   sdlwindow;
 	SDL_GLContext glctx;
 	ImGuiContext* imctx;
 	void*         usr;
 	bool          request_close;
+	struct layer  layers[MIID_MAX_LAYERS];
 };
 
 struct window* window_arr;
+static struct window* current_window;
+static bool have_fbo;
+
+static void layer_free(struct layer* l)
+{
+	if (l->width == 0) return;
+	glDeleteFramebuffers(2, l->fbo);
+	glDeleteTextures(2, l->tex);
+	memset(l, 0, sizeof *l);
+}
+
+static void layer_alloc(struct layer* l, int width, int height)
+{
+	assert(l->width == 0);
+	l->width = width;
+	l->height = height;
+	l->front = 0;
+	GLint last_texture, last_fbo;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture);
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &last_fbo);
+	glGenTextures(2, l->tex);
+	glGenFramebuffers(2, l->fbo);
+	for (int i = 0; i < 2; i++) {
+		glBindTexture(GL_TEXTURE_2D, l->tex[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindFramebuffer(GL_FRAMEBUFFER, l->fbo[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, l->tex[i], 0);
+		assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, last_fbo);
+	glBindTexture(GL_TEXTURE_2D, last_texture);
+}
+
+ImTextureID miidhost_layer_draw(int layer, ImVec2 size, float scale, bool clear, int scroll_px, ImDrawList* draw_list)
+{
+	if (!have_fbo) return 0;
+	struct window* w = current_window;
+	assert(w != NULL);
+	assert(0 <= layer && layer < MIID_MAX_LAYERS);
+	struct layer* l = &w->layers[layer];
+
+	const int width = (int)(size.x * scale);
+	const int height = (int)(size.y * scale);
+	if (width <= 0 || height <= 0) return 0;
+	if (width != l->width || height != l->height) {
+		layer_free(l);
+		layer_alloc(l, width, height);
+		clear = true;
+		scroll_px = 0;
+	}
+	if (scroll_px <= -width || scroll_px >= width) {
+		clear = true;
+		scroll_px = 0;
+	}
+
+	if (clear || scroll_px != 0 || draw_list != NULL) {
+		GLint last_fbo;
+		glGetIntegerv(GL_FRAMEBUFFER_BINDING, &last_fbo);
+		glPushAttrib(GL_COLOR_BUFFER_BIT | GL_SCISSOR_BIT | GL_ENABLE_BIT);
+		glDisable(GL_SCISSOR_TEST);
+
+		// scrolling blits into the back buffer because reading and
+		// writing the same texture is undefined
+		const int dst = scroll_px != 0 ? (1 - l->front) : l->front;
+		glBindFramebuffer(GL_FRAMEBUFFER, l->fbo[dst]);
+		if (clear || scroll_px != 0) {
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			glClearColor(0, 0, 0, 1);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+		if (scroll_px != 0) {
+			const int sx0 = scroll_px > 0 ? 0 : -scroll_px;
+			const int sx1 = scroll_px > 0 ? width - scroll_px : width;
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, l->fbo[l->front]);
+			glBlitFramebuffer(
+				sx0,           0, sx1,           height,
+				sx0+scroll_px, 0, sx1+scroll_px, height,
+				GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, l->fbo[dst]);
+		}
+
+		if (draw_list != NULL) {
+			ImDrawData dd;
+			dd.Valid = true;
+			dd.AddDrawList(draw_list);
+			dd.DisplayPos = ImVec2(0, 0);
+			dd.DisplaySize = size;
+			dd.FramebufferScale = ImVec2(scale, scale);
+			// alpha stays at 1 so the layer composites like it was
+			// drawn directly on the (black) background
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+			ImGui_ImplOpenGL2_RenderDrawData(&dd);
+		}
+
+		glPopAttrib();
+		glBindFramebuffer(GL_FRAMEBUFFER, last_fbo);
+		l->front = dst;
+	}
+
+	return (ImTextureID)(intptr_t)l->tex[l->front];
+}
 
 void miidhost_create_window(void* usr, ImFontAtlas* shared_font_atlas)
 {
@@ -81,6 +195,7 @@ void miidhost_create_window(void* usr, ImFontAtlas* shared_font_atlas)
 	ImGui::SetCurrentContext(w.imctx);
 	ImGui_ImplSDL2_InitForOpenGL(w.sdlwindow, w.glctx);
 	ImGui_ImplOpenGL2_Init();
+	have_fbo = SDL_GL_ExtensionSupported("GL_ARB_framebuffer_object");
 	arrput(window_arr, w);
 }
 
@@ -151,11 +266,17 @@ int main(int argc, char** argv)
 
 			ImGuiIO& io = ImGui::GetIO();
 
+			if (miid_new_frame(w->usr)) {
+				// recreated by ImGui_ImplOpenGL2_NewFrame()
+				ImGui_ImplOpenGL2_DestroyFontsTexture();
+			}
 			ImGui_ImplOpenGL2_NewFrame();
 			ImGui_ImplSDL2_NewFrame();
 			ImGui::NewFrame();
 
+			current_window = w;
 			const bool do_close = miid_frame(w->usr, w->request_close);
+			current_window = NULL;
 
 			ImGui::Render();
 			glViewport(0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y);
@@ -165,6 +286,9 @@ int main(int argc, char** argv)
 			SDL_GL_SwapWindow(w->sdlwindow);
 
 			if (do_close) {
+				for (int i = 0; i < MIID_MAX_LAYERS; i++) {
+					layer_free(&w->layers[i]);
+				}
 				ImGui::DestroyContext(w->imctx);
 				SDL_GL_DeleteContext(w->glctx);
 				SDL_DestroyWindow(w->sdlwindow);
@@ -0,0 +1,2740 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "generalmidi.h"
+#include "util.h"
+#include "mid.h"
+
+bool mid_quiet;
+thread_local char mid_last_error[1<<8];
+
+static void mid_warn(const char* fmt, ...)
+{
+	if (mid_quiet) return;
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "WARNING: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+}
+
+static void mid_error(const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(mid_last_error, sizeof mid_last_error, fmt, ap);
+	va_end(ap);
+	if (!mid_quiet) fprintf(stderr, "ERROR: %s\n", mid_last_error);
+}
+
+bool write_file_from_arr(uint8_t* out_arr, const char* path)
+{
+	FILE* f = fopen(path, "wb");
+	bool ok = f != NULL;
+	if (ok) ok = fwrite(out_arr, arrlen(out_arr), 1, f) == 1;
+	if (f != NULL) ok = (fclose(f) == 0) && ok;
+	if (!ok) mid_error("%s: %s", path, strerror(errno));
+	return ok;
+}
+
+struct blob blob_load(const char* path)
+{
+	struct blob noblob = {0};
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		mid_error("%s: %s", path, strerror(errno));
+		return noblob;
+	}
+
+	if (fseek(f, 0, SEEK_END) != 0) {
+		mid_error("%s: %s", path, strerror(errno));
+		fclose(f);
+		return noblob;
+	}
+
+	const long size = ftell(f);
+
+	if (fseek(f, 0, SEEK_SET) != 0) {
+		mid_error("%s: %s", path, strerror(errno));
+		fclose(f);
+		return noblob;
+	}
+
+	uint8_t* data = (uint8_t*)malloc(size);
+
+	if (size > 0 && fread(data, size, 1, f) != 1) {
+		mid_error("%s: %s", path, strerror(errno));
+		free(data);
+		fclose(f);
+		return noblob;
+	}
+
+	fclose(f);
+
+	return (struct blob) {
+		.data = data,
+		.size = (size_t)size,
+	};
+}
+
+static int read_u8(struct blob* p)
+{
+	if (p->size == 0) return -1;
+	const int b = p->data[0];
+	*p = blob_slice(*p, 1);
+	return b;
+}
+
+static void unread_u8(struct blob* p)
+{
+	*p = blob_slice(*p, -1);
+}
+
+static int skip_n(struct blob* p, int n)
+{
+	if ((int)p->size < n) return 0;
+	*p = blob_slice(*p, n);
+	return 1;
+}
+
+static int skip_magic_string(struct blob* p, const char* s)
+{
+	const size_t n = strlen(s);
+	uint8_t* p0 = p->data;
+	int did_skip = skip_n(p, n);
+	if (!did_skip) return 0;
+	return memcmp(p0, s, n) == 0;
+}
+
+static uint8_t* read_data(struct blob* p, int n)
+{
+	uint8_t* p0 = p->data;
+	if (!skip_n(p, n)) return NULL;
+	return p0;
+}
+
+static char* dup2str(uint8_t* data, int n)
+{
+	char* s = (char*)malloc(n+1);
+	memcpy(s, data, n);
+	s[n] = 0;
+	return s;
+}
+
+static int read_i32_be(struct blob* p)
+{
+	uint8_t* s = p->data;
+	if (!skip_n(p, 4)) return -1;
+	const int v =
+		(((int)(s[0])) << 24) +
+		(((int)(s[1])) << 16) +
+		(((int)(s[2])) << 8)  +
+		 ((int)(s[3]));
+	return v;
+}
+
+static int read_u16_be(struct blob* p)
+{
+	uint8_t* s = p->data;
+	if (!skip_n(p, 2)) return -1;
+	const int v =
+		(((int)(s[0])) << 8)  +
+		 ((int)(s[1]));
+	return v;
+}
+
+static int read_midi_varuint(struct blob* p)
+{
+	int v = 0;
+	for (;;) {
+		int ch = read_u8(p);
+		if (ch == -1) return -1;
+		v |= (ch & 0x7f);
+		if (!(ch & 0x80)) break;
+		v <<= 7;
+	}
+	return v;
+}
+
+#define MThd "MThd"
+#define MTrk "MTrk"
+
+static void handle_text(const char* what, char* text, uint8_t* data, int len)
+{
+	if (strlen(text) == 0) {
+		if (len < (TEXT_FIELD_SIZE-1)) {
+			memcpy(text, data, len);
+			text[len] = 0;
+		} else {
+			mid_warn("trashing very long %s", what);
+		}
+	} else {
+		mid_warn("trashing %s; already got one", what);
+	}
+}
+
+char* alloc_text_field(void)
+{
+	return (char*)calloc(TEXT_FIELD_SIZE, 1);
+}
+
+static struct mid* unmarshal_fail(struct mid* mid, int* trk_flags)
+{
+	mid_free(mid);
+	arrfree(trk_flags);
+	return NULL;
+}
+
+struct mid* mid_unmarshal_blob(struct blob blob)
+{
+	struct blob p = blob;
+	if (!skip_magic_string(&p, MThd)) {
+		mid_error("bad header (fourcc)");
+		return NULL;
+	}
+	if (read_i32_be(&p) != 6) {
+		mid_error("bad header (" MThd " size not 6)");
+		return NULL;
+	}
+
+	const int format = read_u16_be(&p);
+	if (format != 1) {
+		mid_error("unsupported format %d; only format 1 is supported, sorry!", format);
+		return NULL;
+	}
+
+	const int n_tracks = read_u16_be(&p);
+	if (n_tracks == 0) {
+		mid_error("MIDI file has no tracks; aborting load");
+		return NULL;
+	}
+
+	const int division = read_u16_be(&p);
+	if (division >= 0x8000) {
+		mid_error("MIDI uses absolute time division which is not supported (v=%d)", division);
+		return NULL;
+	}
+
+	struct mid* mid = (struct mid*)calloc(1, sizeof *mid);
+	mid->division = division;
+	mid->text = alloc_text_field();
+	arrsetlen(mid->_trk_arr, n_tracks);
+	memset(mid->_trk_arr, 0, n_tracks * sizeof mid->_trk_arr[0]);
+
+	const int HAS_META = 1<<0, HAS_MIDI = 1<<1;
+	int* trk_flags = NULL;
+	arrsetlen(trk_flags, n_tracks);
+	int track_index = 0;
+	while (track_index < n_tracks) {
+		const int is_MTrk = skip_magic_string(&p, "MTrk");
+		const int chunk_size = read_i32_be(&p);
+		if (chunk_size == -1) {
+			mid_error("bad read");
+			return unmarshal_fail(mid, trk_flags);
+		}
+
+		if (!is_MTrk) {
+			if (!skip_n(&p, chunk_size)) {
+				mid_error("badly terminated RIFF chunk");
+				return unmarshal_fail(mid, trk_flags);
+			}
+			continue;
+		}
+
+		int remaining = chunk_size;
+		if (remaining < 0) {
+			mid_error("bad MTrk size");
+			return unmarshal_fail(mid, trk_flags);
+		}
+		int pos = 0;
+		struct trk* trk = &mid->_trk_arr[track_index];
+		memset(trk, 0, sizeof *trk);
+		int* flags = &trk_flags[track_index];
+		*flags = 0;
+		trk->name = alloc_text_field();
+		int end_of_track = 0;
+		int last_b0 = -1;
+		int current_midi_channel = -1;
+		while (remaining > 0) {
+			if (end_of_track) {
+				mid_error("premature end of track marker");
+				return unmarshal_fail(mid, trk_flags);
+			}
+			struct blob anchor = p;
+			const int delta = read_midi_varuint(&p);
+			if (delta < 0) {
+				mid_error("bad timestamp (%d)", delta);
+				return unmarshal_fail(mid, trk_flags);
+			}
+			pos += delta;
+
+			int b0 = read_u8(&p);
+			if (b0 < 0x80) {
+				if (last_b0 < 0x80) {
+					mid_error("bad sync? (last_b0=%d) (p=%ld)", last_b0, p.data-blob.data);
+					return unmarshal_fail(mid, trk_flags);
+				}
+				b0 = last_b0;
+				unread_u8(&p);
+			}
+			last_b0 = b0;
+			const int h0 = b0 & 0xf0;
+			const int nn = b0 & 0x0f;
+			int emit_mev = 0;
+			struct mev mev = {
+				.pos = pos,
+			};
+			int nstd = -1;
+			if (b0 == SYSEX) { // sysex event
+				const int len = read_midi_varuint(&p);
+				if (len < 0) {
+					mid_error("bad sysex length");
+					return unmarshal_fail(mid, trk_flags);
+				}
+				mid_warn("trashing sysex chunk (len=%d)", len);
+				skip_n(&p, len-1);
+				if (read_u8(&p) != 0xf7) {
+					mid_error("bad sysex block");
+					return unmarshal_fail(mid, trk_flags);
+				}
+			} else if (b0 == META) { // meta event
+				const int type = read_u8(&p);
+				int write_nmeta = -1;
+				if (type < 0) {
+					mid_error("bad meta type read");
+					return unmarshal_fail(mid, trk_flags);
+				}
+				const int len = read_midi_varuint(&p);
+				if (len < 0) {
+					mid_error("bad meta type len");
+					return unmarshal_fail(mid, trk_flags);
+				}
+				uint8_t* data = read_data(&p, len);
+				if (data == NULL) {
+					mid_error("bad data");
+					return unmarshal_fail(mid, trk_flags);
+				}
+				if (type == TEXT) {
+					handle_text("TEXT", mid->text, data, len);
+				} else if (type == TRACK_NAME) {
+					handle_text("TRACK TITLE", trk->name, data, len);
+				} else if (type == INSTRUMENT_NAME) {
+					mid_warn("trashing INSTRUMENT NAME");
+				} else if (type == MARKER) {
+					mid_warn("trashing MARKER");
+				} else if (type == MIDI_CHANNEL) {
+					if (len != 1) {
+						mid_error("expected len=1 for MIDI_CHANNEL");
+						return unmarshal_fail(mid, trk_flags);
+					}
+					if (current_midi_channel == -1) {
+						current_midi_channel = data[0];
+					} else {
+						mid_warn("trashing surplus midi channel meta event");
+					}
+				} else if (type == END_OF_TRACK) {
+					if (len != 0) {
+						mid_error("expected len=0 for END_OF_TRACK");
+						return unmarshal_fail(mid, trk_flags);
+					}
+					end_of_track = 1;
+					if (pos >= mid->end_of_song_pos) {
+						mid->end_of_song_pos = pos;
+					}
+				} else if (type == SET_TEMPO) {
+					if (len != 3) {
+						mid_error("expected len=3 for SET_TEMPO");
+						return unmarshal_fail(mid, trk_flags);
+					}
+					write_nmeta = 3;
+				} else if (type == SMPTE_OFFSET) {
+					if (len != 5) {
+						mid_error("expected len=5 for SMPTE_OFFSET");
+						return unmarshal_fail(mid, trk_flags);
+					}
+
+					mid_warn("trashing SMPTE OFFSET %d:%d:%d %d %d", data[0], data[1], data[2], data[3], data[4]);
+				} else if (type == TIME_SIGNATURE) {
+					if (len != 4) {
+						mid_error("expected len=4 for TIME_SIGNATURE");
+						return unmarshal_fail(mid, trk_flags);
+					}
+					write_nmeta = 2;
+				} else if (type == KEY_SIGNATURE) {
+					mid_warn("trashing KEY SIGNATURE");
+				} else if (type == CUSTOM) {
+					// NOTE could put my own stuff here
+					mid_warn("trashing sequencer specific meta event");
+				} else {
+					mid_warn("trashing unknown meta event type 0x%.2x", type);
+				}
+
+				if (write_nmeta >= 0) {
+					assert((type < 0x80) && "conflict with normal MIDI");
+					assert(0 <= write_nmeta && write_nmeta < 4);
+					memset(mev.b, 0, ARRAY_LENGTH(mev.b));
+					mev.b[0] = type;
+					for (int i = 0; i < write_nmeta; i++) {
+						mev.b[i+1] = data[i];
+					}
+					*flags |= HAS_META;
+					emit_mev = 1;
+				}
+			} else if (h0 == NOTE_OFF) {
+				nstd = 2;
+			} else if (h0 == NOTE_ON) {
+				nstd = 2;
+			} else if (h0 == POLY_AFTERTOUCH) {
+				nstd = 2;
+			} else if (h0 == CONTROL_CHANGE) {
+				nstd = 2;
+			} else if (h0 == PROGRAM_CHANGE) {
+				nstd = 1;
+			} else if (h0 == CHANNEL_AFTERTOUCH) {
+				nstd = 1;
+			} else if (h0 == PITCH_BEND) {
+				nstd = 2;
+			} else {
+				mid_error("bad sync? (b0=%d) (p=%ld)", b0, p.data-blob.data);
+				return unmarshal_fail(mid, trk_flags);
+			}
+			if (nstd >= 0) {
+				if (nn != current_midi_channel) {
+					if (current_midi_channel == -1) {
+						current_midi_channel = nn;
+					}
+					if (nn != current_midi_channel) {
+						mid_error("channel mismatch nn=%d vs meta=%d", nn, current_midi_channel);
+						return unmarshal_fail(mid, trk_flags);
+					}
+				}
+				mev.b[0] = b0 & 0xf0; // remove channel (channel is fixed for entire track)
+				for (int i = 0; i < nstd; i++) {
+					int v = read_u8(&p);
+					if (v < 0 || v >= 0x80) {
+						mid_error("bad MIDI event read (p=%ld)", p.data-blob.data);
+						return unmarshal_fail(mid, trk_flags);
+					}
+					mev.b[i+1] = v;
+				}
+				*flags |= HAS_MIDI;
+				emit_mev = 1;
+				#if 0
+				if (h0 == PROGRAM_CHANGE) {
+					printf("PRG %d on channel %d\n", mev.b[1], mev.b[0]&0xf);
+				}
+				#endif
+				if (h0 == CONTROL_CHANGE) {
+					const int controller = mev.b[1];
+					switch (controller) {
+						case VOLUME:
+						case PAN:
+						case MODULATION_WHEEL:
+						case DAMPER_PEDAL:
+						case EFFECT1_DEPTH:
+						case EFFECT3_DEPTH:
+						case RESET_ALL_CONTROLLERS:
+							// handled (?)
+							break;
+						default:
+							mid_warn("trashing CC[%d]=%d event on channel %d", mev.b[1], mev.b[2], mev.b[0]&0xf);
+							emit_mev = 0;
+							break;
+					}
+				} else if (h0 == POLY_AFTERTOUCH) {
+					mid_warn("trashing POLY_AFTERTOUCH");
+					emit_mev = 0;
+				} else if (h0 == CHANNEL_AFTERTOUCH) {
+					mid_warn("trashing CHANNEL_AFTERTOUCH");
+					emit_mev = 0;
+				}
+			}
+			if (emit_mev) {
+				arrput(trk->mev_arr, mev);
+			}
+
+			const int n_read = p.data - anchor.data;
+			assert(n_read > 0);
+			remaining -= n_read;
+		}
+		if (remaining != 0) {
+			mid_error("bad sync? (remaining=%d) (p=%ld)", remaining, p.data-blob.data);
+			return unmarshal_fail(mid, trk_flags);
+		}
+		if (!end_of_track) {
+			mid_error("encountered no end of track marker");
+			return unmarshal_fail(mid, trk_flags);
+		}
+
+		if (current_midi_channel == -1) {
+			// XXX typically seen on first MTrk?
+			mid_warn("no MIDI channel (MTrk index %d)", track_index);
+			trk->midi_channel = -1;
+		} else {
+			trk->midi_channel = current_midi_channel;
+			assert(trk->midi_channel >= 0);
+		}
+
+		int n_note_on = 0;
+		int n_note_off = 0;
+		for (struct mev* e = trk->mev_arr; e < trk->mev_arr + arrlen(trk->mev_arr); e++) {
+			if (e->b[0] == NOTE_ON && e->b[2] == 0) {
+				// XXX is this appropriate? is it a trk
+				// "config" like "percussion"? does fluidsynth
+				// play it differently?
+				e->b[0] = NOTE_OFF;
+			}
+			switch (e->b[0]) {
+			case NOTE_ON:  n_note_on++;  break;
+			case NOTE_OFF: n_note_off++; break;
+			}
+		}
+		if (n_note_on > 0 && n_note_off == 0) {
+			trk->percussive = true;
+		}
+
+		track_index++;
+	}
+
+	if (p.size > 0) {
+		mid_warn("ignoring %zd bytes of trailing garbage", p.size);
+	}
+
+	// we have a constraint that the first track must be a tempo/time
+	// signature track, and the rest must be "normal" tracks (and they
+	// cannot be mixed). this seems to hold for the MIDI files I've seen,
+	// and it makes it easier to use the data as-is. it wouldn't be hard to
+	// FIXME but I need a file that breaks this convention.
+	for (int i = 0; i < n_tracks; i++) {
+		const int flags = trk_flags[i];
+		if ((flags & HAS_META) && (flags & HAS_MIDI)) {
+			// mixed track
+			mid_error("FIXME fixup not implemented (/1)");
+			return unmarshal_fail(mid, trk_flags);
+		}
+		if (flags & HAS_META) {
+			if (i != 0) {
+				// meta track is not first
+				mid_error("FIXME fixup not implemented (/2)");
+				return unmarshal_fail(mid, trk_flags);
+			}
+		} else if (flags & HAS_MIDI) {
+			if (i == 0) {
+				// first track is "normal"
+				mid_error("FIXME fixup not implemented (/3)");
+				return unmarshal_fail(mid, trk_flags);
+			}
+		}
+	}
+
+	#if 0
+	printf("song length: %d\n", mid->end_of_song_pos);
+	#endif
+
+	arrfree(trk_flags);
+	return mid;
+}
+
+static void marshal_raw_string(uint8_t** data_arr, const char* str)
+{
+	size_t n = strlen(str);
+	uint8_t* dst = arraddnptr(*data_arr, n);
+	memcpy(dst, str, n);
+}
+
+static void store_u32_be(uint8_t* p, unsigned v)
+{
+	for (int i = 0; i < 4; i++) {
+		p[i] = (v >> 24);
+		v = (v & 0xffffff) << 8;
+	}
+}
+
+static void marshal_u32_be(uint8_t** data_arr, unsigned v)
+{
+	uint8_t* p = arraddnptr(*data_arr, 4);
+	store_u32_be(p, v);
+}
+
+static void store_u16_be(uint8_t* p, unsigned v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+static void marshal_u16_be(uint8_t** data_arr, unsigned v)
+{
+	uint8_t* p = arraddnptr(*data_arr, 2);
+	store_u16_be(p, v);
+}
+
+static void marshal_u8(uint8_t** data_arr, unsigned v)
+{
+	uint8_t* p = arraddnptr(*data_arr, 1);
+	*p = v;
+}
+
+static void marshal_copy(uint8_t** data_arr, uint8_t* p, int n)
+{
+	if (n == 0) return;
+	uint8_t* d = arraddnptr(*data_arr, n);
+	memcpy(d, p, n);
+}
+
+static void marshal_midi_varuint(uint8_t** data_arr, unsigned v)
+{
+	int n_bytes = 1;
+	unsigned vc = v;
+	for (;;) {
+		vc >>= 7;
+		if (vc == 0) break;
+		n_bytes++;
+	}
+	uint8_t* p = arraddnptr(*data_arr, n_bytes);
+	for (int i = 0; i < n_bytes; i++) {
+		p[i] = ((v >> ((n_bytes-1-i)*7)) & 0x7f) | ((i < (n_bytes-1)) ? 0x80 : 0);
+	}
+}
+
+static void evbegin(int pos, int* cursor, uint8_t** data_arr)
+{
+	int delta = pos - *cursor;
+	assert((delta >= 0) && "bad event ordering");
+	marshal_midi_varuint(data_arr, delta);
+	*cursor = pos;
+}
+
+static uint8_t* evmeta(uint8_t** data_arr, enum meta_type t, int n)
+{
+	marshal_u8(data_arr, META);
+	marshal_u8(data_arr, t);
+	marshal_midi_varuint(data_arr, n);
+	if (n > 0) {
+		uint8_t* p = arraddnptr(*data_arr, n);
+		memset(p, 0, n);
+		return p;
+	} else {
+		assert(n == 0);
+		return NULL;
+	}
+}
+
+static void evmetastr(uint8_t** data_arr, enum meta_type t, char* str)
+{
+	const size_t n = strlen(str);
+	uint8_t* p = evmeta(data_arr, t, n);
+	memcpy(p, str, n);
+}
+
+uint8_t* mid_marshal_arr(struct mid* mid)
+{
+	const int n_tracks = arrlen(mid->_trk_arr);
+
+	// most events marshal to 2-4 bytes (running status + varuint delta)
+	size_t cap = 14;
+	for (int i = 0; i < n_tracks; i++) {
+		struct trk* trk = &mid->_trk_arr[i];
+		cap += 8 + 3+strlen(trk->name) + 4 + 4 + 4*arrlen(trk->mev_arr);
+	}
+	uint8_t* bs = NULL;
+	arrsetcap(bs, cap);
+
+	marshal_raw_string(&bs, MThd);
+	marshal_u32_be(&bs, 6);
+	marshal_u16_be(&bs, 1);
+	marshal_u16_be(&bs, n_tracks);
+	marshal_u16_be(&bs, mid->division);
+
+	for (int track_index = 0; track_index < n_tracks; track_index++) {
+		marshal_raw_string(&bs, MTrk);
+		const int MTrk_chunk_size_offset = arrlen(bs);
+		marshal_u32_be(&bs, -1); // to be written when we know...
+
+		struct trk* trk = &mid->_trk_arr[track_index];
+
+		int cursor = 0;
+
+		evbegin(0, &cursor, &bs);
+		evmetastr(&bs, TRACK_NAME, trk->name);
+
+		const int midi_channel = trk->midi_channel;
+
+		if (midi_channel >= 0) {
+			evbegin(0, &cursor, &bs);
+			uint8_t* p = evmeta(&bs, MIDI_CHANNEL, 1);
+			p[0] = midi_channel;
+		}
+
+		const int n_mev = arrlen(trk->mev_arr);
+		int last_midi_cmd = -1;
+		for (int mev_index = 0; mev_index < n_mev; mev_index++) {
+			struct mev* mev = &trk->mev_arr[mev_index];
+			evbegin(mev->pos, &cursor, &bs);
+			const uint8_t b0 = mev->b[0];
+			int nw = -1;
+			int nmeta = -1;
+			uint8_t meta[4] = {0};
+			if (b0 == SET_TEMPO) {
+				for (int i = 0; i < 3; i++) {
+					meta[i] = mev->b[i+1];
+				}
+				nmeta = 3;
+			} else if (b0 == TIME_SIGNATURE) {
+				for (int i = 0; i < 2; i++) {
+					meta[i] = mev->b[i+1];
+				}
+				meta[2] = 0x24; // XXX?
+				meta[3] = 0x08; // XXX?
+				nmeta = 4;
+			} else {
+				switch (b0 & 0xf0) {
+				case NOTE_OFF:
+				case NOTE_ON:
+				case CONTROL_CHANGE:
+				case PITCH_BEND:
+					nw = 2;
+					break;
+				case PROGRAM_CHANGE:
+					nw = 1;
+					break;
+				default:
+					assert(!"unexpected MIDI event");
+				}
+			}
+			if (nw >= 0) {
+				assert(0 < nw && nw <= 3);
+				const int ch = midi_channel;
+				assert(0 <= ch && ch < 16);
+				const int midi_cmd = (b0&0xf0) + ch;
+				if (midi_cmd != last_midi_cmd) {
+					marshal_u8(&bs, midi_cmd);
+					last_midi_cmd = midi_cmd;
+				}
+				for (int i = 0; i < nw; i++) {
+					const int v = mev->b[i+1];
+					assert((0 <= v && v < 0x80) && "MIDI argument must not have bit 7 set");
+					marshal_u8(&bs, v);
+				}
+			} else if (nmeta >= 0) {
+				const int n0 = arrlen(bs);
+				marshal_u8(&bs, META);
+				marshal_u8(&bs, b0);
+				marshal_u8(&bs, nmeta);
+				marshal_copy(&bs, meta, nmeta);
+				const int n1 = arrlen(bs);
+				assert((n1-n0) == (3+nmeta));
+				last_midi_cmd = -1;
+			} else {
+				assert(!"UNREACHABLE");
+			}
+		}
+
+		evbegin(mid->end_of_song_pos, &cursor, &bs);
+		evmeta(&bs, END_OF_TRACK, 0);
+
+		assert(cursor == mid->end_of_song_pos);
+
+		const int chunk_size = arrlen(bs) - (MTrk_chunk_size_offset + 4);
+		store_u32_be(&bs[MTrk_chunk_size_offset], chunk_size);
+	}
+
+	return bs;
+}
+
+struct mid* mid_new(void)
+{
+	struct mid* m = (struct mid*)calloc(1, sizeof *m);
+	m->text = alloc_text_field();
+	strncpy(m->text, "TODO your song title", TEXT_FIELD_SIZE);
+	m->division = 480;
+	struct trk* trk = arraddnptr(m->_trk_arr, 1);
+	memset(trk, 0, sizeof *trk);
+	trk->midi_channel = -1;
+	trk->name = alloc_text_field();
+	return m;
+}
+
+void mid_free(struct mid* mid)
+{
+	if (mid == NULL) return;
+	const int n = arrlen(mid->_trk_arr);
+	for (int i = 0; i < n; i++) {
+		struct trk* trk = &mid->_trk_arr[i];
+		free(trk->name);
+		arrfree(trk->mev_arr);
+	}
+	arrfree(mid->_trk_arr);
+	free(mid->text);
+	free(mid);
+}
+
+// pairs up NOTE ONs and NOTE OFFs per key in one linear pass. with
+// apply=false it only counts what would be fixed, so well-formed tracks (the
+// common case) are never copied
+static int normalise_trk(struct trk* trk, int end_of_song_pos, bool apply)
+{
+	bool open[N_NOTES] = {0};
+	int open_pos[N_NOTES];
+	int n_fixes = 0;
+	const int n = arrlen(trk->mev_arr);
+	struct mev* out = NULL;
+	if (apply) arrsetcap(out, n + N_NOTES);
+	for (int i = 0; i < n; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		const int key = mev->b[1];
+		if (mev->b[0] == NOTE_ON) {
+			if (open[key] && open_pos[key] == mev->pos) {
+				// re-triggered on the same tick; ending the previous
+				// note here would leave a zero-length note, so drop
+				// this NOTE ON instead
+				n_fixes++;
+				continue;
+			}
+			if (open[key]) {
+				// re-triggered; end the previous note here
+				n_fixes++;
+				if (apply) arrput(out, ((struct mev) { .pos = mev->pos, .b = {NOTE_OFF, (uint8_t)key, 0} }));
+			}
+			open[key] = true;
+			open_pos[key] = mev->pos;
+		} else if (mev->b[0] == NOTE_OFF) {
+			if (!open[key]) {
+				// NOTE OFF without NOTE ON; drop it
+				n_fixes++;
+				continue;
+			}
+			open[key] = false;
+		}
+		if (apply) arrput(out, *mev);
+	}
+	for (int key = 0; key < N_NOTES; key++) {
+		if (!open[key]) continue;
+		// still playing at end of song
+		n_fixes++;
+		if (apply) arrput(out, ((struct mev) { .pos = end_of_song_pos, .b = {NOTE_OFF, (uint8_t)key, 0} }));
+	}
+	if (apply) {
+		arrfree(trk->mev_arr);
+		trk->mev_arr = out;
+	}
+	return n_fixes;
+}
+
+int mid_normalise(struct mid* mid)
+{
+	int n_fixes = 0;
+	const int n_tracks = mid_get_track_count(mid);
+	for (int i = 0; i < n_tracks; i++) {
+		struct trk* trk = mid_get_trk(mid, i);
+		if (trk->percussive) continue;
+		const int n = normalise_trk(trk, mid->end_of_song_pos, false);
+		if (n == 0) continue;
+		normalise_trk(trk, mid->end_of_song_pos, true);
+		n_fixes += n;
+	}
+	return n_fixes;
+}
+
+int mid_validate(struct mid* mid, const char* what)
+{
+	int n_problems = 0;
+	#define PROBLEM(...) do { if (n_problems++ < 16) mid_warn(__VA_ARGS__); } while (0)
+
+	if (mid->division <= 0) PROBLEM("%s: bad division (%d)", what, mid->division);
+	if (arrlen(mid->_trk_arr) < 1) {
+		PROBLEM("%s: no time track", what);
+		return n_problems;
+	}
+
+	const int n_trks = arrlen(mid->_trk_arr);
+	for (int ti = 0; ti < n_trks; ti++) {
+		struct trk* trk = &mid->_trk_arr[ti];
+		if (trk->name == NULL || strnlen(trk->name, TEXT_FIELD_SIZE) == TEXT_FIELD_SIZE) {
+			PROBLEM("%s: track %d: bad name", what, ti);
+		}
+		const int n = arrlen(trk->mev_arr);
+		if (ti > 0 && n > 0 && !(0 <= trk->midi_channel && trk->midi_channel < 16)) {
+			PROBLEM("%s: track %d: bad MIDI channel (%d)", what, ti, trk->midi_channel);
+		}
+		int last_pos = 0;
+		for (int i = 0; i < n; i++) {
+			struct mev* mev = &trk->mev_arr[i];
+			if (mev->pos < last_pos || mev->pos > mid->end_of_song_pos) {
+				PROBLEM("%s: track %d: event %d out of order (pos=%d)", what, ti, i, mev->pos);
+			}
+			last_pos = mev->pos;
+			const int b0 = mev->b[0];
+			int nw = 0;
+			if (ti == 0) {
+				if (b0 != SET_TEMPO && b0 != TIME_SIGNATURE) {
+					PROBLEM("%s: track %d: unexpected event 0x%.2x in time track", what, ti, b0);
+				}
+				continue;
+			}
+			switch (b0) {
+			case NOTE_OFF:
+			case NOTE_ON:
+			case CONTROL_CHANGE:
+			case PITCH_BEND:
+				nw = 2;
+				break;
+			case PROGRAM_CHANGE:
+				nw = 1;
+				break;
+			default:
+				PROBLEM("%s: track %d: unexpected event 0x%.2x", what, ti, b0);
+				break;
+			}
+			for (int j = 0; j < nw; j++) {
+				if (mev->b[1+j] & 0x80) PROBLEM("%s: track %d: event %d has bit 7 set in argument", what, ti, i);
+			}
+		}
+		if (ti > 0 && !trk->percussive) {
+			const int n_unpaired = normalise_trk(trk, mid->end_of_song_pos, false);
+			if (n_unpaired > 0) PROBLEM("%s: track %d: %d unpaired notes", what, ti, n_unpaired);
+		}
+	}
+
+	#undef PROBLEM
+	return n_problems;
+}
+
+// range edits are done by splicing: each track is rebuilt from segments of
+// itself ([src0,src1) placed at dst) in one linear pass. notes sounding
+// across a segment edge are split (NOTE OFF at the end of the segment, NOTE
+// ON at the start of the next), and the last tempo/time signature/CC/pitch
+// bend/program before a segment is carried to its start, so everything
+// sounds the same as in the source. segments must be ordered by dst and
+// must not overlap in the output
+struct splice_seg {
+	int src0, src1; // src1=INT_MAX: until end of track
+	int dst;
+};
+
+#define N_STATE_SLOTS (N_NOTES + 4)
+
+// events that set state which lasts until the next event in the same slot
+static int state_slot(struct mev* mev)
+{
+	switch (mev->b[0]) {
+	case CONTROL_CHANGE: return mev->b[1];
+	case PITCH_BEND:     return N_NOTES + 0;
+	case PROGRAM_CHANGE: return N_NOTES + 1;
+	case SET_TEMPO:      return N_NOTES + 2;
+	case TIME_SIGNATURE: return N_NOTES + 3;
+	default:             return -1;
+	}
+}
+
+// at equal pos: NOTE OFFs, then other events, then NOTE ONs, so that a note
+// can start where another one of the same key ends
+static int mev_order_rank(struct mev* mev)
+{
+	switch (mev->b[0]) {
+	case NOTE_OFF: return 0;
+	case NOTE_ON:  return 2;
+	default:       return 1;
+	}
+}
+
+static int mev_order_cmp(const void* va, const void* vb)
+{
+	struct mev* a = (struct mev*)va;
+	struct mev* b = (struct mev*)vb;
+	if (a->pos != b->pos) return a->pos - b->pos;
+	return mev_order_rank(a) - mev_order_rank(b);
+}
+
+// merges n_add new events (sorted) into mev_arr (sorted) from the back;
+// existing events go first among equals unless the new one ranks before
+// them. new NOTE OFFs go before everything at their pos: their NOTE ON is
+// earlier, and existing events at a pos aren't necessarily in rank order (a
+// zero-length note from a file is NOTE ON, NOTE OFF). stops when the new
+// events run out, so the events before the first new one are never touched
+// and appending at the end is amortised O(1)
+static void mev_merge(struct mev** mev_arr, struct mev* add, int n_add)
+{
+	if (n_add <= 0) return;
+	const int n_old = arrlen(*mev_arr);
+	arrsetlen(*mev_arr, n_old + n_add);
+	struct mev* a = *mev_arr;
+	int i = n_old-1, j = n_add-1, w = n_old + n_add - 1;
+	while (j >= 0) {
+		const bool before = i >= 0 && (add[j].pos != a[i].pos
+			? add[j].pos < a[i].pos
+			: add[j].b[0] == NOTE_OFF || mev_order_rank(&add[j]) < mev_order_rank(&a[i]));
+		if (before) {
+			a[w--] = a[i--];
+		} else {
+			a[w--] = add[j--];
+		}
+	}
+}
+
+int mev_lower_bound(struct mev* mev_arr, int n, int pos)
+{
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		const int mid = lo + (hi-lo)/2;
+		if (mev_arr[mid].pos < pos) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static bool splice_continues(const struct splice_seg* a, const struct splice_seg* b)
+{
+	return b->src0 == a->src1 && b->dst == a->dst + (a->src1 - a->src0);
+}
+
+static void trk_splice(struct trk* trk, const struct splice_seg* segs, int n_segs)
+{
+	struct mev* src = trk->mev_arr;
+	const int n = arrlen(src);
+	const bool track_notes = !trk->percussive;
+
+	int cap = 0;
+	for (int si = 0; si < n_segs; si++) {
+		const struct splice_seg* seg = &segs[si];
+		const int i0 = mev_lower_bound(src, n, seg->src0);
+		const int i1 = seg->src1 == INT_MAX ? n : mev_lower_bound(src, n, seg->src1);
+		cap += (i1 - i0) + 2*N_NOTES + N_STATE_SLOTS;
+	}
+	struct mev* out = NULL;
+	arrsetcap(out, cap);
+
+	uint8_t sounding[N_NOTES] = {0}; // velocity of notes sounding in out
+	struct mev emitted[N_STATE_SLOTS];
+	bool have_emitted[N_STATE_SLOTS] = {0};
+
+	for (int si = 0; si < n_segs; si++) {
+		const struct splice_seg* seg = &segs[si];
+		const int i0 = mev_lower_bound(src, n, seg->src0);
+		const int i1 = seg->src1 == INT_MAX ? n : mev_lower_bound(src, n, seg->src1);
+		const int shift = seg->dst - seg->src0;
+		bool skip_off[N_NOTES] = {0};
+
+		if (si == 0 || !splice_continues(&segs[si-1], seg)) {
+			// chase state at src0
+			uint8_t chased[N_NOTES] = {0};
+			int last_state[N_STATE_SLOTS];
+			for (int i = 0; i < N_STATE_SLOTS; i++) last_state[i] = -1;
+			for (int i = 0; i < i0; i++) {
+				struct mev* e = &src[i];
+				if (e->b[0] == NOTE_ON) {
+					chased[e->b[1]] = e->b[2];
+				} else if (e->b[0] == NOTE_OFF) {
+					chased[e->b[1]] = 0;
+				} else {
+					const int slot = state_slot(e);
+					if (slot >= 0) last_state[slot] = i;
+				}
+			}
+			// NOTE OFFs at src0 end notes from before src0; don't
+			// restart those
+			bool on_at_src0[N_NOTES] = {0};
+			for (int i = i0; i < i1 && src[i].pos == seg->src0; i++) {
+				struct mev* e = &src[i];
+				const int key = e->b[1];
+				if (e->b[0] == NOTE_ON) {
+					on_at_src0[key] = true;
+				} else if (e->b[0] == NOTE_OFF && chased[key] && !on_at_src0[key]) {
+					chased[key] = 0;
+					skip_off[key] = true;
+				}
+			}
+			for (int slot = 0; slot < N_STATE_SLOTS; slot++) {
+				if (last_state[slot] < 0) continue;
+				struct mev e = src[last_state[slot]];
+				if (have_emitted[slot] && memcmp(emitted[slot].b, e.b, sizeof e.b) == 0) continue;
+				e.pos = seg->dst;
+				arrput(out, e);
+				emitted[slot] = e;
+				have_emitted[slot] = true;
+			}
+			if (track_notes) {
+				for (int key = 0; key < N_NOTES; key++) {
+					if (!chased[key]) continue;
+					arrput(out, ((struct mev) { .pos = seg->dst, .b = {NOTE_ON, (uint8_t)key, chased[key]} }));
+					sounding[key] = chased[key];
+				}
+			}
+		}
+
+		for (int i = i0; i < i1; i++) {
+			struct mev e = src[i];
+			const int key = e.b[1];
+			if (e.b[0] == NOTE_ON) {
+				sounding[key] = e.b[2];
+			} else if (e.b[0] == NOTE_OFF) {
+				if (skip_off[key] && e.pos == seg->src0) {
+					skip_off[key] = false;
+					continue;
+				}
+				sounding[key] = 0;
+			} else {
+				const int slot = state_slot(&e);
+				if (slot >= 0) {
+					emitted[slot] = e;
+					have_emitted[slot] = true;
+				}
+			}
+			e.pos += shift;
+			arrput(out, e);
+		}
+
+		const bool closed = seg->src1 != INT_MAX && (si == n_segs-1 || !splice_continues(seg, &segs[si+1]));
+		if (closed && track_notes) {
+			const int end = seg->dst + (seg->src1 - seg->src0);
+			for (int key = 0; key < N_NOTES; key++) {
+				if (!sounding[key]) continue;
+				arrput(out, ((struct mev) { .pos = end, .b = {NOTE_OFF, (uint8_t)key, 0} }));
+				sounding[key] = 0;
+			}
+		}
+	}
+
+	assert(arrlen(out) <= cap);
+	arrfree(trk->mev_arr);
+	trk->mev_arr = out;
+}
+
+// splices tracks selected by track_mask (NULL: all tracks) and, if
+// include_time_track, the time track. end_of_song_pos becomes new_end, or
+// the last event if that's later
+static void mid_splice(struct mid* mid, const struct splice_seg* segs, int n_segs, const bool* track_mask, bool include_time_track, int new_end)
+{
+	if (include_time_track) trk_splice(mid_get_time_track(mid), segs, n_segs);
+	const int n_tracks = mid_get_track_count(mid);
+	for (int i = 0; i < n_tracks; i++) {
+		if (track_mask != NULL && !track_mask[i]) continue;
+		trk_splice(mid_get_trk(mid, i), segs, n_segs);
+	}
+	int end = new_end;
+	for (int i = 0; i < arrlen(mid->_trk_arr); i++) {
+		struct trk* trk = &mid->_trk_arr[i];
+		const int n = arrlen(trk->mev_arr);
+		if (n > 0 && trk->mev_arr[n-1].pos > end) end = trk->mev_arr[n-1].pos;
+	}
+	mid->end_of_song_pos = end;
+	mid->revision++;
+}
+
+static bool is_whole_song(const bool* track_mask, bool include_time_track)
+{
+	return track_mask == NULL && include_time_track;
+}
+
+void mid_delete_range(struct mid* mid, union timespan ts, const bool* track_mask, bool include_time_track)
+{
+	const int a = ts.start, b = ts.end;
+	if (!(0 <= a && a < b)) return;
+	const struct splice_seg segs[] = {
+		{ 0, a,       0 },
+		{ b, INT_MAX, a },
+	};
+	int end = mid->end_of_song_pos;
+	if (is_whole_song(track_mask, include_time_track)) {
+		end = end <= a ? end : end <= b ? a : end - (b-a);
+	}
+	mid_splice(mid, segs, ARRAY_LENGTH(segs), track_mask, include_time_track, end);
+}
+
+void mid_duplicate_range(struct mid* mid, union timespan ts, const bool* track_mask, bool include_time_track)
+{
+	const int a = ts.start, b = ts.end;
+	if (!(0 <= a && a < b)) return;
+	const struct splice_seg segs[] = {
+		{ 0, b,       0       },
+		{ a, b,       b       },
+		{ b, INT_MAX, b+(b-a) },
+	};
+	int end = mid->end_of_song_pos;
+	if (is_whole_song(track_mask, include_time_track) && end > a) end += b-a;
+	mid_splice(mid, segs, ARRAY_LENGTH(segs), track_mask, include_time_track, end);
+}
+
+void mid_crop(struct mid* mid, union timespan ts, bool crop_start, bool crop_end)
+{
+	const int a = crop_start ? ts.start : 0;
+	const int b = crop_end ? ts.end : INT_MAX;
+	if (!(0 <= a && a < b)) return;
+	const struct splice_seg seg = { a, b, 0 };
+	int end = mid->end_of_song_pos;
+	if (b < end) end = b;
+	end = end > a ? end - a : 0;
+	mid_splice(mid, &seg, 1, NULL, true, end);
+}
+
+static bool ctrl_match(int ctrl, int want)
+{
+	return ctrl >= 0 && (want == CTRL_ALL || ctrl == want);
+}
+
+void mid_count_controllers(struct mid* mid, union timespan ts, const bool* track_mask, int* counts)
+{
+	memset(counts, 0, N_CTRLS * sizeof counts[0]);
+	const int n_tracks = mid_get_track_count(mid);
+	for (int ti = 0; ti < n_tracks; ti++) {
+		if (track_mask != NULL && !track_mask[ti]) continue;
+		struct trk* trk = mid_get_trk(mid, ti);
+		const int n = arrlen(trk->mev_arr);
+		for (int i = mev_lower_bound(trk->mev_arr, n, ts.start); i < n; i++) {
+			struct mev* mev = &trk->mev_arr[i];
+			if (mev->pos >= ts.end) break;
+			const int ctrl = mev_ctrl(mev);
+			if (ctrl >= 0) counts[ctrl]++;
+		}
+	}
+}
+
+static int trk_delete_controllers(struct trk* trk, union timespan ts, int want, int end_of_song_pos)
+{
+	const int n = arrlen(trk->mev_arr);
+	const int i0 = mev_lower_bound(trk->mev_arr, n, ts.start);
+	const int i1 = mev_lower_bound(trk->mev_arr, n, ts.end);
+
+	// value before the range, and the last deleted one; if they differ,
+	// the last deleted value is restored at ts.end so that only the range
+	// changes
+	struct mev* before[N_CTRLS] = {0};
+	struct mev restore[N_CTRLS];
+	bool deleted[N_CTRLS] = {0};
+	for (int i = 0; i < i0; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		const int ctrl = mev_ctrl(mev);
+		if (ctrl_match(ctrl, want)) before[ctrl] = mev;
+	}
+
+	int n_deleted = 0, w = i0;
+	for (int i = i0; i < i1; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		const int ctrl = mev_ctrl(mev);
+		if (ctrl_match(ctrl, want)) {
+			restore[ctrl] = *mev;
+			deleted[ctrl] = true;
+			n_deleted++;
+		} else {
+			trk->mev_arr[w++] = *mev;
+		}
+	}
+	if (n_deleted == 0) return 0;
+
+	struct mev* ins_arr = NULL;
+	if (ts.end < end_of_song_pos) {
+		for (int i = i1; i < n; i++) {
+			// an event at ts.end already sets the value
+			struct mev* mev = &trk->mev_arr[i];
+			if (mev->pos > ts.end) break;
+			const int ctrl = mev_ctrl(mev);
+			if (ctrl >= 0) deleted[ctrl] = false;
+		}
+		for (int ctrl = 0; ctrl < N_CTRLS; ctrl++) {
+			if (!deleted[ctrl]) continue;
+			struct mev* b = before[ctrl];
+			if (b != NULL && memcmp(b->b, restore[ctrl].b, sizeof b->b) == 0) continue;
+			restore[ctrl].pos = ts.end;
+			arrput(ins_arr, restore[ctrl]);
+		}
+	}
+
+	// the restores go in by rank: after NOTE OFFs at ts.end, before NOTE ONs
+	memmove(&trk->mev_arr[w], &trk->mev_arr[i1], (n - i1) * sizeof trk->mev_arr[0]);
+	arrsetlen(trk->mev_arr, w + (n - i1));
+	mev_merge(&trk->mev_arr, ins_arr, arrlen(ins_arr));
+	arrfree(ins_arr);
+	return n_deleted;
+}
+
+int mid_delete_controllers(struct mid* mid, union timespan ts, const bool* track_mask, int ctrl)
+{
+	if (!(0 <= ts.start && ts.start < ts.end)) return 0;
+	int n_deleted = 0;
+	const int n_tracks = mid_get_track_count(mid);
+	for (int i = 0; i < n_tracks; i++) {
+		if (track_mask != NULL && !track_mask[i]) continue;
+		n_deleted += trk_delete_controllers(mid_get_trk(mid, i), ts, ctrl, mid->end_of_song_pos);
+	}
+	if (n_deleted > 0) mid->revision++;
+	return n_deleted;
+}
+
+// CC 120-127 are channel mode messages (e.g. reset all controllers), never
+// redundant. CTRL_ALL only thins controllers with continuous values
+static bool ctrl_thinnable(int ctrl, int want)
+{
+	if (!ctrl_match(ctrl, want)) return false;
+	if (120 <= ctrl && ctrl < N_NOTES) return false;
+	if (want != CTRL_ALL) return true;
+	switch (ctrl) {
+	case MODULATION_WHEEL:
+	case VOLUME:
+	case PAN:
+	case EFFECT1_DEPTH:
+	case EFFECT3_DEPTH:
+	case CTRL_PITCH_BEND:
+	case CTRL_AFTERTOUCH:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int trk_thin_controllers(struct trk* trk, union timespan ts, int want, float tolerance)
+{
+	const int n = arrlen(trk->mev_arr);
+	const int i0 = mev_lower_bound(trk->mev_arr, n, ts.start);
+	const int i1 = mev_lower_bound(trk->mev_arr, n, ts.end);
+
+	// the last event of each controller in the range is always kept, so the
+	// value after the range is exact
+	int last[N_CTRLS];
+	for (int ctrl = 0; ctrl < N_CTRLS; ctrl++) last[ctrl] = -1;
+	for (int i = i0; i < i1; i++) {
+		const int ctrl = mev_ctrl(&trk->mev_arr[i]);
+		if (ctrl_thinnable(ctrl, want)) last[ctrl] = i;
+	}
+
+	float kept[N_CTRLS];
+	bool have_kept[N_CTRLS] = {0};
+	for (int i = 0; i < i0; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		const int ctrl = mev_ctrl(mev);
+		if (!ctrl_thinnable(ctrl, want)) continue;
+		kept[ctrl] = mev_ctrl_value(mev);
+		have_kept[ctrl] = true;
+	}
+
+	int w = i0;
+	for (int i = i0; i < i1; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		const int ctrl = mev_ctrl(mev);
+		if (ctrl_thinnable(ctrl, want) && i != last[ctrl]) {
+			const float v = mev_ctrl_value(mev);
+			if (have_kept[ctrl] && fabsf(v - kept[ctrl]) <= tolerance) continue;
+			kept[ctrl] = v;
+			have_kept[ctrl] = true;
+		}
+		trk->mev_arr[w++] = *mev;
+	}
+	const int n_removed = i1 - w;
+	if (n_removed == 0) return 0;
+	memmove(&trk->mev_arr[w], &trk->mev_arr[i1], (n - i1) * sizeof trk->mev_arr[0]);
+	arrsetlen(trk->mev_arr, n - n_removed);
+	return n_removed;
+}
+
+int mid_thin_controllers(struct mid* mid, union timespan ts, const bool* track_mask, int ctrl, float tolerance)
+{
+	if (!(0 <= ts.start && ts.start < ts.end)) return 0;
+	int n_removed = 0;
+	const int n_tracks = mid_get_track_count(mid);
+	for (int i = 0; i < n_tracks; i++) {
+		if (track_mask != NULL && !track_mask[i]) continue;
+		n_removed += trk_thin_controllers(mid_get_trk(mid, i), ts, ctrl, tolerance);
+	}
+	if (n_removed > 0) mid->revision++;
+	return n_removed;
+}
+
+static int mev_us_per_qn(struct mev* mev)
+{
+	return ((int)mev->b[1] << 16) + ((int)mev->b[2] << 8) + (int)mev->b[3];
+}
+
+// denominator_log2 comes straight from the file (0-255)
+#define MAX_DENOMINATOR_LOG2 (7)
+
+static int grid_len(int division, int denominator_log2)
+{
+	if (denominator_log2 < 0) denominator_log2 = 0;
+	if (denominator_log2 > MAX_DENOMINATOR_LOG2) denominator_log2 = MAX_DENOMINATOR_LOG2;
+	const int shift = 2 - denominator_log2;
+	const int64_t len = shift >= 0 ? (int64_t)division * (1 << shift) : division / (1 << -shift);
+	if (len < 1) return 1;
+	if (len > INT_MAX) return INT_MAX;
+	return (int)len;
+}
+
+static struct tempo_grid tempo_grid_init(int division)
+{
+	struct tempo_grid g = {0};
+	g.numerator = 4;
+	g.denominator_log2 = 2;
+	g.us_per_qn = DEFAULT_US_PER_QN;
+	g.len = grid_len(division, g.denominator_log2);
+	return g;
+}
+
+void tempo_grid_step(struct tempo_grid* g)
+{
+	g->pos += g->len;
+	g->beat = (g->beat + 1) % g->numerator;
+	if (g->beat == 0) g->bar++;
+}
+
+static void tempo_grid_advance(struct tempo_grid* g, int n)
+{
+	if (n <= 0) return;
+	g->pos += n * g->len;
+	const int beats = g->beat + n;
+	g->bar += beats / g->numerator;
+	g->beat = beats % g->numerator;
+}
+
+void tempo_grid_apply(struct tempo_grid* g, struct mev* mev, int division)
+{
+	switch (mev->b[0]) {
+	case TIME_SIGNATURE:
+		g->numerator = mev->b[1] > 0 ? mev->b[1] : 1;
+		g->denominator_log2 = mev->b[2] <= MAX_DENOMINATOR_LOG2 ? mev->b[2] : MAX_DENOMINATOR_LOG2;
+		g->len = grid_len(division, g->denominator_log2);
+		// a signature change starts a new bar
+		if (g->beat != 0) {
+			g->bar++;
+			g->beat = 0;
+		}
+		break;
+	case SET_TEMPO:
+		g->us_per_qn = mev_us_per_qn(mev);
+		break;
+	default: assert(!"unhandled time track event");
+	}
+}
+
+void tempo_map_update(struct tempo_map* tm, struct mid* mid)
+{
+	if (tm->division == mid->division && tm->revision == mid->revision) return;
+	tm->division = mid->division;
+	tm->revision = mid->revision;
+	arrsetlen(tm->mark_arr, 0);
+
+	struct trk* trk = mid_get_time_track(mid);
+	const int n = arrlen(trk->mev_arr);
+	struct tempo_grid g = tempo_grid_init(mid->division);
+	double usec = 0.0;
+	int usec_pos = 0;
+	int us_per_qn = DEFAULT_US_PER_QN;
+	for (int i = 0; i < n; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		usec += (double)(mev->pos - usec_pos) * (double)us_per_qn / (double)mid->division;
+		usec_pos = mev->pos;
+		if (mev->b[0] == SET_TEMPO) us_per_qn = mev_us_per_qn(mev);
+
+		// events take effect on the grid at the first grid tick at or
+		// after them
+		if (mev->pos > g.pos) tempo_grid_advance(&g, (mev->pos - g.pos + g.len - 1) / g.len);
+		tempo_grid_apply(&g, mev, mid->division);
+
+		arrput(tm->mark_arr, ((struct tempo_mark) {
+			.pos = mev->pos,
+			.us_per_qn = us_per_qn,
+			.usec = usec,
+			.grid = g,
+		}));
+	}
+}
+
+void tempo_map_free(struct tempo_map* tm)
+{
+	arrfree(tm->mark_arr);
+	memset(tm, 0, sizeof *tm);
+}
+
+double tempo_map_seconds(const struct tempo_map* tm, double pos)
+{
+	// last mark at or before pos
+	int lo = 0, hi = arrlen(tm->mark_arr);
+	while (lo < hi) {
+		const int mid = lo + (hi-lo)/2;
+		if (tm->mark_arr[mid].pos <= pos) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return pos * (double)DEFAULT_US_PER_QN / (double)tm->division * 1e-6;
+	const struct tempo_mark* m = &tm->mark_arr[lo-1];
+	return (m->usec + (pos - m->pos) * (double)m->us_per_qn / (double)tm->division) * 1e-6;
+}
+
+double tempo_map_pos(const struct tempo_map* tm, double seconds)
+{
+	const double usec = seconds * 1e6;
+	int lo = 0, hi = arrlen(tm->mark_arr);
+	while (lo < hi) {
+		const int mid = lo + (hi-lo)/2;
+		if (tm->mark_arr[mid].usec <= usec) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return usec * (double)tm->division / (double)DEFAULT_US_PER_QN;
+	const struct tempo_mark* m = &tm->mark_arr[lo-1];
+	return m->pos + (usec - m->usec) * (double)tm->division / (double)m->us_per_qn;
+}
+
+int tempo_map_grid_at(const struct tempo_map* tm, int pos, struct tempo_grid* out)
+{
+	// first mark on the grid at or after pos; everything before it has
+	// been applied
+	int lo = 0, hi = arrlen(tm->mark_arr);
+	while (lo < hi) {
+		const int mid = lo + (hi-lo)/2;
+		if (tm->mark_arr[mid].grid.pos < pos) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	struct tempo_grid g = lo > 0 ? tm->mark_arr[lo-1].grid : tempo_grid_init(tm->division);
+	if (pos > g.pos) tempo_grid_advance(&g, (pos - g.pos) / g.len);
+	*out = g;
+	return lo;
+}
+
+void tempo_map_beat_at(const struct tempo_map* tm, struct mid* mid, int pos, struct tempo_grid* out)
+{
+	struct trk* timetrk = mid_get_time_track(mid);
+	const int n = arrlen(timetrk->mev_arr);
+	for (int i = tempo_map_grid_at(tm, pos, out); i < n && timetrk->mev_arr[i].pos <= out->pos; i++) {
+		tempo_grid_apply(out, &timetrk->mev_arr[i], tm->division);
+	}
+}
+
+// sets a time track value (tempo or signature) from ts.start; for a range,
+// the value in effect at ts.end is restored there, and changes of the same
+// kind inside the range are removed
+static void time_track_set(struct mid* mid, union timespan ts, struct mev set)
+{
+	struct trk* trk = mid_get_time_track(mid);
+	const uint8_t b0 = set.b[0];
+	const bool range = ts.end > ts.start;
+	const int n = arrlen(trk->mev_arr);
+	const int i0 = mev_lower_bound(trk->mev_arr, n, ts.start);
+	const int i1 = range ? mev_lower_bound(trk->mev_arr, n, ts.end) : i0;
+
+	struct mev restore = {0};
+	restore.b[0] = b0;
+	if (b0 == SET_TEMPO) {
+		restore.b[1] = (DEFAULT_US_PER_QN >> 16) & 0xff;
+		restore.b[2] = (DEFAULT_US_PER_QN >> 8) & 0xff;
+		restore.b[3] = DEFAULT_US_PER_QN & 0xff;
+	} else {
+		restore.b[1] = 4;
+		restore.b[2] = 2;
+	}
+	bool restore_needed = range && ts.end < mid->end_of_song_pos;
+	for (int i = 0; i < i1; i++) {
+		if (trk->mev_arr[i].b[0] == b0) restore = trk->mev_arr[i];
+	}
+	for (int i = i1; i < n && trk->mev_arr[i].pos == ts.end; i++) {
+		if (trk->mev_arr[i].b[0] == b0) restore_needed = false;
+	}
+	if (memcmp(restore.b, set.b, sizeof set.b) == 0) restore_needed = false;
+	restore.pos = ts.end;
+
+	// drop changes in [start,end), or at start if there's no range
+	int w = i0;
+	for (int i = i0; i < n; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		const bool inside = range ? i < i1 : mev->pos == ts.start;
+		if (inside && mev->b[0] == b0) continue;
+		trk->mev_arr[w++] = *mev;
+	}
+	arrsetlen(trk->mev_arr, w);
+
+	set.pos = ts.start;
+	arrins(trk->mev_arr, mev_lower_bound(trk->mev_arr, w, ts.start), set);
+	if (restore_needed) {
+		arrins(trk->mev_arr, mev_lower_bound(trk->mev_arr, w+1, ts.end), restore);
+	}
+	mid->revision++;
+}
+
+void mid_set_tempo(struct mid* mid, union timespan ts, int us_per_qn)
+{
+	assert(0 < us_per_qn && us_per_qn < (1<<24));
+	struct mev set = {0};
+	set.b[0] = SET_TEMPO;
+	set.b[1] = (us_per_qn >> 16) & 0xff;
+	set.b[2] = (us_per_qn >> 8) & 0xff;
+	set.b[3] = us_per_qn & 0xff;
+	time_track_set(mid, ts, set);
+}
+
+void mid_set_time_signature(struct mid* mid, union timespan ts, int numerator, int denominator_log2)
+{
+	assert(0 < numerator && numerator < 256);
+	assert(0 <= denominator_log2 && denominator_log2 <= MAX_DENOMINATOR_LOG2);
+	struct mev set = {0};
+	set.b[0] = TIME_SIGNATURE;
+	set.b[1] = numerator;
+	set.b[2] = denominator_log2;
+	time_track_set(mid, ts, set);
+}
+
+static void chase_state_init(struct chase_state* cs)
+{
+	for (int i = 0; i < 16; i++) {
+		struct chase_channel* c = &cs->ch[i];
+		c->program = CHASE_UNSET;
+		c->pitch_bend = CHASE_UNSET;
+		c->pressure = CHASE_UNSET;
+		memset(c->cc, CHASE_UNSET, sizeof c->cc);
+	}
+}
+
+static void chase_state_apply(struct chase_state* cs, const uint8_t* b)
+{
+	struct chase_channel* c = &cs->ch[b[0] & 0xf];
+	switch (b[0] & 0xf0) {
+	case CONTROL_CHANGE:
+		if (b[1] == RESET_ALL_CONTROLLERS) {
+			// what it resets (RP-015) is back to unset; the chase starts
+			// with a reset, so unset means the synth's default
+			static const uint8_t reset[] = { MODULATION_WHEEL, 11, DAMPER_PEDAL, 65, 66, 67, 98, 99, 100, 101 };
+			for (int i = 0; i < ARRAY_LENGTH(reset); i++) c->cc[reset[i]] = CHASE_UNSET;
+			c->pitch_bend = CHASE_UNSET;
+			c->pressure = CHASE_UNSET;
+		} else if (b[1] < 120) {
+			// 120-127 are channel mode messages, not state
+			c->cc[b[1]] = b[2];
+		}
+		break;
+	case PROGRAM_CHANGE:     c->program = b[1]; break;
+	case CHANNEL_AFTERTOUCH: c->pressure = b[1]; break;
+	case PITCH_BEND:         c->pitch_bend = b[1] + (b[2] << 7); break;
+	default: assert(!"not a chased event");
+	}
+}
+
+struct chase_sort_event {
+	struct chase_event e;
+	int seq; // tie breaker; keeps qsort() stable
+};
+
+static int chase_sort_event_compar(const void* va, const void* vb)
+{
+	const struct chase_sort_event* a = (const struct chase_sort_event*)va;
+	const struct chase_sort_event* b = (const struct chase_sort_event*)vb;
+	if (a->e.pos != b->e.pos) return a->e.pos - b->e.pos;
+	return a->seq - b->seq;
+}
+
+void chase_index_update(struct chase_index* ci, struct mid* mid)
+{
+	if (ci->built && ci->revision == mid->revision) return;
+	ci->built = true;
+	ci->revision = mid->revision;
+	arrsetlen(ci->event_arr, 0);
+	arrsetlen(ci->checkpoint_arr, 0);
+
+	struct chase_sort_event* sort_arr = NULL;
+	const int n_tracks = mid_get_track_count(mid);
+	for (int i = 0; i < n_tracks; i++) {
+		struct trk* trk = mid_get_trk(mid, i);
+		if (trk->midi_channel < 0) continue;
+		const int n = arrlen(trk->mev_arr);
+		for (int j = 0; j < n; j++) {
+			struct mev* mev = &trk->mev_arr[j];
+			switch (mev->b[0]) {
+			case CONTROL_CHANGE:
+			case PROGRAM_CHANGE:
+			case CHANNEL_AFTERTOUCH:
+			case PITCH_BEND:
+				break;
+			default:
+				continue;
+			}
+			struct chase_sort_event se;
+			se.e.pos = mev->pos;
+			se.e.b[0] = mev->b[0] | trk->midi_channel;
+			se.e.b[1] = mev->b[1];
+			se.e.b[2] = mev->b[2];
+			se.seq = arrlen(sort_arr);
+			arrput(sort_arr, se);
+		}
+	}
+	const int n = arrlen(sort_arr);
+	if (n > 0) qsort(sort_arr, n, sizeof *sort_arr, chase_sort_event_compar);
+	arrsetlen(ci->event_arr, n);
+	for (int i = 0; i < n; i++) ci->event_arr[i] = sort_arr[i].e;
+	arrfree(sort_arr);
+
+	// a checkpoint goes on the first event with a new pos after every
+	// CHASE_INTERVAL events
+	struct chase_checkpoint cp;
+	cp.pos = INT_MIN;
+	cp.event_index = 0;
+	chase_state_init(&cp.state);
+	arrput(ci->checkpoint_arr, cp);
+	int last = 0;
+	for (int i = 0; i < n; i++) {
+		struct chase_event* e = &ci->event_arr[i];
+		if (i - last >= CHASE_INTERVAL && e->pos > cp.pos) {
+			cp.pos = e->pos;
+			cp.event_index = i;
+			arrput(ci->checkpoint_arr, cp);
+			last = i;
+		}
+		chase_state_apply(&cp.state, e->b);
+	}
+}
+
+void chase_index_free(struct chase_index* ci)
+{
+	arrfree(ci->event_arr);
+	arrfree(ci->checkpoint_arr);
+	memset(ci, 0, sizeof *ci);
+}
+
+void chase_index_get(const struct chase_index* ci, int pos, struct chase_state* out)
+{
+	assert(ci->built);
+	// last checkpoint at or before pos; the first one is at INT_MIN
+	int lo = 0, hi = arrlen(ci->checkpoint_arr);
+	while (lo < hi) {
+		const int mid = lo + (hi-lo)/2;
+		if (ci->checkpoint_arr[mid].pos <= pos) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	assert(lo > 0);
+	const struct chase_checkpoint* cp = &ci->checkpoint_arr[lo-1];
+	*out = cp->state;
+	const int n = arrlen(ci->event_arr);
+	for (int i = cp->event_index; i < n; i++) {
+		const struct chase_event* e = &ci->event_arr[i];
+		if (e->pos >= pos) break;
+		chase_state_apply(out, e->b);
+	}
+}
+
+int chase_channel_messages(const struct chase_channel* c, int ch, uint8_t (*out)[3])
+{
+	int n = 0;
+	#define MSG(B0,B1,B2) { out[n][0] = (B0) | ch; out[n][1] = (B1); out[n][2] = (B2); n++; }
+	#define CC(I,DEFAULT) { const int v = c->cc[I] != CHASE_UNSET ? c->cc[I] : (DEFAULT); if (v >= 0) MSG(CONTROL_CHANGE, I, v); }
+	MSG(CONTROL_CHANGE, 121, 0); // reset all controllers
+	CC(0, 0);  // bank select
+	CC(32, 0);
+	MSG(PROGRAM_CHANGE, c->program != CHASE_UNSET ? c->program : 0, 0);
+	// parameter number, then data entry; only the last selected
+	// parameter is restored
+	CC(99, -1); CC(98, -1);
+	CC(101, -1); CC(100, -1);
+	CC(6, -1); CC(38, -1);
+	for (int i = 1; i < 120; i++) {
+		switch (i) {
+		case 6: case 32: case 38:
+		case 96: case 97: // data increment/decrement
+		case 98: case 99: case 100: case 101:
+			continue;
+		}
+		CC(i, i == 7 ? 100 : i == 10 ? 64 : -1);
+	}
+	// 120-127 are channel mode messages, not state
+	if (c->pitch_bend != CHASE_UNSET) MSG(PITCH_BEND, c->pitch_bend & 0x7f, c->pitch_bend >> 7);
+	if (c->pressure != CHASE_UNSET) MSG(CHANNEL_AFTERTOUCH, c->pressure, 0);
+	#undef CC
+	#undef MSG
+	assert(n <= CHASE_MAX_MESSAGES);
+	return n;
+}
+
+void note_index_free(struct note_index* ni)
+{
+	for (int key = 0; key < N_NOTES; key++) arrfree(ni->key_arr[key]);
+	memset(ni, 0, sizeof *ni);
+}
+
+void note_index_build(struct note_index* ni, struct trk* trk, int end_of_song_pos)
+{
+	for (int key = 0; key < N_NOTES; key++) arrsetlen(ni->key_arr[key], 0);
+	// index of the open span per key, or -1
+	int open[N_NOTES];
+	for (int key = 0; key < N_NOTES; key++) open[key] = -1;
+	const int n = arrlen(trk->mev_arr);
+	for (int i = 0; i < n; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		const uint8_t b0 = mev->b[0];
+		if (b0 != NOTE_ON && b0 != NOTE_OFF) continue;
+		const int key = mev->b[1];
+		if (open[key] >= 0) {
+			ni->key_arr[key][open[key]].end = mev->pos;
+			open[key] = -1;
+		}
+		if (b0 != NOTE_ON) continue;
+		if (trk->percussive) {
+			arrput(ni->key_arr[key], ((struct note_span) { .start = mev->pos, .end = mev->pos+1 }));
+		} else {
+			open[key] = arrlen(ni->key_arr[key]);
+			arrput(ni->key_arr[key], ((struct note_span) { .start = mev->pos, .end = end_of_song_pos }));
+		}
+	}
+	ni->built = true;
+}
+
+// first span in a key ending after pos
+static int span_lower_bound(struct note_span* span_arr, int pos)
+{
+	int lo = 0, hi = arrlen(span_arr);
+	while (lo < hi) {
+		const int mid = lo + (hi-lo)/2;
+		if (span_arr[mid].end <= pos) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+int note_index_find(const struct note_index* ni, int key, int pos)
+{
+	if (!(0 <= key && key < N_NOTES)) return -1;
+	struct note_span* span_arr = ni->key_arr[key];
+	const int i = span_lower_bound(span_arr, pos);
+	if (i < arrlen(span_arr) && span_arr[i].start <= pos) return i;
+	return -1;
+}
+
+bool note_index_fit(const struct note_index* ni, int key, int start, int* end)
+{
+	if (!(0 <= key && key < N_NOTES)) return false;
+	struct note_span* span_arr = ni->key_arr[key];
+	const int i = span_lower_bound(span_arr, start);
+	if (i >= arrlen(span_arr)) return true;
+	// spans don't overlap, so this is the first one starting after start
+	if (span_arr[i].start <= start) return false;
+	if (span_arr[i].start < *end) *end = span_arr[i].start;
+	return true;
+}
+
+void note_index_query(const struct note_index* ni, int key0, int key1, int pos0, int pos1, struct note_hit** hit_arr)
+{
+	if (key0 < 0) key0 = 0;
+	if (key1 > N_NOTES-1) key1 = N_NOTES-1;
+	for (int key = key0; key <= key1; key++) {
+		struct note_span* span_arr = ni->key_arr[key];
+		const int n = arrlen(span_arr);
+		for (int i = span_lower_bound(span_arr, pos0); i < n && span_arr[i].start <= pos1; i++) {
+			arrput(*hit_arr, ((struct note_hit) {
+				.key = key,
+				.start = span_arr[i].start,
+				.end = span_arr[i].end,
+			}));
+		}
+	}
+}
+
+void note_index_insert(struct note_index* ni, int key, int start, int end)
+{
+	assert(0 <= key && key < N_NOTES);
+	assert(start < end);
+	struct note_span** span_arr = &ni->key_arr[key];
+	int i = span_lower_bound(*span_arr, start);
+	const int n = arrlen(*span_arr);
+	// the new NOTE ON ends a span it starts in, and the next NOTE ON ends
+	// the new span
+	if (i < n && (*span_arr)[i].start < start) (*span_arr)[i++].end = start;
+	if (i < n && (*span_arr)[i].start < end) end = (*span_arr)[i].start;
+	arrins(*span_arr, i, ((struct note_span) { .start = start, .end = end }));
+}
+
+void note_index_remove(struct note_index* ni, int key, int start)
+{
+	assert(0 <= key && key < N_NOTES);
+	struct note_span* span_arr = ni->key_arr[key];
+	const int i = note_index_find(ni, key, start);
+	if (i >= 0 && span_arr[i].start == start) arrdel(ni->key_arr[key], i);
+}
+
+int trk_find_note_on(struct trk* trk, int key, int pos)
+{
+	const int n = arrlen(trk->mev_arr);
+	for (int i = mev_lower_bound(trk->mev_arr, n, pos); i < n; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		if (mev->pos != pos) break;
+		if (mev->b[0] == NOTE_ON && mev->b[1] == key) return i;
+	}
+	return -1;
+}
+
+void mid_insert_notes(struct mid* mid, int track_index, const struct new_note* notes, int n)
+{
+	if (n <= 0) return;
+	struct trk* trk = mid_get_trk(mid, track_index);
+
+	// percussive tracks have no NOTE OFFs (that's how they're told apart
+	// on load)
+	const int n_add = trk->percussive ? n : 2*n;
+	struct mev* add = (struct mev*)malloc(n_add * sizeof *add);
+	int k = 0;
+	for (int i = 0; i < n; i++) {
+		const struct new_note* nn = &notes[i];
+		assert(0 <= nn->start && nn->start < nn->end);
+		assert(nn->key < N_NOTES && 0 < nn->velocity && nn->velocity < 128);
+		add[k++] = ((struct mev) { .pos = nn->start, .b = {NOTE_ON, nn->key, nn->velocity} });
+		if (!trk->percussive) add[k++] = ((struct mev) { .pos = nn->end, .b = {NOTE_OFF, nn->key, 0} });
+		if (nn->end > mid->end_of_song_pos) mid->end_of_song_pos = nn->end;
+	}
+	assert(k == n_add);
+	qsort(add, n_add, sizeof *add, mev_order_cmp);
+	mev_merge(&trk->mev_arr, add, n_add);
+	free(add);
+	mid->revision++;
+}
+
+static int int_cmp(const void* va, const void* vb)
+{
+	const int a = *(const int*)va;
+	const int b = *(const int*)vb;
+	return (a > b) - (a < b);
+}
+
+void mid_delete_notes(struct mid* mid, int track_index, const struct note_hit* hits, int n)
+{
+	struct trk* trk = mid_get_trk(mid, track_index);
+	const int n_mev = arrlen(trk->mev_arr);
+	int* drop_arr = NULL;
+	for (int h = 0; h < n; h++) {
+		const struct note_hit* hit = &hits[h];
+		const int i_on = trk_find_note_on(trk, hit->key, hit->start);
+		if (i_on < 0) continue;
+		arrput(drop_arr, i_on);
+		// the NOTE OFF ending it, if the note isn't ended by a re-trigger
+		// or the end of the song
+		for (int i = mev_lower_bound(trk->mev_arr, n_mev, hit->end); i < n_mev && trk->mev_arr[i].pos == hit->end; i++) {
+			struct mev* mev = &trk->mev_arr[i];
+			if (mev->b[0] == NOTE_OFF && mev->b[1] == hit->key) {
+				arrput(drop_arr, i);
+				break;
+			}
+		}
+	}
+	const int n_drop = arrlen(drop_arr);
+	if (n_drop == 0) {
+		arrfree(drop_arr);
+		return;
+	}
+	qsort(drop_arr, n_drop, sizeof drop_arr[0], int_cmp);
+	int w = drop_arr[0], d = 0;
+	for (int i = drop_arr[0]; i < n_mev; i++) {
+		if (d < n_drop && drop_arr[d] == i) {
+			while (d < n_drop && drop_arr[d] == i) d++;
+			continue;
+		}
+		trk->mev_arr[w++] = trk->mev_arr[i];
+	}
+	arrsetlen(trk->mev_arr, w);
+	arrfree(drop_arr);
+	mid->revision++;
+}
+
+// controller event setting value (0..127 units)
+static struct mev ctrl_mev(int pos, int ctrl, float value)
+{
+	if (ctrl == CTRL_PITCH_BEND) {
+		int v = (int)lroundf(value * 128.0f);
+		if (v < 0) v = 0;
+		if (v > 0x3fff) v = 0x3fff;
+		return (struct mev) { .pos = pos, .b = {PITCH_BEND, (uint8_t)(v & 0x7f), (uint8_t)(v >> 7)} };
+	}
+	int v = (int)lroundf(value);
+	if (v < 0) v = 0;
+	if (v > 127) v = 127;
+	if (ctrl == CTRL_AFTERTOUCH) {
+		return (struct mev) { .pos = pos, .b = {CHANNEL_AFTERTOUCH, (uint8_t)v} };
+	}
+	return (struct mev) { .pos = pos, .b = {CONTROL_CHANGE, (uint8_t)ctrl, (uint8_t)v} };
+}
+
+int mid_paint_controller(struct mid* mid, int track_index, int ctrl, const struct ctrl_point* points, int n, int resolution, float tolerance)
+{
+	assert(0 <= ctrl && ctrl < N_CTRLS);
+	if (n <= 0) return 0;
+	if (resolution < 1) resolution = 1;
+	struct trk* trk = mid_get_trk(mid, track_index);
+	const int p0 = points[0].pos;
+	const int p1 = points[n-1].pos;
+	assert(0 <= p0 && p0 <= p1 && p1 <= mid->end_of_song_pos);
+
+	// resample; a sample is only emitted when the held value would be off
+	// by more than tolerance
+	struct mev* add_arr = NULL;
+	float kept = 0;
+	int seg = 0;
+	for (int pos = p0;; pos += resolution) {
+		if (pos > p1) pos = p1;
+		while (seg < n-1 && points[seg+1].pos <= pos) seg++;
+		const struct ctrl_point* a = &points[seg];
+		const struct ctrl_point* b = &points[seg < n-1 ? seg+1 : seg];
+		const float t = b->pos > a->pos ? (float)(pos - a->pos) / (float)(b->pos - a->pos) : 0.0f;
+		struct mev mev = ctrl_mev(pos, ctrl, lerp(a->value, b->value, t));
+		const float v = mev_ctrl_value(&mev);
+		const bool last = pos == p1;
+		if (arrlen(add_arr) == 0 || fabsf(v - kept) > tolerance || (last && v != kept)) {
+			arrput(add_arr, mev);
+			kept = v;
+		}
+		if (last) break;
+	}
+
+	// the value in effect at p1 before painting is restored after it,
+	// unless something already sets it there
+	const int n_old = arrlen(trk->mev_arr);
+	const int restore_pos = p1 + 1;
+	struct mev* restore = NULL;
+	for (int i = 0; i < n_old && trk->mev_arr[i].pos <= restore_pos; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		if (mev_ctrl(mev) != ctrl) continue;
+		restore = mev->pos < restore_pos ? mev : NULL;
+		if (mev->pos == restore_pos) break;
+	}
+	struct mev* last = &add_arr[arrlen(add_arr)-1];
+	if (restore != NULL && restore_pos < mid->end_of_song_pos && memcmp(restore->b, last->b, sizeof last->b) != 0) {
+		struct mev r = *restore;
+		r.pos = restore_pos;
+		arrput(add_arr, r);
+	}
+
+	// one merge, dropping the old events in [p0;p1]
+	const int n_add = arrlen(add_arr);
+	struct mev* out = NULL;
+	arrsetcap(out, n_old + n_add);
+	int i = 0, j = 0;
+	while (i < n_old || j < n_add) {
+		if (i < n_old) {
+			struct mev* mev = &trk->mev_arr[i];
+			if (p0 <= mev->pos && mev->pos <= p1 && mev_ctrl(mev) == ctrl) {
+				i++;
+				continue;
+			}
+		}
+		const bool take_add = j < n_add && (i == n_old || mev_order_cmp(&add_arr[j], &trk->mev_arr[i]) < 0);
+		arrput(out, take_add ? add_arr[j++] : trk->mev_arr[i++]);
+	}
+	arrfree(add_arr);
+	arrfree(trk->mev_arr);
+	trk->mev_arr = out;
+	mid->revision++;
+	return n_add;
+}
+
+void vel_index_free(struct vel_index* vi)
+{
+	arrfree(vi->trk_arr);
+	arrfree(vi->mev_arr);
+	arrfree(vi->vel0_arr);
+	arrfree(vi->t_arr);
+	arrfree(vi->vel_arr);
+	memset(vi, 0, sizeof *vi);
+}
+
+void vel_index_build(struct vel_index* vi, struct mid* mid, union timespan ts, const bool* track_mask)
+{
+	arrsetlen(vi->trk_arr, 0);
+	arrsetlen(vi->mev_arr, 0);
+	arrsetlen(vi->vel0_arr, 0);
+	arrsetlen(vi->t_arr, 0);
+	const float span = ts.end > ts.start ? (float)(ts.end - ts.start) : 1.0f;
+	const int n_tracks = mid_get_track_count(mid);
+	for (int ti = 0; ti < n_tracks; ti++) {
+		if (track_mask != NULL && !track_mask[ti]) continue;
+		struct trk* trk = mid_get_trk(mid, ti);
+		const int n = arrlen(trk->mev_arr);
+		for (int i = mev_lower_bound(trk->mev_arr, n, ts.start); i < n; i++) {
+			struct mev* mev = &trk->mev_arr[i];
+			if (mev->pos >= ts.end) break;
+			if (mev->b[0] != NOTE_ON) continue;
+			arrput(vi->trk_arr, ti);
+			arrput(vi->mev_arr, i);
+			arrput(vi->vel0_arr, mev->b[2]);
+			arrput(vi->t_arr, (float)(mev->pos - ts.start) / span);
+		}
+	}
+	arrsetlen(vi->vel_arr, arrlen(vi->vel0_arr));
+	vi->timespan = ts;
+	vi->revision = mid->revision;
+}
+
+void vel_index_commit(struct vel_index* vi)
+{
+	const int n = arrlen(vi->vel_arr);
+	memcpy(vi->vel0_arr, vi->vel_arr, n);
+}
+
+static inline uint32_t hash32(uint32_t x)
+{
+	// "lowbias32" by Chris Wellons
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline uint8_t vel_clamp(float v)
+{
+	// clamped as int; float compares don't vectorise without -ffast-math.
+	// vel_index_apply() bounds its parameters so v fits an int
+	int i = (int)(v + 0.5f);
+	i = i < 1 ? 1 : i;
+	i = i > 127 ? 127 : i;
+	return (uint8_t)i;
+}
+
+static inline float vel_param(float v, float lo, float hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+void vel_index_apply(struct vel_index* vi, struct mid* mid, const struct vel_params* p)
+{
+	const int n = arrlen(vi->vel0_arr);
+	const uint8_t* __restrict vel0 = vi->vel0_arr;
+	const float* __restrict t = vi->t_arr;
+	uint8_t* __restrict vel = vi->vel_arr;
+
+	// one branch-free loop per op so they vectorise (at -O3)
+	switch (p->op) {
+	case VEL_SCALE: {
+		const float factor = vel_param(p->factor, 0.0f, 16.0f);
+		for (int i = 0; i < n; i++) vel[i] = vel_clamp((float)vel0[i] * factor);
+	} break;
+	case VEL_OFFSET: {
+		const float offset = vel_param(p->offset, -255.0f, 255.0f);
+		for (int i = 0; i < n; i++) vel[i] = vel_clamp((float)vel0[i] + offset);
+	} break;
+	case VEL_COMPRESS: {
+		const float amount = vel_param(p->amount, 0.0f, 16.0f);
+		const float pivot = vel_param(p->pivot, 0.0f, 127.0f);
+		for (int i = 0; i < n; i++) vel[i] = vel_clamp(pivot + ((float)vel0[i] - pivot) * amount);
+	} break;
+	case VEL_RAMP_LINEAR: {
+		const float from = vel_param(p->from, 0.0f, 16.0f);
+		const float d = vel_param(p->to, 0.0f, 16.0f) - from;
+		for (int i = 0; i < n; i++) vel[i] = vel_clamp((float)vel0[i] * (from + d*t[i]));
+	} break;
+	case VEL_RAMP_EXP: {
+		// from*(to/from)^t; factors are kept away from 0 so that the
+		// ratio is defined. exp2f() keeps this loop scalar
+		const float from = vel_param(p->from, 0.01f, 16.0f);
+		const float to   = vel_param(p->to,   0.01f, 16.0f);
+		const float l = log2f(to / from);
+		for (int i = 0; i < n; i++) vel[i] = vel_clamp((float)vel0[i] * from * exp2f(l*t[i]));
+	} break;
+	case VEL_HUMANISE: {
+		// noise depends only on (seed, note), so changing jitter
+		// scales the same pattern
+		const float jitter = vel_param(p->jitter, 0.0f, 127.0f), k = jitter * (2.0f / 4294967295.0f);
+		const uint32_t seed = hash32(p->seed);
+		for (int i = 0; i < n; i++) {
+			const float r = (float)hash32(seed ^ ((uint32_t)i * 0x9e3779b9u)) * k - jitter;
+			vel[i] = vel_clamp((float)vel0[i] + r);
+		}
+	} break;
+	default: assert(!"unhandled velocity op");
+	}
+
+	for (int i = 0; i < n; i++) {
+		mid_get_trk(mid, vi->trk_arr[i])->mev_arr[vi->mev_arr[i]].b[2] = vel[i];
+	}
+	mid->revision++;
+	vi->revision = mid->revision;
+}
+
+static void mev_merge_sort(struct mev* a, int n)
+{
+	struct mev* tmp = (struct mev*)malloc(n * sizeof *tmp);
+	struct mev* src = a;
+	struct mev* dst = tmp;
+	for (int w = 1; w < n; w *= 2) {
+		for (int lo = 0; lo < n; lo += 2*w) {
+			const int m = lo+w < n ? lo+w : n;
+			const int hi = lo+2*w < n ? lo+2*w : n;
+			int i = lo, j = m, k = lo;
+			while (i < m && j < hi) dst[k++] = mev_order_cmp(&src[j], &src[i]) < 0 ? src[j++] : src[i++];
+			while (i < m) dst[k++] = src[i++];
+			while (j < hi) dst[k++] = src[j++];
+		}
+		struct mev* t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != a) memcpy(a, src, n * sizeof *a);
+	free(tmp);
+}
+
+// stable sort for nearly sorted events (each moved a little): insertion
+// sort is O(n + inversions). if the inversions run away it falls back to a
+// merge sort
+static void mev_sort_nearly(struct mev* a, int n)
+{
+	int64_t budget = 8*(int64_t)n + 1024;
+	for (int i = 1; i < n; i++) {
+		if (mev_order_cmp(&a[i-1], &a[i]) <= 0) continue;
+		const struct mev x = a[i];
+		int j = i;
+		while (j > 0 && mev_order_cmp(&a[j-1], &x) > 0) {
+			a[j] = a[j-1];
+			j--;
+		}
+		a[j] = x;
+		budget -= i - j;
+		if (budget < 0) {
+			mev_merge_sort(a, n);
+			return;
+		}
+	}
+}
+
+void quantize_index_free(struct quantize_index* qi)
+{
+	for (int i = 0; i < arrlen(qi->mev0_arr); i++) arrfree(qi->mev0_arr[i]);
+	arrfree(qi->mev0_arr);
+	arrfree(qi->trk_arr);
+	memset(qi, 0, sizeof *qi);
+}
+
+void quantize_index_build(struct quantize_index* qi, struct mid* mid, union timespan ts, const bool* track_mask)
+{
+	quantize_index_free(qi);
+	const int n_tracks = mid_get_track_count(mid);
+	for (int ti = 0; ti < n_tracks; ti++) {
+		if (track_mask != NULL && !track_mask[ti]) continue;
+		struct trk* trk = mid_get_trk(mid, ti);
+		const int n = arrlen(trk->mev_arr);
+		int n_notes = 0;
+		for (int i = mev_lower_bound(trk->mev_arr, n, ts.start); i < n; i++) {
+			struct mev* mev = &trk->mev_arr[i];
+			if (mev->pos >= ts.end) break;
+			if (mev->b[0] == NOTE_ON) n_notes++;
+		}
+		if (n_notes == 0) continue;
+		struct mev* mev0 = NULL;
+		arrsetlen(mev0, n);
+		memcpy(mev0, trk->mev_arr, n * sizeof *mev0);
+		arrput(qi->trk_arr, ti);
+		arrput(qi->mev0_arr, mev0);
+		qi->n_notes += n_notes;
+	}
+	qi->timespan = ts;
+	qi->revision = mid->revision;
+}
+
+struct quantizer {
+	const struct tempo_map* tm;
+	struct mid* mid;
+	const struct quantize_params* p;
+	struct tempo_grid g; // beat of the last lookup
+};
+
+static int quantize_pos(struct quantizer* q, int pos)
+{
+	struct tempo_grid* g = &q->g;
+	if (!(g->len > 0 && g->pos <= pos && pos < g->pos + g->len)) {
+		tempo_map_beat_at(q->tm, q->mid, pos, g);
+	}
+	const int grid_div = q->p->grid_div > 0 ? q->p->grid_div : 1;
+	const double step = (double)g->len / (double)grid_div;
+	const double off = pos - g->pos;
+	const int k0 = (int)floor(off / step);
+	double best = 0, best_d = 1e30;
+	for (int k = k0-1; k <= k0+1; k++) {
+		if (k < 0 || k > grid_div) continue;
+		double pt = k*step;
+		if (k == grid_div) {
+			pt = g->len; // next beat
+		} else if (k & 1) {
+			pt += q->p->swing * step * 0.5;
+		}
+		const double d = fabs(pt - off);
+		if (d < best_d) {
+			best_d = d;
+			best = pt;
+		}
+	}
+	const double target = (double)g->pos + best;
+	return pos + (int)lround((target - pos) * q->p->strength);
+}
+
+void quantize_index_apply(struct quantize_index* qi, struct mid* mid, const struct tempo_map* tm, const struct quantize_params* params)
+{
+	const union timespan ts = qi->timespan;
+	const int eos = mid->end_of_song_pos;
+	struct quantizer q = { .tm = tm, .mid = mid, .p = params };
+	int* hi_arr = NULL;
+	struct mev* moved_arr = NULL;
+	for (int t = 0; t < arrlen(qi->trk_arr); t++) {
+		struct trk* trk = mid_get_trk(mid, qi->trk_arr[t]);
+		const struct mev* mev0 = qi->mev0_arr[t];
+		const int n = arrlen(mev0);
+		arrsetlen(trk->mev_arr, n);
+		struct mev* out = trk->mev_arr;
+		int w = 0;
+		arrsetlen(moved_arr, 0);
+
+		// notes of a key must not overlap. going backwards, each moved note
+		// gets the last tick it may start at: before the next unmoved note
+		// of its key (or end of song), leaving a tick for each moved note
+		// in between
+		arrsetlen(hi_arr, n);
+		{
+			int wall[N_NOTES], n_after[N_NOTES] = {0};
+			for (int k = 0; k < N_NOTES; k++) wall[k] = eos;
+			for (int i = n-1; i >= 0; i--) {
+				const struct mev* m = &mev0[i];
+				if (m->b[0] != NOTE_ON || m->pos < ts.start) continue;
+				const int key = m->b[1];
+				if (m->pos >= ts.end) {
+					wall[key] = m->pos;
+					n_after[key] = 0;
+				} else {
+					hi_arr[i] = wall[key] - 1 - n_after[key]++;
+				}
+			}
+		}
+
+		// new positions in one pass; a NOTE OFF follows its NOTE ON. a note
+		// doesn't start before the previous one of its key ends (as moved),
+		// and ends no later than the next one may start. moved notes (NOTE
+		// ON and its NOTE OFF) are taken out; the other events keep their
+		// order
+		int start[N_NOTES], delta[N_NOTES], hi[N_NOTES], last_end[N_NOTES] = {0};
+		bool open[N_NOTES] = {0};
+		for (int i = 0; i < n; i++) {
+			struct mev m = mev0[i];
+			const int key = m.b[1];
+			bool moved = false;
+			if (m.b[0] == NOTE_ON && ts.start <= m.pos && m.pos < ts.end) {
+				moved = true;
+				int p = quantize_pos(&q, m.pos);
+				if (p < last_end[key]) p = last_end[key];
+				if (p < 0) p = 0;
+				if (p > hi_arr[i]) p = hi_arr[i];
+				delta[key] = p - m.pos;
+				start[key] = p;
+				hi[key] = hi_arr[i];
+				open[key] = !trk->percussive;
+				m.pos = p;
+			} else if (m.b[0] == NOTE_OFF && open[key]) {
+				moved = true;
+				open[key] = false;
+				int p = params->ends ? quantize_pos(&q, m.pos) : m.pos + delta[key];
+				if (p <= start[key]) p = start[key] + 1;
+				if (p > hi[key] + 1) p = hi[key] + 1;
+				m.pos = p;
+			} else if (m.b[0] == NOTE_ON && open[key]) {
+				open[key] = false; // re-triggered without NOTE OFF
+			}
+			if (m.b[0] == NOTE_OFF) last_end[key] = m.pos;
+			if (moved) {
+				arrput(moved_arr, m);
+			} else {
+				out[w++] = m;
+			}
+		}
+		// moved notes never have zero length, so ordering them by rank
+		// keeps every NOTE OFF after its NOTE ON
+		arrsetlen(trk->mev_arr, w);
+		mev_sort_nearly(moved_arr, arrlen(moved_arr));
+		mev_merge(&trk->mev_arr, moved_arr, arrlen(moved_arr));
+	}
+	arrfree(moved_arr);
+	arrfree(hi_arr);
+	mid->revision++;
+	qi->revision = mid->revision;
+}
+
+// keys pushed out of 0..127 are moved back in by octaves
+static uint8_t key_fold(int key)
+{
+	while (key < 0) key += 12;
+	while (key >= N_NOTES) key -= 12;
+	return (uint8_t)key;
+}
+
+void pitch_map_identity(uint8_t* lut)
+{
+	for (int k = 0; k < N_NOTES; k++) lut[k] = (uint8_t)k;
+}
+
+void pitch_map_transpose(uint8_t* lut, int semitones)
+{
+	for (int k = 0; k < N_NOTES; k++) lut[k] = key_fold(k + semitones);
+}
+
+void pitch_map_scale(uint8_t* lut, int root, unsigned scale_mask, int degrees)
+{
+	scale_mask |= 1; // the root is always in the scale
+	int deg[12], n_deg = 0, deg_index[12];
+	for (int i = 0; i < 12; i++) {
+		deg_index[i] = n_deg - 1; // scale degree at or below i
+		if (scale_mask & (1u << i)) {
+			deg_index[i] = n_deg;
+			deg[n_deg++] = i;
+		}
+	}
+	root = ((root % 12) + 12) % 12;
+	for (int k = 0; k < N_NOTES; k++) {
+		const int pc = (k - root + 120) % 12;
+		const int j = deg_index[pc];
+		const int off = pc - deg[j]; // distance from the scale note below
+		const int jj = j + degrees;
+		const int octave = (jj >= 0 ? jj : jj - (n_deg-1)) / n_deg;
+		const int d = deg[jj - octave*n_deg];
+		lut[k] = key_fold(k - pc + octave*12 + d + off);
+	}
+}
+
+int mid_apply_pitch_map(struct mid* mid, union timespan ts, const bool* track_mask, const uint8_t* lut)
+{
+	// row 0 leaves b[1] of other events alone
+	uint8_t lut2[2][N_NOTES];
+	pitch_map_identity(lut2[0]);
+	memcpy(lut2[1], lut, N_NOTES);
+	bool injective = true;
+	{
+		bool hit[N_NOTES] = {0};
+		for (int k = 0; k < N_NOTES; k++) {
+			if (hit[lut[k]]) injective = false;
+			hit[lut[k]] = true;
+		}
+	}
+
+	const int eos = mid->end_of_song_pos;
+	const bool whole = ts.start <= 0 && ts.end > eos;
+	int n_changed = 0;
+	const int n_tracks = mid_get_track_count(mid);
+	for (int ti = 0; ti < n_tracks; ti++) {
+		if (track_mask != NULL && !track_mask[ti]) continue;
+		struct trk* trk = mid_get_trk(mid, ti);
+		struct mev* mev_arr = trk->mev_arr;
+		const int n = arrlen(mev_arr);
+		const int i0 = whole ? 0 : mev_lower_bound(mev_arr, n, ts.start);
+		const int i1 = whole ? n : mev_lower_bound(mev_arr, n, ts.end);
+		if (i0 == i1) continue;
+
+		// notes are selected by their NOTE ON, so NOTE OFFs of notes
+		// crossing the edges need fixing up: the keys sounding at
+		// ts.start and ts.end (by the NOTE ONs in the range) are found
+		// first
+		bool open0[N_NOTES] = {0}, open1[N_NOTES] = {0};
+		if (!whole && !trk->percussive) {
+			for (int i = 0; i < i1; i++) {
+				struct mev* mev = &mev_arr[i];
+				bool* open = i < i0 ? open0 : open1;
+				if (mev->b[0] == NOTE_ON) {
+					open[mev->b[1]] = true;
+				} else if (mev->b[0] == NOTE_OFF) {
+					open[mev->b[1]] = false;
+				}
+			}
+		}
+		int keep[N_NOTES], n_keep = 0;
+		uint8_t keep_key[N_NOTES];
+		for (int k = 0; k < N_NOTES; k++) {
+			if (!open0[k]) continue;
+			for (int i = i0; i < i1; i++) {
+				struct mev* mev = &mev_arr[i];
+				if (mev->b[1] != k || (mev->b[0] != NOTE_ON && mev->b[0] != NOTE_OFF)) continue;
+				if (mev->b[0] == NOTE_OFF) {
+					keep[n_keep] = i;
+					keep_key[n_keep++] = (uint8_t)k;
+				}
+				break;
+			}
+		}
+
+		// the kernel: branch-free, one table lookup per event
+		for (int i = i0; i < i1; i++) {
+			uint8_t* b = mev_arr[i].b;
+			const int is_note = (b[0] & 0xe0) == 0x80; // NOTE_OFF or NOTE_ON
+			const uint8_t k = lut2[is_note][b[1] & 0x7f];
+			n_changed += is_note & (b[0] >> 4 & 1) & (k != b[1]);
+			b[1] = k;
+		}
+
+		for (int j = 0; j < n_keep; j++) mev_arr[keep[j]].b[1] = keep_key[j];
+		int fix[N_NOTES], n_fix = 0;
+		for (int k = 0; k < N_NOTES; k++) {
+			if (!open1[k]) continue;
+			for (int i = i1; i < n; i++) {
+				struct mev* mev = &mev_arr[i];
+				if (mev->b[1] != k || (mev->b[0] != NOTE_ON && mev->b[0] != NOTE_OFF)) continue;
+				if (mev->b[0] == NOTE_OFF) fix[n_fix++] = i;
+				break;
+			}
+		}
+		for (int j = 0; j < n_fix; j++) mev_arr[fix[j]].b[1] = lut[mev_arr[fix[j]].b[1]];
+
+		// keys mapped together can overlap, and so can a note moved onto a
+		// key held by an unselected note across the edges of ts
+		if ((!injective || !whole) && !trk->percussive && normalise_trk(trk, eos, false) > 0) {
+			normalise_trk(trk, eos, true);
+		}
+	}
+	mid->revision++;
+	return n_changed;
+}
+
+// .miidc is a sidecar cache of the parsed and normalised song (next to the
+// .mid) so that big songs can be reopened without parsing them. it's only
+// used if size, mtime and content hash of the .mid still match. bump
+// MIIDC_VERSION when the layout changes, or when mid_unmarshal_blob() or
+// mid_normalise() change their output.
+#define MIIDC_EXT     ".miidc"
+#define MIIDC_MAGIC   "MIIDC\0\0\0"
+#define MIIDC_VERSION (2)
+
+struct miidc_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t mev_size;
+	int32_t  division;
+	int32_t  end_of_song_pos;
+	int32_t  n_trks;
+	uint64_t source_size;
+	int64_t  source_mtime_sec;
+	int64_t  source_mtime_nsec;
+	uint64_t source_hash;
+	uint64_t text_offset;
+};
+
+struct miidc_trk {
+	int32_t  midi_channel;
+	int32_t  percussive;
+	uint64_t name_offset;
+	uint64_t mev_offset;
+	uint64_t n_mevs;
+};
+
+#define MIIDC_BYTE_ORDER (0x01020304)
+
+uint64_t hash_blob(struct blob blob)
+{
+	uint64_t h = FNV1A64_INIT;
+	const size_t n8 = blob.size / 8;
+	for (size_t i = 0; i < n8; i++) {
+		uint64_t v;
+		memcpy(&v, blob.data + i*8, 8);
+		h = (h ^ v) * 0x100000001b3ull;
+		h ^= h >> 32;
+	}
+	return fnv1a64(h, blob.data + n8*8, blob.size - n8*8);
+}
+
+struct blob blob_map(const char* path)
+{
+	struct blob noblob = {0};
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) return noblob;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return noblob;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return noblob;
+	return (struct blob) {
+		.data = (uint8_t*)data,
+		.size = (size_t)st.st_size,
+	};
+}
+
+void blob_unmap(struct blob blob)
+{
+	if (blob.data == NULL) return;
+	munmap(blob.data, blob.size);
+}
+
+static void miidc_path(char* dst, size_t n, const char* mid_path)
+{
+	snprintf(dst, n, "%s" MIIDC_EXT, mid_path);
+}
+
+static bool miidc_header_matches_source(struct miidc_header* hdr, struct stat* src)
+{
+	return hdr->source_size       == (uint64_t)src->st_size
+	    && hdr->source_mtime_sec  == (int64_t)src->st_mtim.tv_sec
+	    && hdr->source_mtime_nsec == (int64_t)src->st_mtim.tv_nsec;
+}
+
+static inline bool miidc_range_ok(struct blob blob, uint64_t offset, uint64_t size)
+{
+	return offset <= blob.size && size <= (blob.size - offset);
+}
+
+static inline bool miidc_string_ok(struct blob blob, uint64_t offset)
+{
+	if (offset >= blob.size) return false;
+	const size_t n = strnlen((const char*)(blob.data + offset), blob.size - offset);
+	return n < (blob.size - offset) && n < TEXT_FIELD_SIZE;
+}
+
+static char* miidc_read_string(struct blob blob, uint64_t offset)
+{
+	char* field = alloc_text_field();
+	strcpy(field, (const char*)(blob.data + offset));
+	return field;
+}
+
+// returns song from the .miidc next to mid_path, or NULL if there's no valid
+// cache for it
+struct mid* mid_load_miidc(const char* mid_path)
+{
+	struct stat src;
+	if (stat(mid_path, &src) != 0) return NULL;
+
+	char path[1<<12];
+	miidc_path(path, sizeof path, mid_path);
+	struct blob blob = blob_map(path);
+	if (blob.data == NULL) return NULL;
+
+	struct mid* mid = NULL;
+	struct miidc_header hdr;
+	struct miidc_trk* cts = NULL;
+	if (blob.size < sizeof hdr) goto out;
+	memcpy(&hdr, blob.data, sizeof hdr);
+	if (memcmp(hdr.magic, MIIDC_MAGIC, sizeof hdr.magic) != 0) goto out;
+	if (hdr.version != MIIDC_VERSION) goto out;
+	if (hdr.byte_order != MIIDC_BYTE_ORDER) goto out;
+	if (hdr.mev_size != sizeof(struct mev)) goto out;
+	if (!miidc_header_matches_source(&hdr, &src)) goto out;
+
+	if (hdr.n_trks < 1 || !miidc_range_ok(blob, sizeof hdr, (uint64_t)hdr.n_trks * sizeof(struct miidc_trk)) || !miidc_string_ok(blob, hdr.text_offset)) {
+		mid_warn("%s: corrupt cache; ignoring it", path);
+		goto out;
+	}
+	cts = (struct miidc_trk*)malloc(hdr.n_trks * sizeof *cts);
+	memcpy(cts, blob.data + sizeof hdr, hdr.n_trks * sizeof *cts);
+	for (int i = 0; i < hdr.n_trks; i++) {
+		struct miidc_trk* ct = &cts[i];
+		if (!miidc_string_ok(blob, ct->name_offset) || ct->n_mevs > INT32_MAX || !miidc_range_ok(blob, ct->mev_offset, ct->n_mevs * sizeof(struct mev))) {
+			mid_warn("%s: corrupt cache; ignoring it", path);
+			goto out;
+		}
+	}
+
+	{
+		struct blob src_blob = blob_map(mid_path);
+		if (src_blob.data == NULL) goto out;
+		const bool same = (src_blob.size == hdr.source_size) && (hash_blob(src_blob) == hdr.source_hash);
+		blob_unmap(src_blob);
+		if (!same) goto out;
+	}
+
+	mid = (struct mid*)calloc(1, sizeof *mid);
+	mid->division = hdr.division;
+	mid->end_of_song_pos = hdr.end_of_song_pos;
+	mid->text = miidc_read_string(blob, hdr.text_offset);
+	arrsetlen(mid->_trk_arr, hdr.n_trks);
+	memset(mid->_trk_arr, 0, hdr.n_trks * sizeof mid->_trk_arr[0]);
+	for (int i = 0; i < hdr.n_trks; i++) {
+		struct miidc_trk* ct = &cts[i];
+		struct trk* trk = &mid->_trk_arr[i];
+		trk->midi_channel = ct->midi_channel;
+		trk->percussive = ct->percussive != 0;
+		trk->name = miidc_read_string(blob, ct->name_offset);
+		if (ct->n_mevs > 0) {
+			arrsetlen(trk->mev_arr, ct->n_mevs);
+			memcpy(trk->mev_arr, blob.data + ct->mev_offset, ct->n_mevs * sizeof(struct mev));
+		}
+	}
+
+	out:
+	free(cts);
+	blob_unmap(blob);
+	return mid;
+}
+
+// writes .miidc for mid (which must be the unedited result of parsing
+// source) next to mid_path. failure is not fatal; the cache is just skipped
+void mid_save_miidc(const char* mid_path, struct mid* mid, struct blob source)
+{
+	struct stat src;
+	if (stat(mid_path, &src) != 0) return;
+
+	const int n_trks = arrlen(mid->_trk_arr);
+
+	struct miidc_header hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, MIIDC_MAGIC, sizeof hdr.magic);
+	hdr.version = MIIDC_VERSION;
+	hdr.byte_order = MIIDC_BYTE_ORDER;
+	hdr.mev_size = sizeof(struct mev);
+	hdr.division = mid->division;
+	hdr.end_of_song_pos = mid->end_of_song_pos;
+	hdr.n_trks = n_trks;
+	hdr.source_size = source.size;
+	hdr.source_mtime_sec = src.st_mtim.tv_sec;
+	hdr.source_mtime_nsec = src.st_mtim.tv_nsec;
+	hdr.source_hash = hash_blob(source);
+
+	// layout: header, track table, mev arrays, strings
+	uint64_t offset = sizeof hdr + n_trks * sizeof(struct miidc_trk);
+	struct miidc_trk* cts = (struct miidc_trk*)calloc(n_trks, sizeof *cts);
+	for (int i = 0; i < n_trks; i++) {
+		struct trk* trk = &mid->_trk_arr[i];
+		cts[i].midi_channel = trk->midi_channel;
+		cts[i].percussive = trk->percussive;
+		cts[i].mev_offset = offset;
+		cts[i].n_mevs = arrlen(trk->mev_arr);
+		offset += cts[i].n_mevs * sizeof(struct mev);
+	}
+	hdr.text_offset = offset;
+	offset += strlen(mid->text) + 1;
+	for (int i = 0; i < n_trks; i++) {
+		cts[i].name_offset = offset;
+		offset += strlen(mid->_trk_arr[i].name) + 1;
+	}
+
+	uint8_t* out = NULL;
+	arrsetlen(out, offset);
+	memcpy(out, &hdr, sizeof hdr);
+	memcpy(out + sizeof hdr, cts, n_trks * sizeof *cts);
+	for (int i = 0; i < n_trks; i++) {
+		struct trk* trk = &mid->_trk_arr[i];
+		memcpy(out + cts[i].mev_offset, trk->mev_arr, cts[i].n_mevs * sizeof(struct mev));
+		strcpy((char*)out + cts[i].name_offset, trk->name);
+	}
+	strcpy((char*)out + hdr.text_offset, mid->text);
+	free(cts);
+
+	// write+rename so a concurrent reader never sees a partial file
+	char path[1<<12], tmp_path[1<<12];
+	miidc_path(path, sizeof path, mid_path);
+	snprintf(tmp_path, sizeof tmp_path, "%s.%d.tmp", path, (int)getpid());
+	FILE* f = fopen(tmp_path, "wb");
+	bool ok = f != NULL;
+	if (ok) ok = fwrite(out, arrlen(out), 1, f) == 1;
+	if (f != NULL) ok = (fclose(f) == 0) && ok;
+	if (ok) ok = rename(tmp_path, path) == 0;
+	if (!ok) {
+		mid_warn("%s: cannot write cache: %s", path, strerror(errno));
+		remove(tmp_path);
+	}
+	arrfree(out);
+}
@@ -0,0 +1,432 @@
+#ifndef MID_H
+
+// song model, .mid parser/marshaller and .miidc cache. no GUI or audio
+// dependencies, so it's also used by miid-batch
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "stb_ds.h"
+
+#include "generalmidi.h"
+
+union timespan {
+	struct {
+		int start;
+		int end;
+	};
+	int s[2];
+};
+
+struct mev {
+	int pos;
+	uint8_t b[4];
+};
+
+#define TEXT_FIELD_SIZE (1<<10)
+
+struct trk {
+	int midi_channel;
+	char* name;
+	struct mev* mev_arr;
+	bool percussive; // true if mev_arr has NOTE ONs, but no NOTE OFFs
+};
+
+struct mid {
+	char* text;
+	int division;
+	int end_of_song_pos;
+	struct trk* _trk_arr;
+	int revision; // bumped on edits that affect rendering
+};
+
+static inline struct trk* mid_get_time_track(struct mid* mid)
+{
+	assert(arrlen(mid->_trk_arr) >= 1);
+	return &mid->_trk_arr[0];
+}
+
+static inline int mid_get_track_count(struct mid* mid)
+{
+	const int n = arrlen(mid->_trk_arr) - 1;
+	assert(n >= 0);
+	return n;
+}
+
+static inline struct trk* mid_get_trk(struct mid* mid, int index)
+{
+	const int n = mid_get_track_count(mid);
+	assert(0 <= index && index < n);
+	return &mid->_trk_arr[1 + index];
+}
+
+struct blob {
+	uint8_t* data;
+	size_t size;
+};
+
+static inline struct blob blob_slice(struct blob blob, int offset)
+{
+	if (offset == 0) return blob;
+	if (offset > 0) assert((offset <= (int)blob.size) && "slice out of bounds");
+	return (struct blob) {
+		.data = blob.data + offset,
+		.size = blob.size - offset,
+	};
+}
+
+static inline struct blob arrblob(uint8_t* data_arr)
+{
+	return (struct blob) {
+		.data = data_arr,
+		.size = arrlen(data_arr),
+	};
+}
+
+// parser diagnostics are printed to stderr unless mid_quiet is set. the last
+// error is always kept (per thread) in mid_last_error
+extern bool mid_quiet;
+extern thread_local char mid_last_error[1<<8];
+
+struct blob blob_load(const char* path);
+struct blob blob_map(const char* path);
+void blob_unmap(struct blob blob);
+uint64_t hash_blob(struct blob blob);
+bool write_file_from_arr(uint8_t* out_arr, const char* path);
+
+char* alloc_text_field(void);
+struct mid* mid_new(void);
+void mid_free(struct mid* mid);
+struct mid* mid_unmarshal_blob(struct blob blob);
+uint8_t* mid_marshal_arr(struct mid* mid);
+
+// closes hanging notes, inserts NOTE OFFs before re-triggered notes and drops
+// NOTE OFFs without a NOTE ON, so that every NOTE ON in a non-percussive
+// track has exactly one matching NOTE OFF after it. returns number of fixes
+int mid_normalise(struct mid* mid);
+
+// checks song invariants (event order, event types per track, note pairing);
+// problems are printed with `what` as prefix. returns number of problems
+int mid_validate(struct mid* mid, const char* what);
+
+// range edits. each rebuilds a track in one linear pass; notes crossing
+// range edges are split, and tempo/controller state is carried over edges.
+// track_mask selects tracks by mid_get_trk() index (NULL: all tracks), and
+// include_time_track also edits tempo/time signature. all bump revision
+//  delete:    removes ts and pulls later events in
+//  duplicate: inserts a copy of ts at ts.end and pushes later events out
+//  crop:      removes everything before ts.start and/or from ts.end on, from
+//             all tracks
+void mid_delete_range(struct mid* mid, union timespan ts, const bool* track_mask, bool include_time_track);
+void mid_duplicate_range(struct mid* mid, union timespan ts, const bool* track_mask, bool include_time_track);
+void mid_crop(struct mid* mid, union timespan ts, bool crop_start, bool crop_end);
+
+// controller edits in a timespan. ctrl is a CONTROL_CHANGE number (0-127),
+// CTRL_PITCH_BEND, CTRL_AFTERTOUCH (channel pressure) or CTRL_ALL. both
+// return the number of removed events and bump revision if there were any
+//  delete: removes the events; the value they left behind is restored at
+//          ts.end if it differs from the value before the range
+//  thin:   removes events whose value is within tolerance (in 0-127 units)
+//          of the last kept one. controllers hold their value until the next
+//          event, so this bounds what is actually heard; the last event per
+//          controller in the range is always kept. channel mode messages
+//          (CC 120-127) are never thinned, and CTRL_ALL only thins the
+//          continuous ones (modulation, volume, pan, effects 1 and 3,
+//          pitch bend, channel pressure)
+enum {
+	CTRL_ALL = -1,
+	CTRL_PITCH_BEND = N_NOTES,
+	CTRL_AFTERTOUCH,
+	N_CTRLS
+};
+void mid_count_controllers(struct mid* mid, union timespan ts, const bool* track_mask, int* counts); // counts[N_CTRLS]
+int mid_delete_controllers(struct mid* mid, union timespan ts, const bool* track_mask, int ctrl);
+int mid_thin_controllers(struct mid* mid, union timespan ts, const bool* track_mask, int ctrl, float tolerance);
+
+// CTRL_* index of a controller event, or -1
+static inline int mev_ctrl(struct mev* mev)
+{
+	switch (mev->b[0]) {
+	case CONTROL_CHANGE:     return mev->b[1];
+	case PITCH_BEND:         return CTRL_PITCH_BEND;
+	case CHANNEL_AFTERTOUCH: return CTRL_AFTERTOUCH;
+	default:                 return -1;
+	}
+}
+
+// controller value in 0..127 units (pitch bend keeps its 14-bit resolution)
+static inline float mev_ctrl_value(struct mev* mev)
+{
+	switch (mev->b[0]) {
+	case CONTROL_CHANGE:     return mev->b[2];
+	case PITCH_BEND:         return (float)(mev->b[1] + (mev->b[2] << 7)) * (1.0f / 128.0f);
+	case CHANNEL_AFTERTOUCH: return mev->b[1];
+	default: assert(!"not a controller");
+	}
+	return 0;
+}
+
+// index of first event at or after pos
+int mev_lower_bound(struct mev* mev_arr, int n, int pos);
+
+// controller painting. a stroke is a polyline of points sorted by pos, with
+// values in 0..127 units (pitch bend: 64 is center). it's sampled every
+// resolution ticks and at its end, and a sample is only emitted when the
+// held value is off by more than tolerance, so a fast stroke over a long
+// range gives few events. they replace the track's ctrl events in the
+// stroke's [first;last] pos, and the value in effect at its end is restored
+// after it. returns the number of inserted events and bumps revision
+struct ctrl_point {
+	int pos;
+	float value;
+};
+int mid_paint_controller(struct mid* mid, int track_index, int ctrl, const struct ctrl_point* points, int n, int resolution, float tolerance);
+
+// tempo map: the clock and the bar/beat grid after each time track event, so
+// that tick<->seconds and "which bar is this" are binary searches instead of
+// scans from 0. the grid walks in beats of the current signature; events
+// take effect on it at the first beat at or after them, and a signature
+// change starts a new bar. tempo_map_update() rebuilds it (in time track
+// events, not song length) when revision or division has changed
+#define DEFAULT_US_PER_QN (500000) // 120BPM
+
+struct tempo_grid {
+	int pos;
+	int bar, beat;
+	int numerator, denominator_log2;
+	int us_per_qn;
+	int len; // ticks per beat
+};
+
+struct tempo_mark {
+	int pos;
+	int us_per_qn;
+	double usec; // time at pos
+	struct tempo_grid grid;
+};
+
+struct tempo_map {
+	struct tempo_mark* mark_arr; // one per time track event
+	int revision;
+	int division; // 0: never built
+};
+
+void tempo_map_update(struct tempo_map* tm, struct mid* mid);
+void tempo_map_free(struct tempo_map* tm);
+double tempo_map_seconds(const struct tempo_map* tm, double pos);
+double tempo_map_pos(const struct tempo_map* tm, double seconds);
+// grid at the last beat at or before pos, before applying the time track
+// events on that beat. returns the index of the first time track event not
+// yet applied
+int tempo_map_grid_at(const struct tempo_map* tm, int pos, struct tempo_grid* out);
+// grid at the last beat at or before pos, with the events on that beat
+// applied
+void tempo_map_beat_at(const struct tempo_map* tm, struct mid* mid, int pos, struct tempo_grid* out);
+void tempo_grid_step(struct tempo_grid* g);
+void tempo_grid_apply(struct tempo_grid* g, struct mev* mev, int division);
+
+// time track edits. without a range (ts.end <= ts.start) the value is set
+// from ts.start on; with one it is set for the range only: changes of the
+// same kind inside it are removed, and the previous value is restored at
+// ts.end. bump revision
+void mid_set_tempo(struct mid* mid, union timespan ts, int us_per_qn);
+void mid_set_time_signature(struct mid* mid, union timespan ts, int numerator, int denominator_log2);
+
+// chase index: what the MIDI channels are set to (program, controllers,
+// pitch bend, channel pressure) at any pos, for starting playback mid-song.
+// the channel events of all tracks are kept merged in pos order, with a
+// snapshot of all channels every CHASE_INTERVAL events, so chase_index_get()
+// is a binary search plus at most CHASE_INTERVAL events instead of a scan
+// from 0. chase_index_update() rebuilds it when revision has changed
+#define CHASE_INTERVAL (1024)
+#define CHASE_UNSET (-1)
+#define CHASE_MAX_MESSAGES (4+N_NOTES+3)
+
+struct chase_channel {
+	int16_t program;
+	int16_t pitch_bend; // 14-bit
+	int16_t pressure;
+	int8_t cc[N_NOTES];
+};
+
+struct chase_state {
+	struct chase_channel ch[16]; // all CHASE_UNSET at first
+};
+
+struct chase_event {
+	int pos;
+	uint8_t b[3]; // with channel
+};
+
+struct chase_checkpoint {
+	int pos;
+	int event_index; // first event_arr[] at or after pos
+	struct chase_state state; // after all events before pos
+};
+
+struct chase_index {
+	struct chase_event* event_arr;
+	struct chase_checkpoint* checkpoint_arr;
+	int revision;
+	bool built;
+};
+
+void chase_index_update(struct chase_index* ci, struct mid* mid);
+void chase_index_free(struct chase_index* ci);
+// state after all channel events before pos
+void chase_index_get(const struct chase_index* ci, int pos, struct chase_state* out);
+// messages that bring channel ch to state c from whatever it was: reset all
+// controllers, then bank select, program, RPN/NRPN and data entry before
+// the other controllers, so that they take effect. unset bank, program,
+// volume and pan (which the reset leaves alone) get their defaults. returns
+// the number of messages written to out (at most CHASE_MAX_MESSAGES)
+int chase_channel_messages(const struct chase_channel* c, int ch, uint8_t (*out)[3]);
+
+// hit-test index of a track's notes: per key, the notes as sorted, disjoint
+// [start;end) spans. a note lasts until the next NOTE ON/OFF of its key (as
+// drawn; end of song if there is none), and 1 tick in percussive tracks.
+// point and rectangle lookups are O(log n + hits). it's rebuilt with
+// note_index_build() when stale (callers key it on mid->revision);
+// note_index_insert()/_remove() keep it up to date with single note edits
+// in normalised tracks
+struct note_span {
+	int start, end;
+};
+
+struct note_hit {
+	int key;
+	int start, end;
+};
+
+struct note_index {
+	struct note_span* key_arr[N_NOTES];
+	int revision;
+	bool built;
+};
+
+void note_index_build(struct note_index* ni, struct trk* trk, int end_of_song_pos);
+void note_index_free(struct note_index* ni);
+// index into key_arr[key] of the note sounding at pos, or -1
+int note_index_find(const struct note_index* ni, int key, int pos);
+// whether a new note of key can start at start without overlapping one in
+// the index; if so, *end is clamped to where the next one starts
+bool note_index_fit(const struct note_index* ni, int key, int start, int* end);
+// appends notes in keys [key0;key1] overlapping ticks [pos0;pos1]
+void note_index_query(const struct note_index* ni, int key0, int key1, int pos0, int pos1, struct note_hit** hit_arr);
+void note_index_insert(struct note_index* ni, int key, int start, int end);
+void note_index_remove(struct note_index* ni, int key, int start);
+// mev_arr index of the NOTE ON of key at pos, or -1
+int trk_find_note_on(struct trk* trk, int key, int pos);
+
+// note edits on one track (mid_get_trk() index). bump revision
+//  insert: sorts the new notes' NOTE ON/OFF events and merges them into
+//          mev_arr in place, from the back; only events after the first new
+//          one move, so appending at the end of a track is amortised O(1).
+//          new notes shouldn't overlap existing ones of the same key (the
+//          track would need mid_normalise(); see note_index_fit()). on
+//          percussive tracks only the NOTE ONs are inserted
+//  delete: removes notes found by note_index_find()/_query(), with their
+//          NOTE OFFs
+struct new_note {
+	int start, end;
+	uint8_t key, velocity;
+};
+void mid_insert_notes(struct mid* mid, int track_index, const struct new_note* notes, int n);
+void mid_delete_notes(struct mid* mid, int track_index, const struct note_hit* hits, int n);
+
+// velocity edits on the NOTE ONs of a timespan. the index remembers where
+// the NOTE ONs are and their velocities (vel0) when it was built or last
+// committed; vel_index_apply() always transforms from vel0, so it can be
+// called every frame while a slider is dragged. the index is stale once
+// revision != mid->revision
+enum vel_op {
+	VEL_SCALE = 0,   // v*factor
+	VEL_OFFSET,      // v+offset
+	VEL_COMPRESS,    // pivot+(v-pivot)*amount; amount<1 compresses, >1 expands
+	VEL_RAMP_LINEAR, // v*lerp(from,to,t); t is 0..1 across the timespan
+	VEL_RAMP_EXP,    // v*from*(to/from)^t
+	VEL_HUMANISE,    // v+random(-jitter,jitter), same pattern for same seed
+	N_VEL_OPS
+};
+
+struct vel_params {
+	int op;
+	float factor;
+	float offset;
+	float amount;
+	float pivot;
+	float from, to;
+	float jitter;
+	uint32_t seed;
+};
+
+struct vel_index {
+	int* trk_arr;      // mid_get_trk() index
+	int* mev_arr;      // index into trk->mev_arr
+	uint8_t* vel0_arr;
+	float* t_arr;
+	uint8_t* vel_arr;  // result of last vel_index_apply()
+	union timespan timespan;
+	int revision;
+};
+
+void vel_index_build(struct vel_index* vi, struct mid* mid, union timespan ts, const bool* track_mask);
+void vel_index_apply(struct vel_index* vi, struct mid* mid, const struct vel_params* params);
+void vel_index_commit(struct vel_index* vi); // makes last apply the new vel0
+void vel_index_free(struct vel_index* vi);
+
+// quantize: moves the notes starting in a timespan towards a grid of
+// grid_div points per beat of the tempo map. strength is how far they move
+// (1: onto the grid), swing delays every other grid point by swing*step/2
+// (2/3: triplet feel), and ends also quantizes NOTE OFFs (otherwise notes
+// keep their length). like vel_index, the index keeps the tracks as they
+// were when it was built, and quantize_index_apply() always starts from
+// them, so it can be called every frame while a slider is dragged. new
+// positions are computed in one pass; the moved notes, which only move a
+// little, are put back in order with an insertion sort and merged into the
+// other events, which keep their order. the index is stale once
+// revision != mid->revision
+struct quantize_params {
+	int grid_div;
+	float strength;
+	float swing;
+	bool ends;
+};
+
+struct quantize_index {
+	int* trk_arr;          // mid_get_trk() index of tracks with notes in timespan
+	struct mev** mev0_arr; // their events when the index was built
+	int n_notes;
+	union timespan timespan;
+	int revision;
+};
+
+void quantize_index_build(struct quantize_index* qi, struct mid* mid, union timespan ts, const bool* track_mask);
+void quantize_index_apply(struct quantize_index* qi, struct mid* mid, const struct tempo_map* tm, const struct quantize_params* params);
+void quantize_index_free(struct quantize_index* qi);
+
+// pitch maps: lut[key] is the new key (N_NOTES entries). builders:
+//  transpose: by semitones
+//  scale:     by degrees of a scale (root 0-11, scale_mask bit i: root+i is
+//             in the scale); keys off the scale keep their distance to the
+//             scale note below them
+// keys pushed out of 0..127 are moved back in by octaves.
+// mid_apply_pitch_map() remaps the notes starting in ts on the selected
+// tracks (NULL: all) with one branch-free table lookup per event; only
+// NOTE OFFs of notes crossing the edges of ts are fixed up separately.
+// notes that end up overlapping (keys mapped together, or a note moved onto
+// a key held by an unselected note across the edges) are re-paired as with
+// mid_normalise().
+// returns the number of notes that changed key and bumps revision
+void pitch_map_identity(uint8_t* lut);
+void pitch_map_transpose(uint8_t* lut, int semitones);
+void pitch_map_scale(uint8_t* lut, int root, unsigned scale_mask, int degrees);
+int mid_apply_pitch_map(struct mid* mid, union timespan ts, const bool* track_mask, const uint8_t* lut);
+
+// .miidc sidecar cache (see mid.cpp)
+struct mid* mid_load_miidc(const char* mid_path);
+void mid_save_miidc(const char* mid_path, struct mid* mid, struct blob source);
+
+#define MID_H
+#endif
@@ -3,6 +3,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic>
 
 #include "imgui.h"
 #include "imgui_internal.h"
@@ -14,6 +18,7 @@
 #include "generalmidi.h"
 #include "config.h"
 #include "util.h"
+#include "mid.h"
 #include "miid.h"
 
 static const char* get_drum_key(int note)
@@ -27,126 +32,6 @@ static const char* get_drum_key(int note)
 	assert(!"UNREACHABLE");
 }
 
-union timespan {
-	struct {
-		int start;
-		int end;
-	};
-	int s[2];
-};
-
-struct mev {
-	int pos;
-	uint8_t b[4];
-};
-
-#define TEXT_FIELD_SIZE (1<<10)
-
-struct trk {
-	int midi_channel;
-	char* name;
-	struct mev* mev_arr;
-	bool percussive; // true if mev_arr has NOTE ONs, but no NOTE OFFs
-};
-
-struct mid {
-	char* text;
-	int division;
-	int end_of_song_pos;
-	struct trk* _trk_arr;
-};
-
-static inline struct trk* mid_get_time_track(struct mid* mid)
-{
-	assert(arrlen(mid->_trk_arr) >= 1);
-	return &mid->_trk_arr[0];
-}
-
-static inline int mid_get_track_count(struct mid* mid)
-{
-	const int n = arrlen(mid->_trk_arr) - 1;
-	assert(n >= 0);
-	return n;
-}
-
-static inline struct trk* mid_get_trk(struct mid* mid, int index)
-{
-	const int n = mid_get_track_count(mid);
-	assert(0 <= index && index < n);
-	return &mid->_trk_arr[1 + index];
-}
-
-
-static void write_file_from_arr(uint8_t* out_arr, const char* path)
-{
-	FILE* f = fopen(path, "wb");
-	assert((f != NULL) && "cannot write file");
-	assert((fwrite(out_arr, arrlen(out_arr), 1, f) == 1) && "cannot write file");
-	fclose(f);
-}
-
-struct blob {
-	uint8_t* data;
-	size_t size;
-};
-
-static struct blob blob_load(char* path)
-{
-	struct blob noblob = {0};
-	FILE* f = fopen(path, "rb");
-	if (f == NULL) {
-		fprintf(stderr, "%s: %s\n", path, strerror(errno));
-		return noblob;
-	}
-
-	if (fseek(f, 0, SEEK_END) != 0) {
-		fprintf(stderr, "%s: %s\n", path, strerror(errno));
-		fclose(f);
-		return noblob;
-	}
-
-	const long size = ftell(f);
-
-	if (fseek(f, 0, SEEK_SET) != 0) {
-		fprintf(stderr, "%s: %s\n", path, strerror(errno));
-		fclose(f);
-		return noblob;
-	}
-
-	uint8_t* data = (uint8_t*)malloc(size);
-
-	if (fread(data, size, 1, f) != 1) {
-		fprintf(stderr, "%s: %s\n", path, strerror(errno));
-		fclose(f);
-		return noblob;
-	}
-
-	fclose(f);
-
-	return (struct blob) {
-		.data = data,
-		.size = (size_t)size,
-	};
-}
-
-static inline struct blob blob_slice(struct blob blob, int offset)
-{
-	if (offset == 0) return blob;
-	if (offset > 0) assert((offset <= (int)blob.size) && "slice out of bounds");
-	return (struct blob) {
-		.data = blob.data + offset,
-		.size = blob.size - offset,
-	};
-}
-
-static inline struct blob arrblob(uint8_t* data_arr)
-{
-	return (struct blob) {
-		.data = data_arr,
-		.size = arrlen(data_arr),
-	};
-}
-
 struct medit {
 	struct blob mid_blob; // contains valid .mid after edit
 	union timespan affected_timespan;
@@ -181,10 +66,35 @@ enum {
 	SHOW_NO_TRACKS,
 };
 
-#define MAX_TRACKS (1<<8)
+enum {
+	TOOL_NOTE = 0,
+	TOOL_CURV,
+	TOOL_SEQ,
+	TOOL_VIEW,
+	TOOL_ART,
+};
+
+enum {
+	LAYER_PIANOROLL_KEYS = 0,
+	LAYER_PIANOROLL_NOTES,
+	N_LAYERS
+};
+
+// what a layer was last drawn with; it's reused as long as this matches
+struct layer_cache {
+	bool valid;
+	ImVec2 size;
+	float scale;
+	float key127_y;
+	float key_dy;
+	uint64_t content_hash;
+	int span;  // ticks across the layer (notes only)
+	double t0; // tick at the left edge of the layer (notes only)
+};
 
 struct state {
 	int mode0;
+	ImFontAtlas* font_atlas; // what this window's context uses
 	char* path;
 	struct mid* myd;
 	struct medit* medit_arr;
@@ -194,11 +104,13 @@ struct state {
 	float beat_dx;
 	bool bar_select;
 	int timespan_select_mode = SELECT_BAR;
-	int track_select_set[MAX_TRACKS];
+	struct bitset track_select_set;
+	struct bitset track_select_base; // kept while shift-dragging a new selection
 	int primary_track_select = -1;
 	int track_select0;
 	union timespan beat_select0;
-	bool track_show_set[MAX_TRACKS];
+	struct bitset track_show_set;
+	bool* track_mask_arr;
 
 	struct {
 		int track_show_mode = SHOW_ALL_TRACKS;
@@ -206,31 +118,247 @@ struct state {
 		int drag_state;
 		float pan_last_x;
 		int popup_editing_track_index;
+		int* track_display_arr; // scroll_row+row_index-1 => track index
+		int scroll_row; // first displayed track in the first track row
+		float* layout_y0_arr;
 	} header;
 
 	struct {
 		int drag_state;
 		float pan_last_y;
+		union timespan pan_timespan0;
+		struct layer_cache layers[N_LAYERS];
+		int hover_track_index = -1; // no note under the mouse
+		struct note_hit hover;
 	} pianoroll;
 
+	struct note_index* note_index_arr; // per track, see get_note_index()
+
+	int tool = TOOL_NOTE;
+	bool brushen;
+
+	struct {
+		int velocity = 100;
+		int stroke_button; // 0: no stroke, 1: painting, 2: erasing
+		struct new_note* stroke_arr; // painted notes, merged when the stroke ends
+		double erase_pos0;
+		int erase_key0;
+	} note_tool;
+
+	struct {
+		int curve_index; // into curve_types[]
+		float lane_height = 8; // in gui_size units
+		int steps_per_qn = 16;
+		float tolerance = 1;
+		int stroke_button; // 0: no stroke, 1: painting, 2: zeroing
+		struct ctrl_point* stroke_arr; // sorted by pos
+		int stroke_last_pos;
+		ImVec2* polyline_arr; // scratch for draw_curve()
+	} curve_tool;
+
+	struct {
+		int velocity = 100;
+		int octave = 3; // keymap note 0 is key 12*(octave+1)
+		int steps_per_beat = 2;
+		int cursor = -1; // -1: not placed
+		int* step_arr; // lengths of the entered steps, for backspace
+		struct new_note* note_arr; // notes of the entered steps
+	} seq_tool;
+
+	bool no_layers;
+	ImDrawList* layer_draw_list;
+
 	float key127_y;
 	float key_dy = C_DEFAULT_KEY_HEIGHT_PX;
 
 	bool keyjazz_tester_enabled;
 
 	struct cval* config_clone;
+
+	struct tempo_map tempo_map;
+	struct chase_index chase_index;
+
+	struct {
+		float bpm;
+		int numerator;
+		int denominator_log2;
+		uint64_t key;
+	} time_ops;
+
+	struct {
+		struct vel_params params = {
+			.op = VEL_SCALE,
+			.factor = 1.0f,
+			.offset = 0.0f,
+			.amount = 1.0f,
+			.pivot = 64.0f,
+			.from = 1.0f,
+			.to = 1.0f,
+			.jitter = 0.0f,
+			.seed = 1,
+		};
+		struct vel_index index;
+		uint64_t mask_hash;
+	} velocity;
+
+	struct {
+		struct quantize_params params = {
+			.grid_div = 4,
+			.strength = 0.0f,
+			.swing = 0.0f,
+			.ends = false,
+		};
+		struct quantize_index index;
+		uint64_t mask_hash;
+	} quantize;
+
+	struct {
+		int mode;
+		int semitones;
+		int root;
+		int scale_index;
+		int degrees = 1;
+		bool remap_set[N_NOTES];
+		uint8_t remap[N_NOTES];
+		int remap_from = 36;
+		int remap_to = 36;
+	} pitch;
+
+	struct {
+		int ctrl = CTRL_ALL;
+		float tolerance = 1.0f;
+		int counts[N_CTRLS];
+		uint64_t counts_key;
+	} controllers;
+
+	struct {
+		bool have_tick;
+		double tick; // being heard now; see play_get_tick()
+	} play;
+
+	struct miid_frame_stats frame_stats;
+};
+
+// laid out glyph quad relative to the (truncated) label position
+struct label_glyph {
+	float x0, y0, x1, y1;
+	float u0, v0, u1, v1;
+	bool colored;
+};
+
+struct label_run {
+	uint64_t key;
+	int glyph0;
+	int n_glyphs;
 };
 
+#define LABEL_CACHE_SIZE (1<<12)
+
+// a song prepared for the audio thread: events on the sample clock (frames
+// since tick 0), and enough of the tempo map to turn frames back into ticks.
+// immutable once posted, except for the playhead, which belongs to the
+// audio thread
+struct play_event {
+	int64_t frame;
+	int seq; // tie breaker; keeps qsort() stable
+	uint8_t b[3]; // with channel
+};
+
+struct play_tempo {
+	int64_t frame;
+	double tick;
+	double ticks_per_frame;
+};
+
+// a looped playback goes back to start_frame at end_frame. event_arr then
+// only has the loop body, and begins with the chase for its start, so a
+// wrap is: release the notes still held, and replay event_arr from 0
+struct playback {
+	int id; // 0: stop request
+	struct play_event* event_arr;
+	struct play_tempo* tempo_arr;
+	int64_t start_frame, end_frame;
+	int start_tempo_index;
+	bool loop;
+	// audio thread
+	int64_t frame;
+	int next_event;
+	int tempo_index; // last tempo_arr[] at or before frame
+	int n_loops;
+	uint8_t notes_on[16][N_NOTES]; // NOTE ONs without NOTE OFF yet
+};
+
+#define PLAY_MAX_RETIRED (4)
+
 struct g {
 	bool using_audio;
+	float sample_rate;
 	ImFont* fonts[ARRAY_LENGTH(font_sizes)];
 	fluid_synth_t* fluid_synth;
 	int current_soundfont_index;
 	bool soundfont_error[1<<10];
 	struct state* curstate;
+	struct state** state_arr;
+	struct {
+		ImFontAtlas* atlas; // windows switch to this one in miid_new_frame()
+		float size; // gui_size of the newest atlas, built or building
+		ImFontAtlas** retired_arr;
+		bool building;
+		bool threaded; // false: built synchronously, nothing to join
+		float build_size;
+		pthread_t thread;
+		std::atomic<ImFontAtlas*> build_result;
+	} font;
+	struct {
+		bool valid;
+		uint64_t config_hash;
+		float alpha;
+		ImU32 primary[N_NOTES];
+		ImU32 other[N_NOTES];
+	} note_palette;
+	struct note_quad* note_quad_arr; // scratch for emit_note_quads()
+	struct {
+		ImFontAtlas* atlas;
+		ImTextureID tex_id;
+		int n_runs;
+		struct label_run runs[LABEL_CACHE_SIZE]; // open addressing; key 0 is free
+		struct label_glyph* glyph_arr;
+	} label_cache;
+	struct {
+		// gui -> audio; taken by the callback, which hands playbacks it
+		// is done with back through retired[]
+		std::atomic<struct playback*> mailbox;
+		std::atomic<struct playback*> retired[PLAY_MAX_RETIRED];
+		std::atomic<int> ended_id; // last playback that ended or was replaced
+		struct playback* current; // audio thread
+		// gui thread
+		int next_id;
+		int posted_id; // 0: stopped
+		struct state* state; // whose song is playing
+		int start_pos;
+		int loop_end_pos; // <= start_pos: not looping
+	} play;
+	// where the audio thread is, published once per callback. seqlock:
+	// seq is odd while the callback writes
+	struct {
+		std::atomic<unsigned> seq;
+		std::atomic<int> id;
+		std::atomic<int64_t> frame; // at the start of the callback
+		std::atomic<double> tick, ticks_per_frame;
+		std::atomic<double> time; // get_time() at the start of the callback
+		std::atomic<int> n_frames;
+		std::atomic<int> n_loops;
+	} play_clock;
 } g;
 
 
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
 static inline struct state* curstate(void)
 {
 	assert(g.curstate != NULL);
@@ -271,668 +399,341 @@ static void refresh_soundfont(void)
 extern unsigned char font_ttf[];
 extern unsigned int font_ttf_len;
 
-void miid_audio_callback(float* stream, int n_frames)
-{
-	const size_t fsz = 2*sizeof(float);
-	memset(stream, 0, fsz * n_frames);
-	fluid_synth_write_float(g.fluid_synth,
-		n_frames,
-		stream, 0, 2,
-		stream, 1, 2);
-}
-
-static int read_u8(struct blob* p)
+static void play_send(struct playback* p, const struct play_event* e)
 {
-	if (p->size == 0) return -1;
-	const int b = p->data[0];
-	*p = blob_slice(*p, 1);
-	return b;
-}
-
-static void unread_u8(struct blob* p)
-{
-	*p = blob_slice(*p, -1);
-}
-
-static int skip_n(struct blob* p, int n)
-{
-	if ((int)p->size < n) return 0;
-	*p = blob_slice(*p, n);
-	return 1;
-}
-
-static int skip_magic_string(struct blob* p, const char* s)
-{
-	const size_t n = strlen(s);
-	uint8_t* p0 = p->data;
-	int did_skip = skip_n(p, n);
-	if (!did_skip) return 0;
-	return memcmp(p0, s, n) == 0;
-}
-
-static uint8_t* read_data(struct blob* p, int n)
-{
-	uint8_t* p0 = p->data;
-	if (!skip_n(p, n)) return NULL;
-	return p0;
-}
-
-static char* dup2str(uint8_t* data, int n)
-{
-	char* s = (char*)malloc(n+1);
-	memcpy(s, data, n);
-	s[n] = 0;
-	return s;
-}
-
-static int read_i32_be(struct blob* p)
-{
-	uint8_t* s = p->data;
-	if (!skip_n(p, 4)) return -1;
-	const int v =
-		(((int)(s[0])) << 24) +
-		(((int)(s[1])) << 16) +
-		(((int)(s[2])) << 8)  +
-		 ((int)(s[3]));
-	return v;
-}
-
-static int read_u16_be(struct blob* p)
-{
-	uint8_t* s = p->data;
-	if (!skip_n(p, 2)) return -1;
-	const int v =
-		(((int)(s[0])) << 8)  +
-		 ((int)(s[1]));
-	return v;
+	fluid_synth_t* fs = g.fluid_synth;
+	const int ch = e->b[0] & 0xf;
+	uint8_t* on = &p->notes_on[ch][e->b[1] & 0x7f];
+	switch (e->b[0] & 0xf0) {
+	case NOTE_OFF:
+		fluid_synth_noteoff(fs, ch, e->b[1]);
+		if (*on > 0) (*on)--;
+		break;
+	case NOTE_ON:
+		fluid_synth_noteon(fs, ch, e->b[1], e->b[2]);
+		if (e->b[2] == 0) {
+			if (*on > 0) (*on)--;
+		} else if (*on < 0xff) {
+			(*on)++;
+		}
+		break;
+	case POLY_AFTERTOUCH:    fluid_synth_key_pressure(fs, ch, e->b[1], e->b[2]); break;
+	case CONTROL_CHANGE:     fluid_synth_cc(fs, ch, e->b[1], e->b[2]); break;
+	case PROGRAM_CHANGE:     fluid_synth_program_change(fs, ch, e->b[1]); break;
+	case CHANNEL_AFTERTOUCH: fluid_synth_channel_pressure(fs, ch, e->b[1]); break;
+	case PITCH_BEND:         fluid_synth_pitch_bend(fs, ch, e->b[1] + (e->b[2] << 7)); break;
+	}
 }
 
-static int read_midi_varuint(struct blob* p)
+// audio thread
+static void play_wrap(struct playback* p)
 {
-	int v = 0;
-	for (;;) {
-		int ch = read_u8(p);
-		if (ch == -1) return -1;
-		v |= (ch & 0x7f);
-		if (!(ch & 0x80)) break;
-		v <<= 7;
+	for (int ch = 0; ch < 16; ch++) {
+		for (int key = 0; key < N_NOTES; key++) {
+			if (p->notes_on[ch][key] == 0) continue;
+			fluid_synth_noteoff(g.fluid_synth, ch, key);
+			p->notes_on[ch][key] = 0;
+		}
 	}
-	return v;
+	p->frame = p->start_frame;
+	p->next_event = 0;
+	p->tempo_index = p->start_tempo_index;
+	p->n_loops++;
 }
 
-#define MThd "MThd"
-#define MTrk "MTrk"
-
-static void handle_text(const char* what, char* text, uint8_t* data, int len)
+// audio thread. retired[] has room as long as the gui collects it before
+// each post (see play_post())
+static void play_retire(struct playback* p)
 {
-	if (strlen(text) == 0) {
-		if (len < (TEXT_FIELD_SIZE-1)) {
-			memcpy(text, data, len);
-			text[len] = 0;
-		} else {
-			fprintf(stderr, "WARNING: trashing very long %s\n", what);
-		}
-	} else {
-		fprintf(stderr, "WARNING: trashing %s; already got one\n", what);
+	g.play.ended_id.store(p->id);
+	for (int i = 0; i < PLAY_MAX_RETIRED; i++) {
+		struct playback* expected = NULL;
+		if (g.play.retired[i].compare_exchange_strong(expected, p)) return;
 	}
+	assert(!"retired[] is full");
 }
 
-static char* alloc_text_field(void)
+static void play_clock_publish(int id, int64_t frame, double tick, double ticks_per_frame, double time, int n_frames, int n_loops)
 {
-	return (char*)calloc(TEXT_FIELD_SIZE, 1);
+	const unsigned seq = g.play_clock.seq.load(std::memory_order_relaxed);
+	g.play_clock.seq.store(seq+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	g.play_clock.id.store(id, std::memory_order_relaxed);
+	g.play_clock.frame.store(frame, std::memory_order_relaxed);
+	g.play_clock.tick.store(tick, std::memory_order_relaxed);
+	g.play_clock.ticks_per_frame.store(ticks_per_frame, std::memory_order_relaxed);
+	g.play_clock.time.store(time, std::memory_order_relaxed);
+	g.play_clock.n_frames.store(n_frames, std::memory_order_relaxed);
+	g.play_clock.n_loops.store(n_loops, std::memory_order_relaxed);
+	g.play_clock.seq.store(seq+2, std::memory_order_release);
 }
 
-static struct mid* mid_unmarshal_blob(struct blob blob)
+// the sequencer: events are sent between partial renders, so they land on
+// their frame (within fluidsynth's own 64 frame block)
+void miid_audio_callback(float* stream, int n_frames)
 {
-	struct blob p = blob;
-	if (!skip_magic_string(&p, MThd)) {
-		fprintf(stderr, "ERROR: bad header (fourcc)\n");
-		return NULL;
-	}
-	if (read_i32_be(&p) != 6) {
-		fprintf(stderr, "ERROR: bad header (" MThd " size not 6)\n");
-		return NULL;
-	}
-
-	const int format = read_u16_be(&p);
-	if (format != 1) {
-		fprintf(stderr, "ERROR: unsupported format %d; only format 1 is supported, sorry!\n", format);
-		return NULL;
-	}
-
-	const int n_tracks = read_u16_be(&p);
-	if (n_tracks == 0) {
-		fprintf(stderr, "ERROR: MIDI file has no tracks; aborting load\n");
-		return NULL;
-	}
-
-	const int division = read_u16_be(&p);
-	if (division >= 0x8000) {
-		fprintf(stderr, "ERROR: MIDI uses absolute time division which is not supported (v=%d)\n", division);
-		return NULL;
-	}
-
-	struct mid* mid = (struct mid*)calloc(1, sizeof *mid);
-	mid->division = division;
-	mid->text = alloc_text_field();
-	arrsetlen(mid->_trk_arr, n_tracks);
-
-	const int HAS_META = 1<<0, HAS_MIDI = 1<<1;
-	int* trk_flags = NULL;
-	arrsetlen(trk_flags, n_tracks);
-	int track_index = 0;
-	while (track_index < n_tracks) {
-		const int is_MTrk = skip_magic_string(&p, "MTrk");
-		const int chunk_size = read_i32_be(&p);
-		if (chunk_size == -1) {
-			fprintf(stderr, "ERROR: bad read");
-			return NULL;
-		}
-
-		if (!is_MTrk) {
-			if (!skip_n(&p, chunk_size)) {
-				fprintf(stderr, "ERROR: badly terminated RIFF chunk\n");
-				return NULL;
-			}
-			continue;
-		}
-
-		int remaining = chunk_size;
-		if (remaining < 0) {
-			fprintf(stderr, "ERROR: bad MTrk size\n");
-			return NULL;
-		}
-		int pos = 0;
-		struct trk* trk = &mid->_trk_arr[track_index];
-		memset(trk, 0, sizeof *trk);
-		int* flags = &trk_flags[track_index];
-		*flags = 0;
-		trk->name = alloc_text_field();
-		int end_of_track = 0;
-		int last_b0 = -1;
-		int current_midi_channel = -1;
-		while (remaining > 0) {
-			if (end_of_track) {
-				fprintf(stderr, "ERROR: premature end of track marker\n");
-				return NULL;
-			}
-			struct blob anchor = p;
-			const int delta = read_midi_varuint(&p);
-			if (delta < 0) {
-				fprintf(stderr, "ERROR: bad timestamp (%d)\n", delta);
-				return NULL;
-			}
-			pos += delta;
-
-			int b0 = read_u8(&p);
-			if (b0 < 0x80) {
-				if (last_b0 < 0x80) {
-					fprintf(stderr, "ERROR: bad sync? (last_b0=%d) (p=%ld)\n", last_b0, p.data-blob.data);
-					return NULL;
-				}
-				b0 = last_b0;
-				unread_u8(&p);
-			}
-			last_b0 = b0;
-			const int h0 = b0 & 0xf0;
-			const int nn = b0 & 0x0f;
-			int emit_mev = 0;
-			struct mev mev = {
-				.pos = pos,
-			};
-			int nstd = -1;
-			if (b0 == SYSEX) { // sysex event
-				const int len = read_midi_varuint(&p);
-				if (len < 0) {
-					fprintf(stderr, "ERROR: bad sysex length\n");
-					return NULL;
-				}
-				fprintf(stderr, "WARNING: trashing sysex chunk (len=%d)\n", len);
-				skip_n(&p, len-1);
-				if (read_u8(&p) != 0xf7) {
-					fprintf(stderr, "ERROR: bad sysex block\n");
-					return NULL;
-				}
-			} else if (b0 == META) { // meta event
-				const int type = read_u8(&p);
-				int write_nmeta = -1;
-				if (type < 0) {
-					fprintf(stderr, "ERROR: bad meta type read\n");
-					return NULL;
-				}
-				const int len = read_midi_varuint(&p);
-				if (len < 0) {
-					fprintf(stderr, "ERROR: bad meta type len\n");
-					return NULL;
-				}
-				uint8_t* data = read_data(&p, len);
-				if (data == NULL) {
-					fprintf(stderr, "ERROR: bad data\n");
-					return NULL;
-				}
-				if (type == TEXT) {
-					handle_text("TEXT", mid->text, data, len);
-				} else if (type == TRACK_NAME) {
-					handle_text("TRACK TITLE", trk->name, data, len);
-				} else if (type == INSTRUMENT_NAME) {
-					fprintf(stderr, "WARNING: trashing INSTRUMENT NAME\n");
-				} else if (type == MARKER) {
-					fprintf(stderr, "WARNING: trashing MARKER\n");
-				} else if (type == MIDI_CHANNEL) {
-					if (len != 1) {
-						fprintf(stderr, "ERROR: expected len=1 for MIDI_CHANNEL\n");
-						return NULL;
-					}
-					if (current_midi_channel == -1) {
-						current_midi_channel = data[0];
-					} else {
-						fprintf(stderr, "WARNING: trashing surplus midi channel meta event\n");
-					}
-				} else if (type == END_OF_TRACK) {
-					if (len != 0) {
-						fprintf(stderr, "ERROR: expected len=0 for END_OF_TRACK\n");
-						return NULL;
-					}
-					end_of_track = 1;
-					if (pos >= mid->end_of_song_pos) {
-						mid->end_of_song_pos = pos;
-					}
-				} else if (type == SET_TEMPO) {
-					if (len != 3) {
-						fprintf(stderr, "ERROR: expected len=3 for SET_TEMPO\n");
-						return NULL;
-					}
-					write_nmeta = 3;
-				} else if (type == SMPTE_OFFSET) {
-					if (len != 5) {
-						fprintf(stderr, "ERROR: expected len=5 for SMPTE_OFFSET\n");
-						return NULL;
-					}
-
-					fprintf(stderr, "WARNING: trashing SMPTE OFFSET %d:%d:%d %d %d\n", data[0], data[1], data[2], data[3], data[4]);
-				} else if (type == TIME_SIGNATURE) {
-					if (len != 4) {
-						fprintf(stderr, "ERROR: expected len=4 for TIME_SIGNATURE\n");
-						return NULL;
-					}
-					write_nmeta = 2;
-				} else if (type == KEY_SIGNATURE) {
-					fprintf(stderr, "WARNING: trashing KEY SIGNATURE\n");
-				} else if (type == CUSTOM) {
-					// NOTE could put my own stuff here
-					fprintf(stderr, "WARNING: trashing sequencer specific meta event\n");
-				} else {
-					fprintf(stderr, "WARNING: trashing unknown meta event type 0x%.2x\n", type);
-				}
-
-				if (write_nmeta >= 0) {
-					assert((type < 0x80) && "conflict with normal MIDI");
-					assert(0 <= write_nmeta && write_nmeta < 4);
-					memset(mev.b, 0, ARRAY_LENGTH(mev.b));
-					mev.b[0] = type;
-					for (int i = 0; i < write_nmeta; i++) {
-						mev.b[i+1] = data[i];
-					}
-					*flags |= HAS_META;
-					emit_mev = 1;
-				}
-			} else if (h0 == NOTE_OFF) {
-				nstd = 2;
-			} else if (h0 == NOTE_ON) {
-				nstd = 2;
-			} else if (h0 == POLY_AFTERTOUCH) {
-				nstd = 2;
-			} else if (h0 == CONTROL_CHANGE) {
-				nstd = 2;
-			} else if (h0 == PROGRAM_CHANGE) {
-				nstd = 1;
-			} else if (h0 == CHANNEL_AFTERTOUCH) {
-				nstd = 1;
-			} else if (h0 == PITCH_BEND) {
-				nstd = 2;
-			} else {
-				fprintf(stderr, "ERROR: bad sync? (b0=%d) (p=%ld)\n", b0, p.data-blob.data);
-				return NULL;
-			}
-			if (nstd >= 0) {
-				if (nn != current_midi_channel) {
-					if (current_midi_channel == -1) {
-						current_midi_channel = nn;
-					}
-					if (nn != current_midi_channel) {
-						fprintf(stderr, "ERROR: channel mismatch nn=%d vs meta=%d\n", nn, current_midi_channel);
-						return NULL;
-					}
-				}
-				mev.b[0] = b0 & 0xf0; // remove channel (channel is fixed for entire track)
-				for (int i = 0; i < nstd; i++) {
-					int v = read_u8(&p);
-					if (v < 0 || v >= 0x80) {
-						fprintf(stderr, "ERROR: bad MIDI event read (p=%ld)\n", p.data-blob.data);
-						return NULL;
-					}
-					mev.b[i+1] = v;
-				}
-				*flags |= HAS_MIDI;
-				emit_mev = 1;
-				#if 0
-				if (h0 == PROGRAM_CHANGE) {
-					printf("PRG %d on channel %d\n", mev.b[1], mev.b[0]&0xf);
-				}
-				#endif
-				if (h0 == CONTROL_CHANGE) {
-					const int controller = mev.b[1];
-					switch (controller) {
-						case VOLUME:
-						case PAN:
-						case MODULATION_WHEEL:
-						case DAMPER_PEDAL:
-						case EFFECT1_DEPTH:
-						case EFFECT3_DEPTH:
-						case RESET_ALL_CONTROLLERS:
-							// handled (?)
-							break;
-						default:
-							fprintf(stderr, "WARNING: trashing CC[%d]=%d event on channel %d\n", mev.b[1], mev.b[2], mev.b[0]&0xf);
-							emit_mev = 0;
-							break;
-					}
-				} else if (h0 == POLY_AFTERTOUCH) {
-					fprintf(stderr, "WARNING: trashing POLY_AFTERTOUCH\n");
-					emit_mev = 0;
-				} else if (h0 == CHANNEL_AFTERTOUCH) {
-					fprintf(stderr, "WARNING: trashing CHANNEL_AFTERTOUCH\n");
-					emit_mev = 0;
-				}
-			}
-			if (emit_mev) {
-				arrput(trk->mev_arr, mev);
-			}
+	const double time = get_time();
+	const size_t fsz = 2*sizeof(float);
+	memset(stream, 0, fsz * n_frames);
 
-			const int n_read = p.data - anchor.data;
-			assert(n_read > 0);
-			remaining -= n_read;
-		}
-		if (remaining != 0) {
-			fprintf(stderr, "ERROR: bad sync? (remaining=%d) (p=%ld)\n", remaining, p.data-blob.data);
-			return NULL;
+	struct playback* post = g.play.mailbox.exchange(NULL);
+	if (post != NULL) {
+		if (g.play.current != NULL) {
+			fluid_synth_all_notes_off(g.fluid_synth, -1);
+			play_retire(g.play.current);
+			g.play.current = NULL;
 		}
-		if (!end_of_track) {
-			fprintf(stderr, "ERROR: encountered no end of track marker\n");
-			return NULL;
-		}
-
-		if (current_midi_channel == -1) {
-			// XXX typically seen on first MTrk?
-			fprintf(stderr, "WARNING: no MIDI channel (MTrk index %d)\n", track_index);
-			trk->midi_channel = -1;
+		if (post->id == 0) {
+			play_retire(post);
 		} else {
-			trk->midi_channel = current_midi_channel;
-			assert(trk->midi_channel >= 0);
-		}
-
-		int n_note_on = 0;
-		int n_note_off = 0;
-		for (struct mev* e = trk->mev_arr; e < trk->mev_arr + arrlen(trk->mev_arr); e++) {
-			if (e->b[0] == NOTE_ON && e->b[2] == 0) {
-				// XXX is this appropriate? is it a trk
-				// "config" like "percussion"? does fluidsynth
-				// play it differently?
-				e->b[0] = NOTE_OFF;
-			}
-			switch (e->b[0]) {
-			case NOTE_ON:  n_note_on++;  break;
-			case NOTE_OFF: n_note_off++; break;
-			}
-		}
-		if (n_note_on > 0 && n_note_off == 0) {
-			trk->percussive = true;
+			g.play.current = post;
 		}
-
-		track_index++;
 	}
 
-	if (p.size > 0) {
-		fprintf(stderr, "WARNING: ignoring %zd bytes of trailing garbage\n", p.size);
+	struct playback* p = g.play.current;
+	if (p == NULL) {
+		fluid_synth_write_float(g.fluid_synth,
+			n_frames,
+			stream, 0, 2,
+			stream, 1, 2);
+		play_clock_publish(0, 0, 0, 0, time, n_frames, 0);
+		return;
 	}
 
-	// we have a constraint that the first track must be a tempo/time
-	// signature track, and the rest must be "normal" tracks (and they
-	// cannot be mixed). this seems to hold for the MIDI files I've seen,
-	// and it makes it easier to use the data as-is. it wouldn't be hard to
-	// FIXME but I need a file that breaks this convention.
-	for (int i = 0; i < n_tracks; i++) {
-		const int flags = trk_flags[i];
-		if ((flags & HAS_META) && (flags & HAS_MIDI)) {
-			// mixed track
-			fprintf(stderr, "ERROR: FIXME fixup not implemented (/1)\n");
-			return NULL;
-		}
-		if (flags & HAS_META) {
-			if (i != 0) {
-				// meta track is not first
-				fprintf(stderr, "ERROR: FIXME fixup not implemented (/2)\n");
-				return NULL;
-			}
-		} else if (flags & HAS_MIDI) {
-			if (i == 0) {
-				// first track is "normal"
-				fprintf(stderr, "ERROR: FIXME fixup not implemented (/3)\n");
-				return NULL;
-			}
-		}
+	// position at the start of this buffer
+	const int n_tempos = arrlen(p->tempo_arr);
+	while (p->tempo_index+1 < n_tempos && p->tempo_arr[p->tempo_index+1].frame <= p->frame) p->tempo_index++;
+	const struct play_tempo* tempo = &p->tempo_arr[p->tempo_index];
+	play_clock_publish(p->id, p->frame, tempo->tick + (double)(p->frame - tempo->frame) * tempo->ticks_per_frame, tempo->ticks_per_frame, time, n_frames, p->n_loops);
+
+	// a short loop may wrap several times per buffer
+	const int n_events = arrlen(p->event_arr);
+	int done = 0;
+	while (done < n_frames) {
+		if (p->loop && p->frame >= p->end_frame) play_wrap(p);
+		while (p->next_event < n_events && p->event_arr[p->next_event].frame <= p->frame) {
+			play_send(p, &p->event_arr[p->next_event++]);
+		}
+		int n = n_frames - done;
+		if (p->next_event < n_events) {
+			const int64_t d = p->event_arr[p->next_event].frame - p->frame;
+			if (d < n) n = (int)d;
+		}
+		if (p->loop && p->end_frame - p->frame < n) n = (int)(p->end_frame - p->frame);
+		fluid_synth_write_float(g.fluid_synth,
+			n,
+			stream, 2*done, 2,
+			stream, 2*done+1, 2);
+		done += n;
+		p->frame += n;
 	}
 
-	#if 0
-	printf("song length: %d\n", mid->end_of_song_pos);
-	#endif
-
-	return mid;
+	if (!p->loop && p->next_event >= n_events && p->frame >= p->end_frame) {
+		play_retire(p);
+		g.play.current = NULL;
+	}
 }
 
-static void marshal_raw_string(uint8_t** data_arr, const char* str)
+static void play_free(struct playback* p)
 {
-	size_t n = strlen(str);
-	uint8_t* dst = arraddnptr(*data_arr, n);
-	memcpy(dst, str, n);
+	arrfree(p->event_arr);
+	arrfree(p->tempo_arr);
+	free(p);
 }
 
-static void store_u32_be(uint8_t* p, unsigned v)
+// frees what the audio thread is done with. the gui calls it every frame,
+// and before every post, so retired[] never fills up
+static void play_collect(void)
 {
-	for (int i = 0; i < 4; i++) {
-		p[i] = (v >> 24);
-		v = (v & 0xffffff) << 8;
+	for (int i = 0; i < PLAY_MAX_RETIRED; i++) {
+		struct playback* p = g.play.retired[i].exchange(NULL);
+		if (p != NULL) play_free(p);
 	}
 }
 
-static void marshal_u32_be(uint8_t** data_arr, unsigned v)
+static void play_post(struct playback* p)
 {
-	uint8_t* p = arraddnptr(*data_arr, 4);
-	store_u32_be(p, v);
+	play_collect();
+	struct playback* old = g.play.mailbox.exchange(p);
+	if (old != NULL) play_free(old); // never picked up
+	g.play.posted_id = p->id;
 }
 
-static void store_u16_be(uint8_t* p, unsigned v)
+static int play_event_compar(const void* va, const void* vb)
 {
-	p[0] = (v >> 8) & 0xff;
-	p[1] = v & 0xff;
+	const struct play_event* a = (const struct play_event*)va;
+	const struct play_event* b = (const struct play_event*)vb;
+	if (a->frame != b->frame) return a->frame < b->frame ? -1 : 1;
+	return a->seq - b->seq;
 }
 
-static void marshal_u16_be(uint8_t** data_arr, unsigned v)
-{
-	uint8_t* p = arraddnptr(*data_arr, 2);
-	store_u16_be(p, v);
-}
+static struct note_index* get_note_index(int track_index);
 
-static void marshal_u8(uint8_t** data_arr, unsigned v)
+// plays from pos; with loop_end > pos, loops [pos;loop_end) until stopped
+static void play_start(struct state* st, int pos, int loop_end)
 {
-	uint8_t* p = arraddnptr(*data_arr, 1);
-	*p = v;
-}
+	assert(st == curstate()); // see get_note_index()
+	struct mid* mid = st->myd;
+	struct tempo_map* tm = &st->tempo_map;
+	tempo_map_update(tm, mid);
+	const double sr = g.sample_rate;
+
+	struct playback* p = (struct playback*)calloc(1, sizeof *p);
+	p->id = ++g.play.next_id;
+	if (p->id <= 0) p->id = g.play.next_id = 1;
+
+	const int n_marks = arrlen(tm->mark_arr);
+	arrput(p->tempo_arr, ((struct play_tempo) {
+		.frame = 0,
+		.tick = 0,
+		.ticks_per_frame = (double)mid->division * 1e6 / ((double)DEFAULT_US_PER_QN * sr),
+	}));
+	for (int i = 0; i < n_marks; i++) {
+		struct tempo_mark* m = &tm->mark_arr[i];
+		arrput(p->tempo_arr, ((struct play_tempo) {
+			.frame = (int64_t)llround(m->usec * 1e-6 * sr),
+			.tick = (double)m->pos,
+			.ticks_per_frame = (double)mid->division * 1e6 / ((double)m->us_per_qn * sr),
+		}));
+	}
 
-static void marshal_copy(uint8_t** data_arr, uint8_t* p, int n)
-{
-	if (n == 0) return;
-	uint8_t* d = arraddnptr(*data_arr, n);
-	memcpy(d, p, n);
-}
+	const int64_t start_frame = (int64_t)llround(tempo_map_seconds(tm, pos) * sr);
+	int seq = 0;
+	const bool loop = loop_end > pos;
+	int end_pos = loop ? loop_end : mid->end_of_song_pos;
+	const int n_tracks = mid_get_track_count(mid);
 
-static void marshal_midi_varuint(uint8_t** data_arr, unsigned v)
-{
-	int n_bytes = 1;
-	unsigned vc = v;
-	for (;;) {
-		vc >>= 7;
-		if (vc == 0) break;
-		n_bytes++;
+	// chase: first bring the channels to where they'd be at pos, then
+	// strike the notes that are held over it, so that every NOTE OFF
+	// that follows has its NOTE ON
+	struct chase_index* ci = &st->chase_index;
+	chase_index_update(ci, mid);
+	struct chase_state cs;
+	chase_index_get(ci, pos, &cs);
+	bool used_channels[16] = {0};
+	for (int i = 0; i < n_tracks; i++) {
+		const int ch = mid_get_trk(mid, i)->midi_channel;
+		if (ch >= 0) used_channels[ch] = true;
 	}
-	uint8_t* p = arraddnptr(*data_arr, n_bytes);
-	for (int i = 0; i < n_bytes; i++) {
-		p[i] = ((v >> ((n_bytes-1-i)*7)) & 0x7f) | ((i < (n_bytes-1)) ? 0x80 : 0);
+	for (int ch = 0; ch < 16; ch++) {
+		if (!used_channels[ch]) continue;
+		uint8_t msgs[CHASE_MAX_MESSAGES][3];
+		const int n = chase_channel_messages(&cs.ch[ch], ch, msgs);
+		for (int j = 0; j < n; j++) {
+			arrput(p->event_arr, ((struct play_event) {
+				.frame = start_frame,
+				.seq = seq++,
+				.b = { msgs[j][0], msgs[j][1], msgs[j][2] },
+			}));
+		}
 	}
-}
+	struct note_hit* hit_arr = NULL;
+	for (int i = 0; i < n_tracks; i++) {
+		struct trk* trk = mid_get_trk(mid, i);
+		if (trk->midi_channel < 0 || trk->percussive || pos <= 0) continue;
+		arrsetlen(hit_arr, 0);
+		note_index_query(get_note_index(i), 0, N_NOTES-1, pos, pos, &hit_arr);
+		for (int j = 0; j < arrlen(hit_arr); j++) {
+			const struct note_hit* h = &hit_arr[j];
+			if (!(h->start < pos && pos < h->end)) continue;
+			const int k = trk_find_note_on(trk, h->key, h->start);
+			if (k < 0) continue; // lasts from a NOTE OFF; nothing sounds
+			arrput(p->event_arr, ((struct play_event) {
+				.frame = start_frame,
+				.seq = seq++,
+				.b = { (uint8_t)(NOTE_ON | trk->midi_channel), (uint8_t)h->key, trk->mev_arr[k].b[2] },
+			}));
+		}
+	}
+	arrfree(hit_arr);
 
-static void evbegin(int pos, int* cursor, uint8_t** data_arr)
-{
-	int delta = pos - *cursor;
-	assert((delta >= 0) && "bad event ordering");
-	marshal_midi_varuint(data_arr, delta);
-	*cursor = pos;
+	for (int i = 0; i < n_tracks; i++) {
+		struct trk* trk = mid_get_trk(mid, i);
+		if (trk->midi_channel < 0) continue;
+		const int n = arrlen(trk->mev_arr);
+		for (int j = mev_lower_bound(trk->mev_arr, n, pos); j < n; j++) {
+			struct mev* mev = &trk->mev_arr[j];
+			if (loop && mev->pos >= loop_end) break;
+			if (mev->b[0] < NOTE_OFF || mev->b[0] >= SYSEX) continue;
+			// NOTE OFFs sort first, so these end notes from before pos
+			if (mev->pos == pos && (mev->b[0] == NOTE_OFF || (mev->b[0] == NOTE_ON && mev->b[2] == 0))) continue;
+			if (mev->pos > end_pos) end_pos = mev->pos;
+			arrput(p->event_arr, ((struct play_event) {
+				.frame = (int64_t)llround(tempo_map_seconds(tm, mev->pos) * sr),
+				.seq = seq++,
+				.b = { (uint8_t)(mev->b[0] | trk->midi_channel), mev->b[1], mev->b[2] },
+			}));
+		}
+	}
+	if (arrlen(p->event_arr) > 0) qsort(p->event_arr, arrlen(p->event_arr), sizeof *p->event_arr, play_event_compar);
+
+	p->frame = p->start_frame = start_frame;
+	p->end_frame = (int64_t)llround(tempo_map_seconds(tm, end_pos) * sr);
+	p->loop = loop && p->end_frame > p->start_frame;
+	while (p->tempo_index+1 < arrlen(p->tempo_arr) && p->tempo_arr[p->tempo_index+1].frame <= p->frame) p->tempo_index++;
+	p->start_tempo_index = p->tempo_index;
+
+	play_post(p);
+	g.play.state = st;
+	g.play.start_pos = pos;
+	g.play.loop_end_pos = p->loop ? loop_end : pos;
 }
 
-static uint8_t* evmeta(uint8_t** data_arr, enum meta_type t, int n)
+static void play_stop(void)
 {
-	marshal_u8(data_arr, META);
-	marshal_u8(data_arr, t);
-	marshal_midi_varuint(data_arr, n);
-	if (n > 0) {
-		uint8_t* p = arraddnptr(*data_arr, n);
-		memset(p, 0, n);
-		return p;
-	} else {
-		assert(n == 0);
-		return NULL;
-	}
+	if (g.play.posted_id == 0) return;
+	struct playback* p = (struct playback*)calloc(1, sizeof *p);
+	play_post(p);
+	g.play.state = NULL;
 }
 
-static void evmetastr(uint8_t** data_arr, enum meta_type t, char* str)
+static bool play_is_playing(struct state* st)
 {
-	const size_t n = strlen(str);
-	uint8_t* p = evmeta(data_arr, t, n);
-	memcpy(p, str, n);
+	if (g.play.posted_id == 0 || g.play.state != st) return false;
+	if (g.play.ended_id.load() == g.play.posted_id) {
+		g.play.posted_id = 0;
+		g.play.state = NULL;
+		return false;
+	}
+	return true;
 }
 
-static int last_marshal_size;
-static uint8_t* mid_marshal_arr(struct mid* mid)
+// the song position being heard now, in ticks: where the audio thread was
+// at its last callback, moved on by the time since then minus the device
+// latency (taken as one buffer). false if st is not playing, or the audio
+// thread has not started on it yet
+static bool play_get_tick(struct state* st, double* tick)
 {
-	uint8_t* bs = NULL;
-	if (last_marshal_size > 0) {
-		arrsetcap(bs, last_marshal_size);
+	if (!play_is_playing(st)) return false;
+	int id, n_frames, n_loops;
+	double tick0, ticks_per_frame, time;
+	for (;;) {
+		const unsigned seq = g.play_clock.seq.load(std::memory_order_acquire);
+		if (seq & 1) continue;
+		id = g.play_clock.id.load(std::memory_order_relaxed);
+		tick0 = g.play_clock.tick.load(std::memory_order_relaxed);
+		ticks_per_frame = g.play_clock.ticks_per_frame.load(std::memory_order_relaxed);
+		time = g.play_clock.time.load(std::memory_order_relaxed);
+		n_frames = g.play_clock.n_frames.load(std::memory_order_relaxed);
+		n_loops = g.play_clock.n_loops.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (g.play_clock.seq.load(std::memory_order_relaxed) == seq) break;
 	}
-
-	const int n_tracks = arrlen(mid->_trk_arr);
-
-	marshal_raw_string(&bs, MThd);
-	marshal_u32_be(&bs, 6);
-	marshal_u16_be(&bs, 1);
-	marshal_u16_be(&bs, n_tracks);
-	marshal_u16_be(&bs, mid->division);
-
-	for (int track_index = 0; track_index < n_tracks; track_index++) {
-		marshal_raw_string(&bs, MTrk);
-		const int MTrk_chunk_size_offset = arrlen(bs);
-		marshal_u32_be(&bs, -1); // to be written when we know...
-
-		struct trk* trk = &mid->_trk_arr[track_index];
-
-		int cursor = 0;
-
-		evbegin(0, &cursor, &bs);
-		evmetastr(&bs, TRACK_NAME, trk->name);
-
-		const int midi_channel = trk->midi_channel;
-
-		if (midi_channel >= 0) {
-			evbegin(0, &cursor, &bs);
-			uint8_t* p = evmeta(&bs, MIDI_CHANNEL, 1);
-			p[0] = midi_channel;
-		}
-
-		const int n_mev = arrlen(trk->mev_arr);
-		int last_midi_cmd = -1;
-		for (int mev_index = 0; mev_index < n_mev; mev_index++) {
-			struct mev* mev = &trk->mev_arr[mev_index];
-			evbegin(mev->pos, &cursor, &bs);
-			const uint8_t b0 = mev->b[0];
-			int nw = -1;
-			int nmeta = -1;
-			uint8_t meta[4] = {0};
-			if (b0 == SET_TEMPO) {
-				for (int i = 0; i < 3; i++) {
-					meta[i] = mev->b[i+1];
-				}
-				nmeta = 3;
-			} else if (b0 == TIME_SIGNATURE) {
-				for (int i = 0; i < 2; i++) {
-					meta[i] = mev->b[i+1];
-				}
-				meta[2] = 0x24; // XXX?
-				meta[3] = 0x08; // XXX?
-				nmeta = 4;
-			} else {
-				switch (b0 & 0xf0) {
-				case NOTE_OFF:
-				case NOTE_ON:
-				case CONTROL_CHANGE:
-				case PITCH_BEND:
-					nw = 2;
-					break;
-				case PROGRAM_CHANGE:
-					nw = 1;
-					break;
-				default:
-					assert(!"unexpected MIDI event");
-				}
-			}
-			if (nw >= 0) {
-				assert(0 < nw && nw <= 3);
-				const int ch = midi_channel;
-				assert(0 <= ch && ch < 16);
-				const int midi_cmd = (b0&0xf0) + ch;
-				if (midi_cmd != last_midi_cmd) {
-					marshal_u8(&bs, midi_cmd);
-					last_midi_cmd = midi_cmd;
-				}
-				for (int i = 0; i < nw; i++) {
-					const int v = mev->b[i+1];
-					assert((0 <= v && v < 0x80) && "MIDI argument must not have bit 7 set");
-					marshal_u8(&bs, v);
-				}
-			} else if (nmeta >= 0) {
-				const int n0 = arrlen(bs);
-				marshal_u8(&bs, META);
-				marshal_u8(&bs, b0);
-				marshal_u8(&bs, nmeta);
-				marshal_copy(&bs, meta, nmeta);
-				const int n1 = arrlen(bs);
-				assert((n1-n0) == (3+nmeta));
-				last_midi_cmd = -1;
-			} else {
-				assert(!"UNREACHABLE");
-			}
-		}
-
-		evbegin(mid->end_of_song_pos, &cursor, &bs);
-		evmeta(&bs, END_OF_TRACK, 0);
-
-		assert(cursor == mid->end_of_song_pos);
-
-		const int chunk_size = arrlen(bs) - (MTrk_chunk_size_offset + 4);
-		store_u32_be(&bs[MTrk_chunk_size_offset], chunk_size);
+	if (id != g.play.posted_id) return false;
+	const double latency = (double)n_frames / g.sample_rate;
+	double dt = get_time() - time - latency;
+	// no further than one buffer either way, if a callback is late
+	if (dt < -latency) dt = -latency;
+	if (dt > latency) dt = latency;
+	*tick = tick0 + dt * g.sample_rate * ticks_per_frame;
+	const int p0 = g.play.start_pos, p1 = g.play.loop_end_pos;
+	if (p1 > p0) {
+		// extrapolated over a wrap, either way
+		if (*tick >= p1) *tick -= p1 - p0;
+		if (*tick < p0 && n_loops > 0) *tick += p1 - p0;
 	}
-
-	last_marshal_size = arrlen(bs);
-	printf("mtsz=%d\n", last_marshal_size);
-	return bs;
+	if (*tick < p0) *tick = p0;
+	return true;
 }
 
 static inline float getsz(float scalar)
@@ -940,14 +741,6 @@ static inline float getsz(float scalar)
 	return CFLOAT(gui_size) * scalar;
 }
 
-static inline int dshift(int v, int shift)
-{
-	if (shift == 0) return v;
-	if (shift > 0) return v << shift;
-	if (shift < 0) return v >> (-shift);
-	assert(!"UNREACHABLE");
-}
-
 ImVec4 color_scale(ImVec4 c, float s)
 {
 	return ImVec4(c.x*s, c.y*s, c.z*s, c.w);
@@ -970,15 +763,14 @@ static void track_toggle(int index)
 	if (mid == NULL) return;
 	const int n = mid_get_track_count(mid);
 	if (!(0 <= index && index < n)) return;
-	if (index >= ARRAY_LENGTH(state->track_select_set)) return;
-	if (state->track_select_set[index] > 0) {
-		state->track_select_set[index] = 0;
+	if (bitset_get(&state->track_select_set, index)) {
+		bitset_put(&state->track_select_set, index, false);
 		if (index == state->primary_track_select) {
 			state->primary_track_select = -1;
 		}
 	} else {
 		state->primary_track_select = index;
-		state->track_select_set[index] = 1;
+		bitset_put(&state->track_select_set, index, true);
 	}
 }
 
@@ -1123,28 +915,95 @@ static inline bool note_render_next(struct note_render* r)
 	return false;
 }
 
+struct note_quad {
+	float x0, y0, x1, y1;
+	ImU32 color;
+};
+
+// writes n filled quads straight into the draw list, reserving vertices
+// and indices per chunk instead of per rect. with border_size > 0 every
+// quad also gets a border_color frame along its inside edges (like
+// AddRect() with thickness 1, but without anti-aliasing)
+static void emit_note_quads(ImDrawList* dl, const struct note_quad* quads, int n, ImU32 border_color, float border_size)
+{
+	const bool border = border_size > 0 && (border_color & IM_COL32_A_MASK) != 0;
+	const int vpn = border ? 4+8 : 4;  // vertices per note
+	const int ipn = border ? 6+24 : 6; // indices per note
+	const int CHUNK = 1<<12;
+	const ImVec2 uv = dl->_Data->TexUvWhitePixel;
+	for (int i0 = 0; i0 < n; i0 += CHUNK) {
+		const int nc = n-i0 < CHUNK ? n-i0 : CHUNK;
+		dl->PrimReserve(nc*ipn, nc*vpn);
+		ImDrawVert* __restrict vtx = dl->_VtxWritePtr;
+		ImDrawIdx* __restrict idx = dl->_IdxWritePtr;
+		ImDrawIdx vi = (ImDrawIdx)dl->_VtxCurrentIdx;
+		#define VTX(I,X,Y,COL) vtx[I].pos.x = X; vtx[I].pos.y = Y; vtx[I].uv = uv; vtx[I].col = COL;
+		#define TRI(I,A,B,C) idx[I] = vi+(A); idx[I+1] = vi+(B); idx[I+2] = vi+(C);
+		for (int i = 0; i < nc; i++) {
+			const struct note_quad q = quads[i0+i];
+			VTX(0, q.x0, q.y0, q.color)
+			VTX(1, q.x1, q.y0, q.color)
+			VTX(2, q.x1, q.y1, q.color)
+			VTX(3, q.x0, q.y1, q.color)
+			TRI(0, 0,1,2)
+			TRI(3, 0,2,3)
+			if (border) {
+				// outer corners 4-7, inner corners 8-11; two
+				// triangles per edge
+				const float tx = fminf(border_size, (q.x1-q.x0)*0.5f);
+				const float ty = fminf(border_size, (q.y1-q.y0)*0.5f);
+				VTX(4,  q.x0,    q.y0,    border_color)
+				VTX(5,  q.x1,    q.y0,    border_color)
+				VTX(6,  q.x1,    q.y1,    border_color)
+				VTX(7,  q.x0,    q.y1,    border_color)
+				VTX(8,  q.x0+tx, q.y0+ty, border_color)
+				VTX(9,  q.x1-tx, q.y0+ty, border_color)
+				VTX(10, q.x1-tx, q.y1-ty, border_color)
+				VTX(11, q.x0+tx, q.y1-ty, border_color)
+				TRI(6,  4,5,9)  TRI(9,  4,9,8)
+				TRI(12, 5,6,10) TRI(15, 5,10,9)
+				TRI(18, 6,7,11) TRI(21, 6,11,10)
+				TRI(24, 7,4,8)  TRI(27, 7,8,11)
+			}
+			vtx += vpn;
+			idx += ipn;
+			vi += vpn;
+		}
+		#undef TRI
+		#undef VTX
+		dl->_VtxWritePtr = vtx;
+		dl->_IdxWritePtr = idx;
+		dl->_VtxCurrentIdx = vi;
+	}
+}
+
+// velocity => packed note color of primary or other track notes; rebuilt
+// when the config or the style alpha changes
+static const ImU32* get_note_palette(bool is_other)
+{
+	const float alpha = ImGui::GetStyle().Alpha;
+	if (!g.note_palette.valid || g.note_palette.config_hash != config_snapshot.hash || g.note_palette.alpha != alpha) {
+		const ImVec4 c0 = CCOL(pianoroll_note_color0);
+		const ImVec4 c1 = CCOL(pianoroll_note_color1);
+		for (int velocity = 0; velocity < N_NOTES; velocity++) {
+			const ImVec4 cc = imvec4_lerp(c0, c1, (float)velocity / 127.0f);
+			g.note_palette.primary[velocity] = ImGui::GetColorU32(cc);
+			g.note_palette.other[velocity] = ImGui::GetColorU32(CCOLTX(cc, pianoroll_note_other_track_coltx));
+		}
+		g.note_palette.valid = true;
+		g.note_palette.config_hash = config_snapshot.hash;
+		g.note_palette.alpha = alpha;
+	}
+	return is_other ? g.note_palette.other : g.note_palette.primary;
+}
+
 static int map_row_to_track_index(int row_index)
 {
 	if (row_index <= 0) return -1;
 	struct state* state = curstate();
-	struct mid* mid = state->myd;
-	const int n_tracks = mid_get_track_count(mid);
-	if (state->header.track_show_mode == SHOW_ALL_TRACKS) {
-		return row_index - 1;
-	} else if (state->header.track_show_mode == SHOW_SELECTED_TRACKS) {
-		int cmp = 0;
-		for (int i = 0; i < n_tracks; i++) {
-			if (state->track_show_set[i]) {
-				if (cmp == (row_index-1)) {
-					return i;
-				}
-				cmp++;
-			}
-		}
-		return -1;
-	} else {
-		return -1;
-	}
+	const int i = state->header.scroll_row + row_index - 1;
+	if (i >= arrlen(state->header.track_display_arr)) return -1;
+	return state->header.track_display_arr[i];
 }
 
 static int must_map_row_to_track_index(int row_index)
@@ -1293,26 +1152,623 @@ static void g_prefs(void)
 	#define MUL_RGB(X)  coltxpick(label, &cval->v4, &cval->t);
 	#define MUL_RGBA(X) coltxpick(label, &cval->v4, &cval->t);
 
-	#define C(NAME,TYPE) \
-	{ \
-		pretty_label(label, #NAME); \
-		cval = CN(NAME) >= CONFIG_END ? NULL : config_get_cval(CN(NAME)); \
-		TYPE \
+	#define C(NAME,TYPE) \
+	{ \
+		pretty_label(label, #NAME); \
+		cval = CN(NAME) >= CONFIG_END ? NULL : config_get_cval(CN(NAME)); \
+		TYPE \
+	}
+	EMIT_CONFIGS
+	#undef C
+	#undef KEY
+	#undef RGB
+	#undef RGBA
+	#undef ADD_RGB
+	#undef ADD_RGBA
+	#undef SUB_RGB
+	#undef SUB_RGBA
+	#undef MUL_RGB
+	#undef MUL_RGBA
+	#undef SLIDE
+	#undef PX
+	#undef BOOL
+}
+
+// sliders transform the velocities the NOTE ONs had when the drag began, and
+// spring back to neutral when released, so every drag is one edit
+static void g_velocity_ops(const bool* track_mask, bool whole_song, const char* scope)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const union timespan ts = st->selected_timespan;
+	struct vel_index* vi = &st->velocity.index;
+	struct vel_params* vp = &st->velocity.params;
+
+	const int n_tracks = mid_get_track_count(mid);
+	uint64_t mask_hash = FNV1A64_INIT;
+	if (!whole_song) mask_hash = fnv1a64(mask_hash, track_mask, n_tracks * sizeof track_mask[0]);
+	if (ts.end > ts.start && (vi->revision != mid->revision || vi->timespan.start != ts.start || vi->timespan.end != ts.end || st->velocity.mask_hash != mask_hash)) {
+		vel_index_build(vi, mid, ts, whole_song ? NULL : track_mask);
+		st->velocity.mask_hash = mask_hash;
+	}
+
+	ImGui::SeparatorText("Velocity");
+	static const char* op_names[] = {
+		"Scale",
+		"Offset",
+		"Compress/expand",
+		"Linear ramp",
+		"Exponential ramp",
+		"Humanise",
+	};
+	static_assert(ARRAY_LENGTH(op_names) == N_VEL_OPS, "op_names out of sync");
+	ImGui::SetNextItemWidth(getsz(12));
+	ImGui::Combo("##velop", &vp->op, op_names, N_VEL_OPS);
+	ImGui::SameLine();
+	ImGui::Text("%d notes in %s", (int)arrlen(vi->vel0_arr), scope);
+
+	bool changed = false, released = false;
+	#define SLIDER(FN, LABEL, V, V0, V1, FMT) \
+		ImGui::SetNextItemWidth(getsz(20)); \
+		changed |= ImGui::FN(LABEL, V, V0, V1, FMT, ImGuiSliderFlags_AlwaysClamp); \
+		released |= ImGui::IsItemDeactivatedAfterEdit();
+	switch (vp->op) {
+	case VEL_SCALE:
+		SLIDER(SliderFloat, "Factor", &vp->factor, 0.0f, 4.0f, "%.2fx")
+		break;
+	case VEL_OFFSET:
+		SLIDER(SliderFloat, "Offset", &vp->offset, -127.0f, 127.0f, "%+.0f")
+		break;
+	case VEL_COMPRESS:
+		SLIDER(SliderFloat, "Pivot", &vp->pivot, 1.0f, 127.0f, "%.0f")
+		changed = released = false; // pivot is a setting, not an edit
+		SLIDER(SliderFloat, "Amount", &vp->amount, 0.0f, 2.0f, "%.2fx")
+		break;
+	case VEL_RAMP_LINEAR:
+	case VEL_RAMP_EXP:
+		SLIDER(SliderFloat, "From", &vp->from, 0.0f, 2.0f, "%.2fx")
+		SLIDER(SliderFloat, "To", &vp->to, 0.0f, 2.0f, "%.2fx")
+		break;
+	case VEL_HUMANISE:
+		SLIDER(SliderFloat, "Jitter", &vp->jitter, 0.0f, 64.0f, "+/-%.0f")
+		break;
+	default: assert(!"unhandled velocity op");
+	}
+	#undef SLIDER
+	MaybeSetItemTooltip("Drag to edit the velocities of the notes in the selection; releases back to neutral");
+
+	if (changed && arrlen(vi->vel0_arr) > 0) vel_index_apply(vi, mid, vp);
+	if (released) {
+		vel_index_commit(vi);
+		vp->factor = 1.0f;
+		vp->offset = 0.0f;
+		vp->amount = 1.0f;
+		vp->from = vp->to = 1.0f;
+		vp->jitter = 0.0f;
+		vp->seed++; // fresh pattern for the next humanise
+	}
+}
+
+static void g_quantize_ops(const bool* track_mask, bool whole_song, const char* scope)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const union timespan ts = st->selected_timespan;
+	struct quantize_index* qi = &st->quantize.index;
+	struct quantize_params* qp = &st->quantize.params;
+
+	// strength is relative to the index, which is rebuilt from the
+	// current song after other edits
+	const int n_tracks = mid_get_track_count(mid);
+	uint64_t mask_hash = FNV1A64_INIT;
+	if (!whole_song) mask_hash = fnv1a64(mask_hash, track_mask, n_tracks * sizeof track_mask[0]);
+	if (ts.end > ts.start && (qi->revision != mid->revision || qi->timespan.start != ts.start || qi->timespan.end != ts.end || st->quantize.mask_hash != mask_hash)) {
+		quantize_index_build(qi, mid, ts, whole_song ? NULL : track_mask);
+		st->quantize.mask_hash = mask_hash;
+		qp->strength = 0.0f;
+	}
+
+	ImGui::SeparatorText("Quantize");
+	ImGui::Text("%d notes in %s", qi->n_notes, scope);
+
+	bool changed = false;
+	ImGui::SetNextItemWidth(getsz(20));
+	changed |= ImGui::SliderInt("Grid", &qp->grid_div, 1, 16, "%d/beat", ImGuiSliderFlags_AlwaysClamp);
+	ImGui::SetNextItemWidth(getsz(20));
+	changed |= ImGui::SliderFloat("Swing", &qp->swing, 0.0f, 1.0f, "%.2f", ImGuiSliderFlags_AlwaysClamp);
+	MaybeSetItemTooltip("Delays every other grid point by up to half a step (0.67: triplet feel)");
+	ImGui::SetNextItemWidth(getsz(20));
+	changed |= ImGui::SliderFloat("Strength", &qp->strength, 0.0f, 1.0f, "%.2f", ImGuiSliderFlags_AlwaysClamp);
+	MaybeSetItemTooltip("Drag to move the notes in the selection towards the grid; 0 is where they were");
+	changed |= ImGui::Checkbox("Quantize note ends", &qp->ends);
+
+	if (changed && qi->n_notes > 0) {
+		tempo_map_update(&st->tempo_map, mid);
+		quantize_index_apply(qi, mid, &st->tempo_map, qp);
+	}
+}
+
+static const char* KEYS = "C#D#EF#G#A#B";
+
+// "C#4", or the drum name in drum tracks. returns dst or a static string
+static const char* get_key_label(char* dst, size_t n, int note, bool is_drum_track)
+{
+	if (is_drum_track) {
+		const char* drum = get_drum_key(note);
+		if (drum != NULL) return drum;
+	}
+	const char* sep = "";
+	char k = KEYS[note % 12];
+	if (k == '#') {
+		sep = "#";
+		assert(note > 0);
+		k = KEYS[(note+11) % 12];
+	}
+	const int octave = (note/12)-1;
+	snprintf(dst, n, "%c%s%d", k, sep, octave);
+	return dst;
+}
+
+enum {
+	LABEL_BAR = 1, // "%d"
+	LABEL_BAR_BEAT, // "%d.%d"
+	LABEL_BEAT, // ".%d"
+	LABEL_KEY, // get_key_label()
+};
+
+// label ids must identify the text; A is 32 bits, B is 24 bits
+#define LABEL_ID(KIND,A,B) (((uint64_t)(KIND)<<56) | ((uint64_t)(uint32_t)(A)<<24) | ((uint64_t)(B) & 0xffffff))
+
+static void label_cache_clear(ImFontAtlas* atlas)
+{
+	g.label_cache.atlas = atlas;
+	g.label_cache.tex_id = atlas->TexID;
+	g.label_cache.n_runs = 0;
+	memset(g.label_cache.runs, 0, sizeof g.label_cache.runs);
+	arrsetlen(g.label_cache.glyph_arr, 0);
+}
+
+// draws label id (see LABEL_ID()) with the draw list's current font like
+// AddText() does, but from a cached glyph run; fmt is only formatted and
+// laid out the first time an id is seen. with fmt == NULL, an uncached id
+// returns false and draws nothing
+static bool draw_label(ImDrawList* dl, ImVec2 pos, ImU32 col, uint64_t id, const char* fmt, ...)
+{
+	if ((col & IM_COL32_A_MASK) == 0) return true;
+	const ImFont* font = dl->_Data->Font;
+	const float size = dl->_Data->FontSize;
+	assert(font->ContainerAtlas->TexID == dl->_CmdHeader.TextureId);
+	const ImVec4 clip = dl->_CmdHeader.ClipRect;
+	const float x = (float)(int)pos.x;
+	const float y = (float)(int)pos.y;
+	if (y > clip.w || y + size < clip.y) return true;
+
+	if (font->ContainerAtlas != g.label_cache.atlas || font->ContainerAtlas->TexID != g.label_cache.tex_id || g.label_cache.n_runs >= LABEL_CACHE_SIZE*3/4) {
+		label_cache_clear(font->ContainerAtlas);
+	}
+
+	uint64_t key = FNV1A64_INIT;
+	key = fnv1a64(key, &font, sizeof font);
+	key = fnv1a64(key, &size, sizeof size);
+	key = fnv1a64(key, &id, sizeof id);
+	key |= 1;
+	struct label_run* r;
+	for (int i = key & (LABEL_CACHE_SIZE-1);; i = (i+1) & (LABEL_CACHE_SIZE-1)) {
+		r = &g.label_cache.runs[i];
+		if (r->key == key || r->key == 0) break;
+	}
+
+	if (r->key == 0) {
+		if (fmt == NULL) return false;
+		char buf[1<<8];
+		va_list ap;
+		va_start(ap, fmt);
+		vsnprintf(buf, sizeof buf, fmt, ap);
+		va_end(ap);
+		r->key = key;
+		r->glyph0 = arrlen(g.label_cache.glyph_arr);
+		r->n_glyphs = 0;
+		g.label_cache.n_runs++;
+		const float scale = size / font->FontSize;
+		float x = 0;
+		const char* end = buf + strlen(buf);
+		for (const char* p = buf; p < end;) {
+			unsigned int c = (unsigned int)*p;
+			if (c < 0x80) {
+				p++;
+			} else {
+				p += ImTextCharFromUtf8(&c, p, end);
+			}
+			const ImFontGlyph* glyph = font->FindGlyph((ImWchar)c);
+			if (glyph == NULL) continue;
+			if (glyph->Visible) {
+				arrput(g.label_cache.glyph_arr, ((struct label_glyph) {
+					.x0 = x + glyph->X0 * scale,
+					.y0 = glyph->Y0 * scale,
+					.x1 = x + glyph->X1 * scale,
+					.y1 = glyph->Y1 * scale,
+					.u0 = glyph->U0,
+					.v0 = glyph->V0,
+					.u1 = glyph->U1,
+					.v1 = glyph->V1,
+					.colored = (bool)glyph->Colored,
+				}));
+				r->n_glyphs++;
+			}
+			x += glyph->AdvanceX * scale;
+		}
+	}
+
+	const int n = r->n_glyphs;
+	if (n == 0) return true;
+	const ImU32 col_untinted = col | ~IM_COL32_A_MASK;
+	dl->PrimReserve(n*6, n*4);
+	ImDrawVert* vtx = dl->_VtxWritePtr;
+	ImDrawIdx* idx = dl->_IdxWritePtr;
+	ImDrawIdx vi = (ImDrawIdx)dl->_VtxCurrentIdx;
+	const struct label_glyph* gl = &g.label_cache.glyph_arr[r->glyph0];
+	int n_culled = 0;
+	for (int i = 0; i < n; i++, gl++) {
+		if (x + gl->x0 > clip.z || x + gl->x1 < clip.x) {
+			n_culled++;
+			continue;
+		}
+		const ImU32 c = gl->colored ? col_untinted : col;
+		vtx[0].pos.x = x + gl->x0; vtx[0].pos.y = y + gl->y0; vtx[0].uv.x = gl->u0; vtx[0].uv.y = gl->v0; vtx[0].col = c;
+		vtx[1].pos.x = x + gl->x1; vtx[1].pos.y = y + gl->y0; vtx[1].uv.x = gl->u1; vtx[1].uv.y = gl->v0; vtx[1].col = c;
+		vtx[2].pos.x = x + gl->x1; vtx[2].pos.y = y + gl->y1; vtx[2].uv.x = gl->u1; vtx[2].uv.y = gl->v1; vtx[2].col = c;
+		vtx[3].pos.x = x + gl->x0; vtx[3].pos.y = y + gl->y1; vtx[3].uv.x = gl->u0; vtx[3].uv.y = gl->v1; vtx[3].col = c;
+		idx[0] = vi; idx[1] = vi+1; idx[2] = vi+2;
+		idx[3] = vi; idx[4] = vi+2; idx[5] = vi+3;
+		vtx += 4; idx += 6; vi += 4;
+	}
+	dl->_VtxWritePtr = vtx;
+	dl->_IdxWritePtr = idx;
+	dl->_VtxCurrentIdx = vi;
+	if (n_culled > 0) dl->PrimUnreserve(n_culled*6, n_culled*4);
+	return true;
+}
+
+static bool key_combo(const char* label, int* key, bool is_drum_track)
+{
+	char buf[1<<6];
+	bool changed = false;
+	ImGui::SetNextItemWidth(getsz(9));
+	if (ImGui::BeginCombo(label, get_key_label(buf, sizeof buf, *key, is_drum_track))) {
+		for (int k = 0; k < N_NOTES; k++) {
+			ImGui::PushID(k);
+			if (ImGui::Selectable(get_key_label(buf, sizeof buf, k, is_drum_track), k == *key)) {
+				*key = k;
+				changed = true;
+			}
+			ImGui::PopID();
+		}
+		ImGui::EndCombo();
+	}
+	return changed;
+}
+
+// transpose, transpose in scale and key remapping (e.g. between drum maps)
+// of the notes starting in the selection. returns true if the popup
+// should close
+static bool g_pitch_ops(const bool* mask, const char* scope)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+
+	static const char* root_names[] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+	static const struct {
+		const char* name;
+		unsigned mask; // bit i: root+i is in the scale
+	} scales[] = {
+		{ "Major"            , 0xab5 },
+		{ "Natural minor"    , 0x5ad },
+		{ "Harmonic minor"   , 0x9ad },
+		{ "Dorian"           , 0x6ad },
+		{ "Mixolydian"       , 0x6b5 },
+		{ "Major pentatonic" , 0x295 },
+		{ "Minor pentatonic" , 0x4a9 },
+		{ "Blues"            , 0x4e9 },
+	};
+	static const char* mode_names[] = { "Transpose", "Transpose in scale", "Remap keys" };
+
+	const bool is_drum_track = st->primary_track_select >= 0 && mid_get_trk(mid, st->primary_track_select)->midi_channel == 9;
+
+	ImGui::SeparatorText("Pitch");
+	ImGui::SetNextItemWidth(getsz(12));
+	ImGui::Combo("##pitchmode", &st->pitch.mode, mode_names, ARRAY_LENGTH(mode_names));
+
+	uint8_t lut[N_NOTES];
+	switch (st->pitch.mode) {
+	case 0:
+		ImGui::SetNextItemWidth(getsz(8));
+		ImGui::InputInt("Semitones", &st->pitch.semitones);
+		if (st->pitch.semitones < -127) st->pitch.semitones = -127;
+		if (st->pitch.semitones > 127) st->pitch.semitones = 127;
+		pitch_map_transpose(lut, st->pitch.semitones);
+		break;
+	case 1:
+		ImGui::SetNextItemWidth(getsz(4));
+		ImGui::Combo("##root", &st->pitch.root, root_names, ARRAY_LENGTH(root_names));
+		ImGui::SameLine();
+		ImGui::SetNextItemWidth(getsz(10));
+		if (ImGui::BeginCombo("##scale", scales[st->pitch.scale_index].name)) {
+			for (int i = 0; i < ARRAY_LENGTH(scales); i++) {
+				if (ImGui::Selectable(scales[i].name, i == st->pitch.scale_index)) st->pitch.scale_index = i;
+			}
+			ImGui::EndCombo();
+		}
+		ImGui::SameLine();
+		ImGui::SetNextItemWidth(getsz(8));
+		ImGui::InputInt("Degrees", &st->pitch.degrees);
+		if (st->pitch.degrees < -64) st->pitch.degrees = -64;
+		if (st->pitch.degrees > 64) st->pitch.degrees = 64;
+		MaybeSetItemTooltip("Scale steps; notes off the scale keep their distance to the scale note below them");
+		pitch_map_scale(lut, st->pitch.root, scales[st->pitch.scale_index].mask, st->pitch.degrees);
+		break;
+	case 2: {
+		char buf[1<<6];
+		key_combo("##from", &st->pitch.remap_from, is_drum_track);
+		ImGui::SameLine();
+		ImGui::TextUnformatted("->");
+		ImGui::SameLine();
+		key_combo("##to", &st->pitch.remap_to, is_drum_track);
+		ImGui::SameLine();
+		if (ImGui::Button("Add")) {
+			st->pitch.remap_set[st->pitch.remap_from] = true;
+			st->pitch.remap[st->pitch.remap_from] = (uint8_t)st->pitch.remap_to;
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Clear")) {
+			memset(st->pitch.remap_set, 0, sizeof st->pitch.remap_set);
+		}
+		pitch_map_identity(lut);
+		for (int k = 0; k < N_NOTES; k++) {
+			if (!st->pitch.remap_set[k]) continue;
+			lut[k] = st->pitch.remap[k];
+			ImGui::PushID(k);
+			if (ImGui::SmallButton("x")) st->pitch.remap_set[k] = false;
+			ImGui::PopID();
+			ImGui::SameLine();
+			ImGui::Text("%s", get_key_label(buf, sizeof buf, k, is_drum_track));
+			ImGui::SameLine();
+			ImGui::Text("-> %s", get_key_label(buf, sizeof buf, lut[k], is_drum_track));
+		}
+	} break;
+	default: assert(!"unhandled pitch mode");
+	}
+
+	bool done = false;
+	if (ImGui::Button("Apply##pitch")) {
+		mid_apply_pitch_map(mid, st->selected_timespan, mask, lut);
+		done = true;
+	}
+	MaybeSetItemTooltip("Change the keys of the notes starting in the selection in %s", scope);
+	return done;
+}
+
+static void ctrl_label(char* buf, size_t bufsz, int ctrl, int count)
+{
+	switch (ctrl) {
+	case CTRL_ALL:        snprintf(buf, bufsz, "All controllers (%d)", count); break;
+	case CTRL_PITCH_BEND: snprintf(buf, bufsz, "Pitch bend (%d)", count); break;
+	case CTRL_AFTERTOUCH: snprintf(buf, bufsz, "Aftertouch (%d)", count); break;
+	default:              snprintf(buf, bufsz, "CC %d (%d)", ctrl, count); break;
+	}
+}
+
+// returns true if the popup should close
+static bool g_controller_ops(const bool* mask, const char* scope)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const union timespan ts = st->selected_timespan;
+	int* counts = st->controllers.counts;
+
+	uint64_t key = FNV1A64_INIT;
+	key = fnv1a64(key, &mid->revision, sizeof mid->revision);
+	key = fnv1a64(key, &ts, sizeof ts);
+	if (mask != NULL) key = fnv1a64(key, mask, mid_get_track_count(mid) * sizeof mask[0]);
+	if (key != st->controllers.counts_key) {
+		mid_count_controllers(mid, ts, mask, counts);
+		st->controllers.counts_key = key;
+	}
+	int n_all = 0;
+	for (int i = 0; i < N_CTRLS; i++) n_all += counts[i];
+
+	ImGui::SeparatorText("Controllers");
+	int* ctrl = &st->controllers.ctrl;
+	if (*ctrl != CTRL_ALL && counts[*ctrl] == 0) *ctrl = CTRL_ALL;
+	char label[1<<6];
+	ctrl_label(label, sizeof label, *ctrl, *ctrl == CTRL_ALL ? n_all : counts[*ctrl]);
+	ImGui::SetNextItemWidth(getsz(12));
+	if (ImGui::BeginCombo("##ctrl", label)) {
+		ctrl_label(label, sizeof label, CTRL_ALL, n_all);
+		if (ImGui::Selectable(label, *ctrl == CTRL_ALL)) *ctrl = CTRL_ALL;
+		for (int i = 0; i < N_CTRLS; i++) {
+			if (counts[i] == 0) continue;
+			ctrl_label(label, sizeof label, i, counts[i]);
+			if (ImGui::Selectable(label, *ctrl == i)) *ctrl = i;
+		}
+		ImGui::EndCombo();
+	}
+	ImGui::SameLine();
+	ImGui::TextUnformatted(scope);
+
+	bool close = false;
+	ImGui::BeginDisabled(n_all == 0);
+	if (ImGui::Button("Delete##ctrl")) {
+		mid_delete_controllers(mid, ts, mask, *ctrl);
+		close = true;
+	}
+	MaybeSetItemTooltip("Remove the controller events in the selection; the value after it is kept");
+	ImGui::SameLine();
+	if (ImGui::Button("Thin")) {
+		mid_thin_controllers(mid, ts, mask, *ctrl, st->controllers.tolerance);
+	}
+	MaybeSetItemTooltip("Remove controller events that change the value by no more than the tolerance");
+	ImGui::SameLine();
+	ImGui::SetNextItemWidth(getsz(10));
+	ImGui::SliderFloat("##tolerance", &st->controllers.tolerance, 0.0f, 8.0f, "tolerance=%.2f", ImGuiSliderFlags_AlwaysClamp);
+	ImGui::EndDisabled();
+
+	return close;
+}
+
+static void text_seconds(double seconds)
+{
+	const int minutes = (int)(seconds / 60.0);
+	ImGui::Text("%d:%05.2f", minutes, seconds - minutes*60.0);
+}
+
+// beat grid at pos, with the time track events on that beat applied
+static struct tempo_grid grid_at(int pos)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	tempo_map_update(&st->tempo_map, mid);
+	struct tempo_grid tg;
+	tempo_map_beat_at(&st->tempo_map, mid, pos, &tg);
+	return tg;
+}
+
+// tempo and time signature at selected_timespan.start, or for the selected
+// range. returns true if the popup should close
+static bool g_time_ops(void)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const union timespan ts = st->selected_timespan;
+	const bool have_range = ts.end > ts.start;
+	struct tempo_map* tm = &st->tempo_map;
+	tempo_map_update(tm, mid);
+
+	// inputs follow the song until edited
+	uint64_t key = FNV1A64_INIT;
+	key = fnv1a64(key, &mid->revision, sizeof mid->revision);
+	key = fnv1a64(key, &mid->division, sizeof mid->division);
+	key = fnv1a64(key, &ts.start, sizeof ts.start);
+	if (key != st->time_ops.key) {
+		const struct tempo_grid tg = grid_at(ts.start);
+		st->time_ops.bpm = 60e6f / (float)tg.us_per_qn;
+		st->time_ops.numerator = tg.numerator;
+		st->time_ops.denominator_log2 = tg.denominator_log2;
+		st->time_ops.key = key;
+	}
+
+	text_seconds(tempo_map_seconds(tm, ts.start));
+	if (have_range) {
+		ImGui::SameLine();
+		ImGui::TextUnformatted("-");
+		ImGui::SameLine();
+		text_seconds(tempo_map_seconds(tm, ts.end));
+	}
+
+	bool close = false;
+	const char* where = have_range ? "for the selection" : "from the selection start on";
+
+	ImGui::SetNextItemWidth(getsz(10));
+	ImGui::InputFloat("##bpm", &st->time_ops.bpm, 1.0f, 10.0f, "%.1fBPM");
+	// SET_TEMPO is 24-bit microseconds per quarter note
+	if (st->time_ops.bpm < 4.0f) st->time_ops.bpm = 4.0f;
+	if (st->time_ops.bpm > 1000.0f) st->time_ops.bpm = 1000.0f;
+	ImGui::SameLine();
+	if (ImGui::Button("Set tempo")) {
+		mid_set_tempo(mid, ts, (int)roundf(60e6f / st->time_ops.bpm));
+		close = true;
+	}
+	MaybeSetItemTooltip("Set the tempo %s", where);
+
+	ImGui::SetNextItemWidth(getsz(7));
+	ImGui::InputInt("##numerator", &st->time_ops.numerator);
+	if (st->time_ops.numerator < 1) st->time_ops.numerator = 1;
+	if (st->time_ops.numerator > 255) st->time_ops.numerator = 255;
+	ImGui::SameLine();
+	ImGui::TextUnformatted("/");
+	ImGui::SameLine();
+	static const char* denominators[] = { "1", "2", "4", "8", "16", "32", "64", "128" };
+	int* dl2 = &st->time_ops.denominator_log2;
+	if (*dl2 < 0 || *dl2 >= (int)ARRAY_LENGTH(denominators)) *dl2 = 2;
+	ImGui::SetNextItemWidth(getsz(4));
+	ImGui::Combo("##denominator", dl2, denominators, ARRAY_LENGTH(denominators));
+	ImGui::SameLine();
+	if (ImGui::Button("Set time signature")) {
+		mid_set_time_signature(mid, ts, st->time_ops.numerator, *dl2);
+		close = true;
+	}
+	MaybeSetItemTooltip("Set the time signature %s", where);
+
+	return close;
+}
+
+// range edits on selected_timespan in the "Op" popup
+static void g_ops(void)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const union timespan ts = st->selected_timespan;
+	const bool have_range = ts.end > ts.start;
+
+	const int n_tracks = mid_get_track_count(mid);
+	arrsetlen(st->track_mask_arr, n_tracks);
+	bool* track_mask = st->track_mask_arr;
+	for (int i = 0; i < n_tracks; i++) track_mask[i] = bitset_get(&st->track_select_set, i);
+	const int n_selected = bitset_count(&st->track_select_set);
+	// with none or all tracks selected, edits apply to the whole song,
+	// including tempo and time signature
+	const bool whole_song = n_selected == 0 || n_selected == n_tracks;
+	const bool* mask = whole_song ? NULL : track_mask;
+	const char* scope = whole_song ? "the whole song" : "the selected tracks";
+
+	ImGui::SeparatorText("Operations");
+	bool done = false;
+	if (g_time_ops()) done = true;
+
+	ImGui::BeginDisabled(!have_range);
+
+	ImGui::TextUnformatted("Crop:");
+	ImGui::SameLine();
+	int crop = 0;
+	if (ImGui::Button("Start")) crop = 1;
+	MaybeSetItemTooltip("Remove everything before the selection");
+	ImGui::SameLine();
+	if (ImGui::Button("End")) crop = 2;
+	MaybeSetItemTooltip("Remove everything after the selection");
+	ImGui::SameLine();
+	if (ImGui::Button("Both")) crop = 3;
+	MaybeSetItemTooltip("Remove everything outside the selection");
+	if (crop > 0) {
+		mid_crop(mid, ts, crop & 1, crop & 2);
+		if (crop & 1) {
+			st->selected_timespan.start = 0;
+			st->selected_timespan.end = ts.end - ts.start;
+		}
+		done = true;
+	}
+
+	if (ImGui::Button("Delete range")) {
+		mid_delete_range(mid, ts, mask, whole_song);
+		st->selected_timespan.end = ts.start;
+		done = true;
+	}
+	MaybeSetItemTooltip("Remove the selected time from %s and pull later events in", scope);
+
+	if (ImGui::Button("Duplicate range")) {
+		mid_duplicate_range(mid, ts, mask, whole_song);
+		st->selected_timespan.start = ts.end;
+		st->selected_timespan.end = ts.end + (ts.end - ts.start);
+		done = true;
 	}
-	EMIT_CONFIGS
-	#undef C
-	#undef KEY
-	#undef RGB
-	#undef RGBA
-	#undef ADD_RGB
-	#undef ADD_RGBA
-	#undef SUB_RGB
-	#undef SUB_RGBA
-	#undef MUL_RGB
-	#undef MUL_RGBA
-	#undef SLIDE
-	#undef PX
-	#undef BOOL
+	MaybeSetItemTooltip("Insert a copy of the selected time in %s after the selection", scope);
+
+	g_velocity_ops(track_mask, whole_song, scope);
+	g_quantize_ops(track_mask, whole_song, scope);
+	if (g_pitch_ops(mask, scope)) done = true;
+	if (g_controller_ops(mask, scope)) done = true;
+
+	ImGui::EndDisabled();
+
+	if (done) ImGui::CloseCurrentPopup();
 }
 
 static void g_header(void)
@@ -1320,7 +1776,7 @@ static void g_header(void)
 	const int IDLE=0, TIME_DRAG=1, TIMETRACK_DRAG=2, TIME_PAN=3;
 	struct state* state = curstate();
 
-	float layout_y0s[MAX_TRACKS+2];
+	float* layout_y0s = NULL;
 	float layout_x1 = 0;
 	float layout_w1 = 0;
 
@@ -1342,10 +1798,9 @@ static void g_header(void)
 		struct mid* mid = state->myd;
 
 		int n_displayed_tracks;
-		int track_display_list[MAX_TRACKS];
-
 		const int n_total_tracks = mid_get_track_count(mid);
-		assert(n_total_tracks <= MAX_TRACKS);
+		arrsetlen(state->header.track_display_arr, n_total_tracks);
+		int* track_display_list = state->header.track_display_arr;
 
 		switch (state->header.track_show_mode) {
 		case SHOW_ALL_TRACKS: {
@@ -1357,7 +1812,7 @@ static void g_header(void)
 		case SHOW_SELECTED_TRACKS: {
 			n_displayed_tracks = 0;
 			for (int i = 0; i < n_total_tracks; i++) {
-				if (state->track_show_set[i]) {
+				if (bitset_get(&state->track_show_set, i)) {
 					track_display_list[n_displayed_tracks++] = i;
 				}
 			}
@@ -1368,13 +1823,27 @@ static void g_header(void)
 		default: assert(!"unhandled case");
 		}
 
-		const int n_rows = 1 + n_displayed_tracks;
+		arrsetlen(state->header.track_display_arr, n_displayed_tracks);
+
+		// only the track rows that fit in header_max_height are
+		// submitted, starting at scroll_row; widgets, hover tests and
+		// notes are never done for the scrolled-away rows
+		const float track_row_height = fmaxf(getsz(1.0), ImGui::GetFrameHeight()) + 2*ImGui::GetStyle().CellPadding.y;
+		const float track_rows_max_height = (ImGui::GetContentRegionAvail().y - getsz(1.5)) * CFLOAT(header_max_height);
+		int max_visible_tracks = (int)(track_rows_max_height / track_row_height);
+		if (max_visible_tracks < 1) max_visible_tracks = 1;
+		int scroll_row = state->header.scroll_row;
+		if (scroll_row > n_displayed_tracks - max_visible_tracks) scroll_row = n_displayed_tracks - max_visible_tracks;
+		if (scroll_row < 0) scroll_row = 0;
+		state->header.scroll_row = scroll_row;
+		const int n_visible_tracks = n_displayed_tracks - scroll_row < max_visible_tracks ? n_displayed_tracks - scroll_row : max_visible_tracks;
+
+		const int n_rows = 1 + n_visible_tracks;
 		assert(n_rows > 0);
+		arrsetlen(state->header.layout_y0_arr, n_rows+1);
+		layout_y0s = state->header.layout_y0_arr;
 
-		int n_selected_tracks = 0;
-		for (int i = 0; i < n_total_tracks; i++) {
-			if (state->track_select_set[i] > 0) n_selected_tracks++;
-		}
+		const int n_selected_tracks = bitset_count(&state->track_select_set);
 
 		for (int row_index = 0; row_index < n_rows; row_index++) {
 			const float row_height = row_index == 0 ? getsz(1.5) : getsz(1.0);
@@ -1383,20 +1852,19 @@ static void g_header(void)
 
 			ImGui::TableNextRow();
 
-			assert(row_index < ARRAY_LENGTH(layout_y0s));
 			layout_y0s[row_index] = ImGui::GetCursorScreenPos().y;
 
 			int track_index = -1;
 
 			if (row_index > 0) {
-				ImVec4 c = (row_index & 1) == 1 ? CCOL(track_row_even_color) : CCOL(track_row_odd_color);
+				ImVec4 c = ((scroll_row + row_index) & 1) == 1 ? CCOL(track_row_even_color) : CCOL(track_row_odd_color);
 				if (row_index == state->header.hover_row_index) {
 					c = CCOLTX(c, track_row_hover_coltx);
 				}
 				track_index = must_map_row_to_track_index(row_index);
 				if (track_index == state->primary_track_select) {
 					c = CCOLTX(c, primary_track_coltx);
-				} else if (state->track_select_set[track_index] > 0) {
+				} else if (bitset_get(&state->track_select_set, track_index)) {
 					c = CCOLTX(c, other_track_coltx);
 				}
 				ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, ImGui::GetColorU32(c));
@@ -1407,20 +1875,39 @@ static void g_header(void)
 			ImGui::TableSetColumnIndex(0);
 			{
 				if (row_index == 0) {
-					if (ImGui::Button("Play")) {
+					const bool playing = play_is_playing(state);
+					ImGui::BeginDisabled(!g.using_audio);
+					if (ImGui::Button(playing ? "Stop###play" : "Play###play")) {
+						if (playing) {
+							play_stop();
+						} else {
+							play_start(state, state->selected_timespan.start, 0);
+						}
 					}
+					ImGui::EndDisabled();
+					MaybeSetItemTooltip(playing ? "Stop playback" : "Play from the start of the selected timespan");
 					ImGui::SameLine();
+					const union timespan ts = state->selected_timespan;
+					const bool looping = playing && g.play.loop_end_pos > g.play.start_pos;
+					ImGui::BeginDisabled(!g.using_audio || (!looping && ts.end <= ts.start));
+					ImGui::PushStyleColor(ImGuiCol_Text, looping ? CCOL(label_active_color) : CCOL(label_inactive_color));
 					if (ImGui::Button("Loop")) {
+						if (looping) {
+							play_stop();
+						} else {
+							play_start(state, ts.start, ts.end);
+						}
 					}
+					ImGui::PopStyleColor(1);
+					ImGui::EndDisabled();
+					MaybeSetItemTooltip(looping ? "Stop looping" : "Loop the selected timespan");
 
 					{
 						const char* showing = NULL;
 						if (state->header.track_show_mode == SHOW_ALL_TRACKS) {
 							if (ImGui::Button("A")) {
 								if (n_selected_tracks > 0) {
-									for (int i = 0; i < n_total_tracks; i++) {
-										state->track_show_set[i] = state->track_select_set[i] > 0;
-									}
+									bitset_copy(&state->track_show_set, &state->track_select_set);
 									set_new_track_show_mode = SHOW_SELECTED_TRACKS;
 								} else {
 									set_new_track_show_mode = SHOW_NO_TRACKS;
@@ -1512,19 +1999,11 @@ static void g_header(void)
 
 		ImGui::EndTable();
 
-		assert(n_rows < ARRAY_LENGTH(layout_y0s));
 		layout_y0s[n_rows] = ImGui::GetCursorScreenPos().y - 4;
 
 		if (do_open_op_popup) ImGui::OpenPopup("op_popup");
 		if (ImGui::BeginPopup("op_popup")) {
-			ImGui::SeparatorText("Operations");
-			ImGui::TextUnformatted("TODO: set tempo"); // TODO
-			ImGui::TextUnformatted("TODO: time crop (set start/end/both)"); // TODO
-			ImGui::TextUnformatted("TODO: set time signature"); // TODO
-			ImGui::TextUnformatted("TODO: delete range"); // TODO
-			ImGui::TextUnformatted("TODO: duplicate range"); // TODO
-			ImGui::TextUnformatted("TODO: velocity range operations"); // TODO
-			ImGui::TextUnformatted("TODO: delete pitch bend / CC in range"); // TODO
+			g_ops();
 			ImGui::EndPopup();
 		}
 
@@ -1567,9 +2046,11 @@ static void g_header(void)
 				if (human_midi_channel < 1)  human_midi_channel = 1;
 				if (human_midi_channel > 16) human_midi_channel = 16;
 				trk->midi_channel = human_midi_channel - 1;
+				mid->revision++;
 			}
 
 			if (ImGui::Checkbox("Percussive (NOTE ON only)", &trk->percussive)) {
+				mid->revision++;
 				if (trk->percussive) {
 					printf("TODO remove NOTE OFF events\n"); // TODO
 				} else {
@@ -1604,6 +2085,7 @@ static void g_header(void)
 				_tracks[i1] = _tracks[i0];
 				_tracks[i0] = tmp;
 				state->header.popup_editing_track_index = i1;
+				mid->revision++;
 			}
 			ImGui::EndDisabled();
 
@@ -1622,6 +2104,9 @@ static void g_header(void)
 			const ImVec2 sz = ImVec2(layout_w1, layout_y0s[n_rows] - layout_y0s[0]);
 
 			ImGui::InvisibleButton("timeline", sz, ImGuiButtonFlags_MouseButtonLeft | ImGuiButtonFlags_MouseButtonRight);
+			state->frame_stats.header_timeline_p0 = ImVec2(layout_x1, layout_y0s[0]);
+			state->frame_stats.header_timeline_p1 = ImVec2(layout_x1 + sz.x, layout_y0s[n_rows]);
+			state->frame_stats.header_time_row_y1 = layout_y0s[1];
 			ImGui::SetItemKeyOwner(ImGuiKey_MouseWheelY); // grab mouse wheel
 
 			const bool is_drag = ImGui::IsItemActive();
@@ -1652,14 +2137,11 @@ static void g_header(void)
 					state->header.drag_state = TIME_DRAG;
 				} else {
 					state->header.drag_state = TIMETRACK_DRAG;
-					for (int i = 0; i < n_total_tracks; i++) {
-						if (io.KeyShift) {
-							if (state->track_select_set[i] == 1) {
-								state->track_select_set[i] = 2;
-							}
-						} else {
-							state->track_select_set[i] = 0;
-						}
+					if (io.KeyShift) {
+						bitset_copy(&state->track_select_base, &state->track_select_set);
+					} else {
+						bitset_clear(&state->track_select_base);
+						bitset_clear(&state->track_select_set);
 					}
 
 				}
@@ -1701,6 +2183,35 @@ static void g_header(void)
 			}
 		}
 
+		if (n_visible_tracks < n_displayed_tracks) {
+			// wheel over the track names scrolls; track drags scroll
+			// when leaving the rows
+			const float my = io.MousePos.y;
+			const float rows_y0 = layout_y0s[1];
+			const float rows_y1 = layout_y0s[n_rows];
+			int scroll_delta = 0;
+			if (io.MouseWheel != 0 && io.MousePos.x < layout_x1 && rows_y0 <= my && my < rows_y1 && ImGui::IsWindowHovered()) {
+				scroll_delta = io.MouseWheel > 0 ? -1 : 1;
+			}
+			if (state->header.drag_state == TIMETRACK_DRAG && !start_drag) {
+				if (my < rows_y0 && scroll_row > 0) {
+					scroll_delta = -1;
+					new_hover_row_index = 1;
+				} else if (my >= rows_y1 && n_rows > 1) {
+					scroll_delta = 1;
+					new_hover_row_index = n_rows-1;
+				}
+			}
+			state->header.scroll_row += scroll_delta;
+
+			const float bx1 = layout_x1 - ImGui::GetStyle().CellPadding.x;
+			const float bx0 = bx1 - getsz(0.2);
+			const float h = rows_y1 - rows_y0;
+			const float by0 = rows_y0 + h * (float)scroll_row / (float)n_displayed_tracks;
+			const float by1 = rows_y0 + h * (float)(scroll_row + n_visible_tracks) / (float)n_displayed_tracks;
+			ImGui::GetWindowDrawList()->AddRectFilled(ImVec2(bx0, by0), ImVec2(bx1, by1), ImGui::GetColorU32(ImGuiCol_ScrollbarGrab));
+		}
+
 		ImDrawList* draw_list = ImGui::GetWindowDrawList();
 
 		{
@@ -1708,15 +2219,7 @@ static void g_header(void)
 			struct trk* timetrk = mid_get_time_track(mid);
 			const int n_timetrack_events = arrlen(timetrk->mev_arr);
 			const ImVec2 reserve = ImGui::CalcTextSize("0000.0");
-			int numerator = 4;
-			int denominator_log2 = 2;
-			float beats_per_minute = 120.0;
-			int ttpos = 0;
-			float bx = state->beat0_x;
-			int bar = 0;
-			int tickpos = 0;
-			int last_spanpos = 0;
-			float last_spanbx = bx;
+			tempo_map_update(&state->tempo_map, mid);
 
 			const bool is_track_dragging = state->header.drag_state == TIMETRACK_DRAG;
 			const bool is_time_dragging = (state->header.drag_state == TIME_DRAG) || (state->header.drag_state == TIMETRACK_DRAG);
@@ -1733,14 +2236,8 @@ static void g_header(void)
 				int t0 = state->track_select0;
 				int t1 = track_index;
 				order_2i32(&t0, &t1);
-				for (int t = 0; t < n_total_tracks; t++) {
-					const bool select = (t0 <= t) && (t <= t1);
-					if (select) {
-						state->track_select_set[t] |= 1;
-					} else {
-						state->track_select_set[t] &= ~1;
-					}
-				}
+				bitset_copy(&state->track_select_set, &state->track_select_base);
+				for (int t = t0; t <= t1; t++) bitset_put(&state->track_select_set, t, true);
 			}
 
 			if (is_time_dragging && state->timespan_select_mode == SELECT_FINE) {
@@ -1780,6 +2277,13 @@ static void g_header(void)
 			}
 
 
+			if (state->play.have_tick && CBOOL(play_follow) && state->header.drag_state == IDLE) {
+				// turn the page when the cursor leaves the view
+				const float w = table_p0.x + table_width - layout_x1;
+				const float x = state->beat0_x + (float)state->play.tick * state->beat_dx / (float)mid->division;
+				if (x < 0 || x > w*0.9f) state->beat0_x -= x - w*0.1f;
+			}
+
 			const ImVec2 clip0(layout_x1, table_p0.y);
 			const ImVec2 clip1(table_p0.x + table_width, layout_y0s[n_rows]);
 			draw_list->PushClipRect(clip0, clip1);
@@ -1805,12 +2309,31 @@ static void g_header(void)
 				}
 			}
 
-			int pos = 0;
-			while (pos <= mid->end_of_song_pos) {
+			// only walk the visible beats (plus room for labels starting
+			// left of the view, and up to the mouse while dragging). start
+			// on a bar so that bar spans can be selected
+			const float max_tick_w = CFLOAT(tick0_size) > CFLOAT(tickn_size) ? CFLOAT(tick0_size) : CFLOAT(tickn_size);
+			float x_begin = -ImGui::CalcTextSize("000.0BPM 00/00").x;
+			float x_end = (clip1.x - clip0.x) + max_tick_w;
+			if (is_time_dragging) {
+				if (mx < x_begin) x_begin = mx;
+				if (mx > x_end) x_end = mx;
+			}
+			struct tempo_grid tg;
+			tempo_map_grid_at(&state->tempo_map, (int)floorf((x_begin - state->beat0_x) * (float)mid->division / state->beat_dx), &tg);
+			int ttpos = tempo_map_grid_at(&state->tempo_map, tg.pos - tg.beat*tg.len, &tg);
+			const float pos_to_x = state->beat_dx / (float)mid->division;
+			float bx = state->beat0_x + (float)tg.pos * pos_to_x;
+			int last_spanpos = tg.pos;
+			float last_spanbx = bx;
+
+			while (tg.pos <= mid->end_of_song_pos) {
+				if (bx > x_end && (!is_time_dragging || last_spanbx > mx)) break;
+				const int pos = tg.pos;
 				const bool is_spanpos =
 					is_time_dragging &&
 					(
-					((state->timespan_select_mode == SELECT_BAR) && tickpos == 0) ||
+					((state->timespan_select_mode == SELECT_BAR) && tg.beat == 0) ||
 					(state->timespan_select_mode == SELECT_TICK)
 					);
 				if (is_spanpos && last_spanbx <= mx && mx < bx) {
@@ -1824,163 +2347,912 @@ static void g_header(void)
 						}
 					}
 
-					float start0 = span.start;
-					float start1 = state->beat_select0.start;
-					float start2 = state->base_selected_timespan.start;
-					order_3f32(&start0, &start1, &start2);
+					float start0 = span.start;
+					float start1 = state->beat_select0.start;
+					float start2 = state->base_selected_timespan.start;
+					order_3f32(&start0, &start1, &start2);
+
+					float end0 = span.end;
+					float end1 = state->beat_select0.end;
+					float end2 = state->base_selected_timespan.end;
+					order_3f32(&end0, &end1, &end2);
+
+					state->selected_timespan.start = start0;
+					state->selected_timespan.end = end2;
+				}
+
+				bool has_signature_change = false;
+				bool has_tempo_change = false;
+				for (;;) {
+					if (ttpos >= n_timetrack_events) break;
+					struct mev* mev = &timetrk->mev_arr[ttpos];
+					if (mev->pos > pos) break;
+					if (mev->b[0] == TIME_SIGNATURE) has_signature_change = true;
+					if (mev->b[0] == SET_TEMPO) has_tempo_change = true;
+					tempo_grid_apply(&tg, mev, mid->division);
+					ttpos++;
+				}
+
+				const bool bz = tg.beat == 0;
+
+				const float tw = bz ? CFLOAT(tick0_size) : CFLOAT(tickn_size);
+				const float x0 = layout_x1 + bx - tw*0.5f;
+				const float y0 = layout_y0s[0];
+				const float x1 = x0+tw;
+				const float y1 = layout_y0s[n_rows];
+
+				if (x1 > clip0.x && x0 < clip1.x) {
+					draw_list->AddQuadFilled(
+						ImVec2(x0,y0),
+						ImVec2(x1,y0),
+						ImVec2(x1,y1),
+						ImVec2(x0,y1),
+						bz ? CCOL32(tick0_color) : CCOL32(tickn_color));
+				}
+
+				const float tick_dx = (float)tg.len * pos_to_x;
+				const bool print_per_beat = tick_dx > reserve.x;
+
+				const bool print = bz || print_per_beat;
+				char buf[1<<10];
+
+				if (print) {
+					const ImVec2 lp = ImVec2(x0 + getsz(0.3), layout_y0s[1] - reserve.y);
+					const ImU32 lc = bz ? CCOL32(bar_label_color) : CCOL32(tick_label_color);
+					if (print_per_beat) {
+						if (bz) {
+							draw_label(draw_list, lp, lc, LABEL_ID(LABEL_BAR_BEAT, tg.bar, tg.beat), "%d.%d", tg.bar+1, tg.beat+1);
+						} else {
+							draw_label(draw_list, lp, lc, LABEL_ID(LABEL_BEAT, 0, tg.beat), ".%d", tg.beat+1);
+						}
+					} else {
+						draw_label(draw_list, lp, lc, LABEL_ID(LABEL_BAR, tg.bar, 0), "%d", tg.bar+1);
+					}
+				}
+
+				if (has_signature_change || has_tempo_change) {
+					const float beats_per_minute = 60e6f / (float)tg.us_per_qn;
+					const int numerator = tg.numerator;
+					const int denominator = 1<<tg.denominator_log2;
+					if (has_signature_change && has_tempo_change) {
+						snprintf(buf, sizeof buf, "%.1fBPM %d/%d", beats_per_minute, numerator, denominator);
+					} else if (has_signature_change) {
+						snprintf(buf, sizeof buf, "%d/%d", numerator, denominator);
+					} else if (has_tempo_change) {
+						snprintf(buf, sizeof buf, "%.1fBPM", beats_per_minute);
+					} else {
+						assert(!"UNREACHABLE");
+					}
+					draw_list->AddText(
+						ImVec2(x0 + getsz(0.3), y0),
+						CCOL32(tempo_label_color),
+						buf);
+				}
+
+
+				if (is_spanpos) {
+					last_spanpos = pos;
+					last_spanbx = bx;
+				}
+				tempo_grid_step(&tg);
+				bx = state->beat0_x + (float)tg.pos * pos_to_x;
+			}
+
+			struct note_render nr;
+			const float t0 = (-state->beat0_x / state->beat_dx) * (float)mid->division;
+			const float t1 = t0 + ((clip1.x - clip0.x) / state->beat_dx) * (float)mid->division;
+			note_render_init(&nr, mid->end_of_song_pos, t0, t1, clip0.x, clip1.x);
+			const int nmod = 12; // FIXME?
+			const ImU32* palette = get_note_palette(false);
+			for (int i0 = 1; i0 < n_rows; i0++) {
+				const float y0 = layout_y0s[i0];
+				const float y1 = layout_y0s[i0+1];
+				struct trk* trk = mid_get_trk(mid, must_map_row_to_track_index(i0));
+				const bool percussive = trk->percussive;
+				note_render_do_mevs(&nr, trk->mev_arr, arrlen(trk->mev_arr), percussive);
+				arrsetlen(g.note_quad_arr, 0);
+				while (note_render_next(&nr)) {
+					const float x0 = nr.x0;
+					const float x1 = nr.x1;
+					const int note = (int)nr.note % nmod;
+					const float y = y0 + (nmod - 1 - note) + 0.5f*((y1-y0)-getsz(1)); // XXX scale?
+					const ImU32 color = palette[nr.velocity & 0x7f];
+					if (percussive) {
+						draw_list->AddCircleFilled(ImVec2(x0,y), 2, color);
+					} else {
+						arrput(g.note_quad_arr, ((struct note_quad) { x0, y-0.5f, x1, y+0.5f, color }));
+					}
+				}
+				emit_note_quads(draw_list, g.note_quad_arr, arrlen(g.note_quad_arr), 0, 0);
+			}
+
+			if (state->play.have_tick) {
+				const float x = layout_x1 + state->beat0_x + (float)state->play.tick * state->beat_dx / (float)mid->division;
+				draw_list->AddLine(ImVec2(x, layout_y0s[0]), ImVec2(x, layout_y0s[n_rows]), CCOL32(play_cursor_color), CFLOAT(play_cursor_size));
+			}
+
+			draw_list->PopClipRect();
+			ImGui::PopFont();
+		}
+	}
+
+	state->header.hover_row_index = new_hover_row_index;
+
+	if (set_new_track_show_mode >= 0) {
+		state->header.track_show_mode = set_new_track_show_mode;
+	}
+}
+
+
+// draws the 128 key rows of the keys or notes column between x0 and x1; y0
+// is the top of key 127
+static void draw_key_rows(ImDrawList* draw_list, float x0, float x1, float y0, ImU32 black, ImU32 white, bool print_key_labels, bool is_drum_track)
+{
+	struct state* st = curstate();
+	const float key_size = st->key_dy;
+	const float line_height = ImGui::GetTextLineHeight();
+	const ImU32 key_label_color = CCOL32(key_label_color);
+
+	draw_list->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y0 + 128*key_size), white);
+
+	float y = y0;
+	char prev_key = 0;
+	for (int note = 127; note >= 0; note--, y += key_size) {
+		char key = KEYS[note % 12];
+		if (key == '#') {
+			const float y0 = y;
+			const float y1 = y + key_size;
+			draw_list->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y1), black);
+		}
+		if ((key == '#') == (prev_key == '#')) {
+			const float y0 = y - 0.5;
+			const float y1 = y + 0.5;
+			draw_list->AddRectFilled( ImVec2(x0, y0), ImVec2(x1, y1), black);
+		}
+		if (print_key_labels) {
+			const ImVec2 lp = ImVec2(x0 + getsz(0.3), y + key_size/2 - line_height/2);
+			const uint64_t id = LABEL_ID(LABEL_KEY, note, is_drum_track);
+			if (!draw_label(draw_list, lp, key_label_color, id, NULL)) {
+				char buf[1<<8];
+				draw_label(draw_list, lp, key_label_color, id, "%s", get_key_label(buf, sizeof buf, note, is_drum_track));
+			}
+		}
+		prev_key = key;
+	}
+}
+
+// draws notes of the selected tracks (primary track last, on top). ticks
+// [t0;t1] map to [x0;x1], and only notes overlapping [cx0;cx1] are emitted.
+// y0 is the top of key 127
+static void draw_notes(ImDrawList* draw_list, double t0, double t1, float x0, float x1, float cx0, float cx1, float y0)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+
+	const ImU32 border_color = CCOL32(pianoroll_note_border_color);
+	const float border_size = CFLOAT(pianoroll_note_border_size);
+	const float percussion_line_width = CFLOAT(percussion_line_width);
+	const float percussion_dot_radius = CFLOAT(percussion_dot_radius);
+
+	struct note_render nr;
+	note_render_init(&nr, mid->end_of_song_pos, t0, t1, x0, x1);
+
+	const int n_tracks = mid_get_track_count(mid);
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1 && st->primary_track_select < 0) break;
+		for (int track_index = 0; track_index < n_tracks; track_index++) {
+			if (pass == 0 && !bitset_get(&st->track_select_set, track_index)) continue;
+			if (pass == 0 && track_index == st->primary_track_select) continue;
+			if (pass == 1 && track_index != st->primary_track_select) continue;
+			const ImU32* palette = get_note_palette(pass == 0);
+
+			struct trk* trk = mid_get_trk(mid, track_index);
+			const bool percussive = trk->percussive;
+			note_render_do_mevs(&nr, trk->mev_arr, arrlen(trk->mev_arr), percussive);
+
+			// rects (and percussion lines) are batched per track; the
+			// percussion dots go on top of the track's lines
+			arrsetlen(g.note_quad_arr, 0);
+			while (note_render_next(&nr)) {
+				const float x0 = nr.x0;
+				const float x1 = nr.x1;
+				const int note = nr.note;
+				const float ny0 = y0 + (float)(127-note) * st->key_dy;
+				const float ny1 = ny0 + st->key_dy;
+				const ImU32 color = palette[nr.velocity & 0x7f];
+				if (!percussive) {
+					if (x1 > cx0 && x0 < cx1) {
+						arrput(g.note_quad_arr, ((struct note_quad) { x0, ny0, x1, ny1, color }));
+					}
+				} else if (x0 >= cx0 && x0 <= cx1 && percussion_line_width > 0) {
+					arrput(g.note_quad_arr, ((struct note_quad) { x0-percussion_line_width, ny0, x0+percussion_line_width, ny1, color }));
+				}
+			}
+			if (percussive) {
+				emit_note_quads(draw_list, g.note_quad_arr, arrlen(g.note_quad_arr), 0, 0);
+			} else {
+				emit_note_quads(draw_list, g.note_quad_arr, arrlen(g.note_quad_arr), border_color, border_size);
+			}
+
+			if (!percussive || percussion_dot_radius <= 0) continue;
+			note_render_do_mevs(&nr, trk->mev_arr, arrlen(trk->mev_arr), percussive);
+			while (note_render_next(&nr)) {
+				const float x0 = nr.x0;
+				if (!(x0 >= cx0 && x0 <= cx1)) continue;
+				const float ny0 = y0 + (float)(127-nr.note) * st->key_dy;
+				draw_list->AddCircleFilled(ImVec2(x0, ny0 + st->key_dy*0.5f), percussion_dot_radius, palette[nr.velocity & 0x7f]);
+			}
+		}
+	}
+}
+
+static struct note_index* get_note_index(int track_index)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const int n_tracks = mid_get_track_count(mid);
+	assert(0 <= track_index && track_index < n_tracks);
+	while (arrlen(st->note_index_arr) < n_tracks) {
+		struct note_index ni;
+		memset(&ni, 0, sizeof ni);
+		arrput(st->note_index_arr, ni);
+	}
+	struct note_index* ni = &st->note_index_arr[track_index];
+	if (!ni->built || ni->revision != mid->revision) {
+		note_index_build(ni, mid_get_trk(mid, track_index), mid->end_of_song_pos);
+		ni->revision = mid->revision;
+	}
+	return ni;
+}
+
+// finds the note under (pos,key) in the tracks shown by draw_notes(), top
+// one first. pos_tolerance widens the lookup for percussion dots
+static int hit_test_note(int pos, int key, int pos_tolerance, struct note_hit* out)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	if (!(0 <= key && key < N_NOTES)) return -1;
+	const int n_tracks = mid_get_track_count(mid);
+	struct note_hit* hit_arr = NULL;
+	int found = -1;
+	for (int pass = 0; pass < 2 && found < 0; pass++) {
+		for (int track_index = n_tracks-1; track_index >= 0; track_index--) {
+			if (pass == 0 && track_index != st->primary_track_select) continue;
+			if (pass == 1 && (!bitset_get(&st->track_select_set, track_index) || track_index == st->primary_track_select)) continue;
+			struct note_index* ni = get_note_index(track_index);
+			if (mid_get_trk(mid, track_index)->percussive) {
+				arrsetlen(hit_arr, 0);
+				note_index_query(ni, key, key, pos - pos_tolerance, pos + pos_tolerance, &hit_arr);
+				if (arrlen(hit_arr) == 0) continue;
+				// closest dot
+				int best = 0;
+				for (int i = 1; i < arrlen(hit_arr); i++) {
+					if (abs(hit_arr[i].start - pos) < abs(hit_arr[best].start - pos)) best = i;
+				}
+				*out = hit_arr[best];
+			} else {
+				const int i = note_index_find(ni, key, pos);
+				if (i < 0) continue;
+				out->key = key;
+				out->start = ni->key_arr[key][i].start;
+				out->end = ni->key_arr[key][i].end;
+			}
+			found = track_index;
+			break;
+		}
+	}
+	arrfree(hit_arr);
+	return found;
+}
+
+// inserts notes and, if the track's note index was current, updates it
+// instead of leaving it to be rebuilt on the next lookup
+static void insert_notes(int track_index, const struct new_note* notes, int n)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	if (n <= 0) return;
+	struct note_index* ni = track_index < arrlen(st->note_index_arr) ? &st->note_index_arr[track_index] : NULL;
+	const bool was_current = ni != NULL && ni->built && ni->revision == mid->revision;
+	mid_insert_notes(mid, track_index, notes, n);
+	if (was_current) {
+		// percussive notes are one tick long in the index, as in
+		// note_index_build()
+		const bool percussive = mid_get_trk(mid, track_index)->percussive;
+		for (int i = 0; i < n; i++) {
+			const struct new_note* nn = &notes[i];
+			note_index_insert(ni, nn->key, nn->start, percussive ? nn->start+1 : nn->end);
+		}
+		ni->revision = mid->revision;
+	}
+}
+
+// left-drag paints notes on the primary track, one per beat and key the
+// mouse passes; they are staged (and drawn from) st->note_tool.stroke_arr
+// and merged into the track when the stroke ends. right-drag erases the
+// notes in a box
+static void g_note_tool(ImDrawList* draw_list, ImVec2 clip0, ImVec2 clip1, int click, bool active, float wheel)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const union timespan ts = st->selected_timespan;
+	const int track_index = st->primary_track_select;
+	if (ts.end <= ts.start || clip1.x <= clip0.x || track_index < 0) {
+		st->note_tool.stroke_button = 0;
+		arrsetlen(st->note_tool.stroke_arr, 0);
+		return;
+	}
+
+	int* velocity = &st->note_tool.velocity;
+	if (wheel != 0) {
+		*velocity += wheel > 0 ? 4 : -4;
+		if (*velocity < 1) *velocity = 1;
+		if (*velocity > 127) *velocity = 127;
+	}
+
+	const float px_per_tick = (clip1.x - clip0.x) / (float)(ts.end - ts.start);
+	const ImVec2 mp = ImGui::GetIO().MousePos;
+	const double mpos = (double)ts.start + (double)((mp.x - clip0.x) / px_per_tick);
+	const int mkey = 127 - (int)floorf((mp.y - clip0.y - st->key127_y) / st->key_dy);
+	struct note_index* ni = get_note_index(track_index);
+
+	if (click > 0) {
+		st->note_tool.stroke_button = click;
+		arrsetlen(st->note_tool.stroke_arr, 0);
+		st->note_tool.erase_pos0 = mpos;
+		st->note_tool.erase_key0 = mkey;
+	}
+
+	const ImU32* palette = get_note_palette(false);
+	const ImU32 hover_color = CCOL32(pianoroll_note_hover_color);
+	const float y0 = clip0.y + st->key127_y;
+	draw_list->PushClipRect(clip0, clip1, true);
+
+	if (st->note_tool.stroke_button == 1) {
+		if (active && 0 <= mkey && mkey < N_NOTES && mpos >= 0) {
+			const struct tempo_grid tg = grid_at((int)floor(mpos));
+			struct new_note nn = {
+				.start = tg.pos,
+				.end = tg.pos + tg.len,
+				.key = (uint8_t)mkey,
+				.velocity = (uint8_t)*velocity,
+			};
+			// end where the next note of the key starts
+			bool skip = !note_index_fit(ni, mkey, nn.start, &nn.end);
+			for (int i = 0; i < arrlen(st->note_tool.stroke_arr) && !skip; i++) {
+				struct new_note* s = &st->note_tool.stroke_arr[i];
+				if (s->key != nn.key) continue;
+				if (s->start <= nn.start && nn.start < s->end) skip = true;
+				if (nn.start < s->start && s->start < nn.end) nn.end = s->start;
+			}
+			if (!skip) arrput(st->note_tool.stroke_arr, nn);
+		}
+		const int n = arrlen(st->note_tool.stroke_arr);
+		for (int i = 0; i < n; i++) {
+			struct new_note* s = &st->note_tool.stroke_arr[i];
+			const float x0 = clip0.x + (float)(s->start - ts.start) * px_per_tick;
+			const float x1 = clip0.x + (float)(s->end   - ts.start) * px_per_tick;
+			const float ny0 = y0 + (float)(127 - s->key) * st->key_dy;
+			draw_list->AddRectFilled(ImVec2(x0, ny0), ImVec2(x1, ny0 + st->key_dy), palette[s->velocity & 0x7f]);
+			draw_list->AddRect(ImVec2(x0, ny0), ImVec2(x1, ny0 + st->key_dy), hover_color);
+		}
+		if (!active) {
+			insert_notes(track_index, st->note_tool.stroke_arr, n);
+			arrsetlen(st->note_tool.stroke_arr, 0);
+			st->note_tool.stroke_button = 0;
+		}
+	} else if (st->note_tool.stroke_button == 2) {
+		double pos0 = st->note_tool.erase_pos0, pos1 = mpos;
+		if (pos1 < pos0) { const double t = pos0; pos0 = pos1; pos1 = t; }
+		int key0 = st->note_tool.erase_key0, key1 = mkey;
+		if (key1 < key0) { const int t = key0; key0 = key1; key1 = t; }
+		struct note_hit* hit_arr = NULL;
+		note_index_query(ni, key0, key1, (int)floor(pos0), (int)ceil(pos1), &hit_arr);
+		const int n = arrlen(hit_arr);
+		for (int i = 0; i < n; i++) {
+			struct note_hit* h = &hit_arr[i];
+			const float x0 = clip0.x + (float)(h->start - ts.start) * px_per_tick;
+			const float x1 = clip0.x + (float)(h->end   - ts.start) * px_per_tick;
+			const float ny0 = y0 + (float)(127 - h->key) * st->key_dy;
+			draw_list->AddRect(ImVec2(x0, ny0), ImVec2(x1, ny0 + st->key_dy), hover_color, 0, 0, getsz(0.1f));
+		}
+		const float bx0 = clip0.x + (float)(pos0 - ts.start) * px_per_tick;
+		const float bx1 = clip0.x + (float)(pos1 - ts.start) * px_per_tick;
+		const float by0 = y0 + (float)(127 - key1) * st->key_dy;
+		const float by1 = y0 + (float)(128 - key0) * st->key_dy;
+		draw_list->AddRect(ImVec2(bx0, by0), ImVec2(bx1, by1), hover_color);
+		if (!active) {
+			mid_delete_notes(mid, track_index, hit_arr, n);
+			st->note_tool.stroke_button = 0;
+		}
+		arrfree(hit_arr);
+	}
+
+	draw_list->PopClipRect();
+}
+
+static const struct curve_type {
+	int ctrl;
+	float zero; // right-click value
+	const char* label;
+} curve_types[] = {
+	{ CTRL_PITCH_BEND , 64 , "Pitch Bend"             },
+	{ 1               , 0  , "(CC1) Modulation Wheel" },
+	{ 7               , 0  , "(CC7) Volume"           },
+	{ 10              , 64 , "(CC10) Pan"             },
+	{ 64              , 0  , "(CC64) Damper Pedal"    },
+	{ 91              , 0  , "(CC91/FX1) Reverb"      },
+	{ 93              , 0  , "(CC93/FX3) Chorus"      },
+};
+
+// controller curve of a track as a step polyline (values hold until the next
+// event) between ly0 (127) and ly1 (0). like draw_notes() it's culled to the
+// visible ticks, starting from a binary search, and events closer than a
+// pixel are drawn as one vertical span instead of separate steps
+static void draw_curve(ImDrawList* draw_list, struct trk* trk, int ctrl, double t0, double t1, float x0, float x1, float ly0, float ly1, ImU32 color, float thickness)
+{
+	struct state* st = curstate();
+	const int n = arrlen(trk->mev_arr);
+	const float dx = (x1 - x0) / (float)(t1 - t0);
+	const float dy = (ly0 - ly1) / 128.0f;
+	int i = mev_lower_bound(trk->mev_arr, n, (int)floor(t0));
+
+	ImVec2** pts = &st->curve_tool.polyline_arr;
+	arrsetlen(*pts, 0);
+	for (int j = i-1; j >= 0; j--) {
+		struct mev* mev = &trk->mev_arr[j];
+		if (mev_ctrl(mev) != ctrl) continue;
+		arrput(*pts, ImVec2(x0, ly1 - mev_ctrl_value(mev) * dy));
+		break;
+	}
+	float span_y0 = 0, span_y1 = 0;
+	bool have_span = false;
+	for (; i < n; i++) {
+		struct mev* mev = &trk->mev_arr[i];
+		if (mev->pos > t1) break;
+		if (mev_ctrl(mev) != ctrl) continue;
+		const float x = x0 + (float)(mev->pos - t0) * dx;
+		const float y = ly1 - mev_ctrl_value(mev) * dy;
+		const int np = arrlen(*pts);
+		if (np > 0 && x - (*pts)[np-1].x < 1.0f) {
+			// same pixel column: extend the span, move the step
+			ImVec2* last = &(*pts)[np-1];
+			if (!have_span) {
+				span_y0 = span_y1 = last->y;
+				have_span = true;
+			}
+			span_y0 = fminf(span_y0, y);
+			span_y1 = fmaxf(span_y1, y);
+			last->y = y;
+			continue;
+		}
+		if (have_span) {
+			const float sx = (*pts)[np-1].x;
+			draw_list->AddLine(ImVec2(sx, span_y0), ImVec2(sx, span_y1), color, thickness);
+			have_span = false;
+		}
+		if (np > 0) arrput(*pts, ImVec2(x, (*pts)[np-1].y));
+		arrput(*pts, ImVec2(x, y));
+	}
+	if (have_span) {
+		const float sx = (*pts)[arrlen(*pts)-1].x;
+		draw_list->AddLine(ImVec2(sx, span_y0), ImVec2(sx, span_y1), color, thickness);
+	}
+	const int np = arrlen(*pts);
+	if (np > 0) arrput(*pts, ImVec2(x1, (*pts)[np-1].y));
+	if (arrlen(*pts) >= 2) draw_list->AddPolyline(*pts, arrlen(*pts), color, 0, thickness);
+}
+
+// curve lane along the bottom of the notes area. left-drag paints the
+// selected controller of the primary track, right-drag paints its zero
+// value. the stroke is kept as a pos-sorted polyline (painting over a pos
+// replaces it) and turned into events by mid_paint_controller() when it
+// ends
+static void g_curve_tool(ImDrawList* draw_list, ImVec2 clip0, ImVec2 clip1, int click, bool active, float wheel)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const union timespan ts = st->selected_timespan;
+	const int track_index = st->primary_track_select;
+
+	float* lane_height = &st->curve_tool.lane_height;
+	if (wheel != 0) {
+		*lane_height *= mouse_wheel_scalar(wheel);
+		if (*lane_height < 2) *lane_height = 2;
+		if (*lane_height > 40) *lane_height = 40;
+	}
+	const float ly1 = clip1.y;
+	const float ly0 = fmaxf(clip0.y, ly1 - getsz(*lane_height));
+
+	if (ts.end <= ts.start || clip1.x <= clip0.x || track_index < 0) {
+		st->curve_tool.stroke_button = 0;
+		arrsetlen(st->curve_tool.stroke_arr, 0);
+		return;
+	}
+
+	const struct curve_type* ct = &curve_types[st->curve_tool.curve_index];
+	const float px_per_tick = (clip1.x - clip0.x) / (float)(ts.end - ts.start);
+	const ImVec2 mp = ImGui::GetIO().MousePos;
+
+	if (click > 0) {
+		st->curve_tool.stroke_button = click;
+		arrsetlen(st->curve_tool.stroke_arr, 0);
+	}
+
+	struct ctrl_point** stroke = &st->curve_tool.stroke_arr;
+	if (st->curve_tool.stroke_button > 0 && active) {
+		int pos = ts.start + (int)roundf((mp.x - clip0.x) / px_per_tick);
+		if (pos < 0) pos = 0;
+		if (pos > mid->end_of_song_pos) pos = mid->end_of_song_pos;
+		float value = ct->zero;
+		if (st->curve_tool.stroke_button == 1) {
+			value = (ly1 - mp.y) / (ly1 - ly0) * 128.0f;
+			if (value < 0) value = 0;
+			if (value > 127.99f) value = 127.99f;
+		}
+		// drop what the mouse passed over since the last point (keeping
+		// that point), so that moving back paints over the stroke
+		const int n = arrlen(*stroke);
+		const int last = st->curve_tool.stroke_last_pos;
+		const int lo = n > 0 && last < pos ? last : pos;
+		const int hi = n > 0 && last > pos ? last : pos;
+		int w = 0;
+		for (int i = 0; i < n; i++) {
+			const int p = (*stroke)[i].pos;
+			if (lo <= p && p <= hi && (p != last || p == pos)) continue;
+			(*stroke)[w++] = (*stroke)[i];
+		}
+		arrsetlen(*stroke, w);
+		int at = 0;
+		while (at < w && (*stroke)[at].pos < pos) at++;
+		arrins(*stroke, at, ((struct ctrl_point) { .pos = pos, .value = value }));
+		st->curve_tool.stroke_last_pos = pos;
+	}
+
+	draw_list->PushClipRect(ImVec2(clip0.x, ly0), clip1, true);
+	draw_list->AddRectFilled(ImVec2(clip0.x, ly0), clip1, CCOL32(curve_lane_color));
+	const float thickness = CFLOAT(curve_line_width);
+	draw_curve(draw_list, mid_get_trk(mid, track_index), ct->ctrl, ts.start, ts.end, clip0.x, clip1.x, ly0, ly1, CCOL32(curve_color), thickness);
+
+	const int n = arrlen(*stroke);
+	if (n > 0) {
+		ImVec2** pts = &st->curve_tool.polyline_arr;
+		arrsetlen(*pts, 0);
+		for (int i = 0; i < n; i++) {
+			const struct ctrl_point* cp = &(*stroke)[i];
+			arrput(*pts, ImVec2(clip0.x + (float)(cp->pos - ts.start) * px_per_tick, ly1 - cp->value * (ly1 - ly0) / 128.0f));
+		}
+		if (n == 1) arrput(*pts, ImVec2((*pts)[0].x + 1, (*pts)[0].y));
+		draw_list->AddPolyline(*pts, arrlen(*pts), CCOL32(curve_stroke_color), 0, thickness);
+	}
+	draw_list->PopClipRect();
 
-					float end0 = span.end;
-					float end1 = state->beat_select0.end;
-					float end2 = state->base_selected_timespan.end;
-					order_3f32(&end0, &end1, &end2);
+	if (st->curve_tool.stroke_button > 0 && !active) {
+		const int resolution = mid->division / st->curve_tool.steps_per_qn;
+		mid_paint_controller(mid, track_index, ct->ctrl, *stroke, n, resolution, st->curve_tool.tolerance);
+		arrsetlen(*stroke, 0);
+		st->curve_tool.stroke_button = 0;
+	}
+}
 
-					state->selected_timespan.start = start0;
-					state->selected_timespan.end = end2;
-				}
+static int seq_step_len(int pos)
+{
+	struct state* st = curstate();
+	const int len = grid_at(pos).len / st->seq_tool.steps_per_beat;
+	return len > 0 ? len : 1;
+}
 
-				bool has_signature_change = false;
-				bool has_tempo_change = false;
-				for (;;) {
-					if (ttpos >= n_timetrack_events) break;
-					struct mev* mev = &timetrk->mev_arr[ttpos];
-					if (mev->pos > pos) break;
-					const uint8_t b0 = mev->b[0];
-					if (b0 == TIME_SIGNATURE) {
-						has_signature_change = true;
-						numerator = mev->b[1];
-						denominator_log2 = mev->b[2];
-						if (tickpos != 0) {
-							bar++;
-							tickpos = 0;
-						}
-					} else if (b0 == SET_TEMPO) {
-						has_tempo_change = true;
-						const int microseconds_per_quarter_note =
-							((int)(mev->b[1]) << 16) +
-							((int)(mev->b[2]) << 8)  +
-							((int)(mev->b[3]))       ;
-						beats_per_minute = 60e6/microseconds_per_quarter_note;
-					} else {
-						assert(!"unhandled time track event");
-					}
-					ttpos++;
-				}
+// step entry: left-click places the cursor (snapped to steps), then each
+// keyjazz key press enters a note at the cursor and advances it one step;
+// keys pressed together make a chord. space is a rest and backspace undoes
+// the last step (removing only the notes entered with it). right-drag
+// erases like the note tool
+static void g_seq_tool(ImDrawList* draw_list, ImVec2 clip0, ImVec2 clip1, int click, bool active, float wheel)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	union timespan* ts = &st->selected_timespan;
+	const int track_index = st->primary_track_select;
 
-				const bool bz = tickpos == 0;
+	if (click == 2 || st->note_tool.stroke_button == 2) {
+		g_note_tool(draw_list, clip0, clip1, click, active, 0);
+	}
+	if (ts->end <= ts->start || clip1.x <= clip0.x || track_index < 0) return;
 
-				const float tw = bz ? CFLOAT(tick0_size) : CFLOAT(tickn_size);
-				const float x0 = layout_x1 + bx - tw*0.5f;
-				const float y0 = layout_y0s[0];
-				const float x1 = x0+tw;
-				const float y1 = layout_y0s[n_rows];
+	int* velocity = &st->seq_tool.velocity;
+	if (wheel != 0) {
+		*velocity += wheel > 0 ? 4 : -4;
+		if (*velocity < 1) *velocity = 1;
+		if (*velocity > 127) *velocity = 127;
+	}
 
-				if (x1 > clip0.x && x0 < clip1.x) {
-					draw_list->AddQuadFilled(
-						ImVec2(x0,y0),
-						ImVec2(x1,y0),
-						ImVec2(x1,y1),
-						ImVec2(x0,y1),
-						bz ? CCOL32(tick0_color) : CCOL32(tickn_color));
+	int* cursor = &st->seq_tool.cursor;
+	if (click == 1) {
+		const float px_per_tick = (clip1.x - clip0.x) / (float)(ts->end - ts->start);
+		int pos = ts->start + (int)floorf((ImGui::GetIO().MousePos.x - clip0.x) / px_per_tick);
+		if (pos < 0) pos = 0;
+		const struct tempo_grid tg = grid_at(pos);
+		const int len = seq_step_len(pos);
+		*cursor = tg.pos + ((pos - tg.pos) / len) * len;
+		arrsetlen(st->seq_tool.step_arr, 0);
+		arrsetlen(st->seq_tool.note_arr, 0);
+	}
+	if (*cursor < 0) return;
+
+	if (ImGui::IsWindowFocused() && !ImGui::GetIO().WantTextInput) {
+		const int len = seq_step_len(*cursor);
+		struct new_note chord[1<<5];
+		int n = 0;
+		struct note_index* ni = get_note_index(track_index);
+		for (int i = 0;; i++) {
+			struct keyjazz_keymap* m = get_keyjazz_keymap(i);
+			if (m == NULL) break;
+			if (!ImGui::IsKeyPressed(m->keycode, false)) continue;
+			const int key = 12*(st->seq_tool.octave+1) + m->note;
+			if (key < 0 || key >= N_NOTES || n >= ARRAY_LENGTH(chord)) continue;
+			// not over a note of the key sounding at the cursor, and
+			// ending where the next one starts
+			int end = *cursor + len;
+			if (!note_index_fit(ni, key, *cursor, &end)) continue;
+			bool dup = false;
+			for (int j = 0; j < n; j++) if (chord[j].key == key) dup = true;
+			if (dup) continue;
+			chord[n++] = ((struct new_note) {
+				.start = *cursor,
+				.end = end,
+				.key = (uint8_t)key,
+				.velocity = (uint8_t)*velocity,
+			});
+		}
+		if (n > 0 || ImGui::IsKeyPressed(ImGuiKey_Space, false)) {
+			insert_notes(track_index, chord, n);
+			for (int i = 0; i < n; i++) arrput(st->seq_tool.note_arr, chord[i]);
+			arrput(st->seq_tool.step_arr, len);
+			*cursor += len;
+		} else if (ImGui::IsKeyPressed(ImGuiKey_Backspace) && arrlen(st->seq_tool.step_arr) > 0) {
+			*cursor -= arrpop(st->seq_tool.step_arr);
+			struct note_hit* hit_arr = NULL;
+			struct new_note** note_arr = &st->seq_tool.note_arr;
+			while (arrlen(*note_arr) > 0 && (*note_arr)[arrlen(*note_arr)-1].start == *cursor) {
+				const struct new_note nn = arrpop(*note_arr);
+				arrput(hit_arr, ((struct note_hit) { .key = nn.key, .start = nn.start, .end = nn.end }));
+			}
+			const int w = arrlen(hit_arr);
+			if (w > 0) {
+				mid_delete_notes(mid, track_index, hit_arr, w);
+				if (!mid_get_trk(mid, track_index)->percussive) {
+					for (int i = 0; i < w; i++) note_index_remove(ni, hit_arr[i].key, hit_arr[i].start);
+					ni->revision = mid->revision;
 				}
+			}
+			arrfree(hit_arr);
+		}
 
-				const int flog2 = -(denominator_log2-2);
-				const float tick_dx = state->beat_dx * powf(2.0, flog2);
-				const bool print_per_beat = tick_dx > reserve.x;
+		// follow the cursor
+		const int span = ts->end - ts->start;
+		if (*cursor + len > ts->end) {
+			const int d = *cursor + len - ts->end + span/4;
+			ts->start += d;
+			ts->end += d;
+		} else if (*cursor < ts->start) {
+			const int d = ts->start - *cursor + span/4;
+			ts->start -= d;
+			ts->end -= d;
+		}
+	}
 
-				const bool print = bz || print_per_beat;
-				char buf[1<<10];
+	const float px_per_tick = (clip1.x - clip0.x) / (float)(ts->end - ts->start);
+	const float x0 = clip0.x + (float)(*cursor - ts->start) * px_per_tick;
+	const float x1 = x0 + (float)seq_step_len(*cursor) * px_per_tick;
+	const ImU32 color = CCOL32(seq_cursor_color);
+	draw_list->PushClipRect(clip0, clip1, true);
+	draw_list->AddRectFilled(ImVec2(x0, clip0.y), ImVec2(x1, clip1.y), ImGui::GetColorU32(CCOLTX(CCOL(seq_cursor_color), seq_step_coltx)));
+	draw_list->AddLine(ImVec2(x0, clip0.y), ImVec2(x0, clip1.y), color, getsz(0.1f));
+	draw_list->PopClipRect();
+}
 
-				if (print) {
-					if (print_per_beat) {
-						if (bz) {
-							snprintf(buf, sizeof buf, "%d.%d", bar+1, tickpos+1);
-						} else {
-							snprintf(buf, sizeof buf, ".%d", tickpos+1);
-						}
-					} else {
-						snprintf(buf, sizeof buf, "%d", bar+1);
-					}
-					draw_list->AddText(
-						ImVec2(x0 + getsz(0.3), layout_y0s[1] - reserve.y),
-						bz ? CCOL32(bar_label_color) : CCOL32(tick_label_color),
-						buf);
-				}
+// finds lowest/highest note drawn by draw_notes() between ticks t0 and t1
+static bool get_note_range(int t0, int t1, int* note_min, int* note_max)
+{
+	struct state* st = curstate();
+	struct mid* mid = st->myd;
+	const bool percussion_visible = CFLOAT(percussion_line_width) > 0 || CFLOAT(percussion_dot_radius) > 0;
 
-				if (has_signature_change || has_tempo_change) {
-					const int denominator = 1<<denominator_log2;
-					if (has_signature_change && has_tempo_change) {
-						snprintf(buf, sizeof buf, "%.1fBPM %d/%d", beats_per_minute, numerator, denominator);
-					} else if (has_signature_change) {
-						snprintf(buf, sizeof buf, "%d/%d", numerator, denominator);
-					} else if (has_tempo_change) {
-						snprintf(buf, sizeof buf, "%.1fBPM", beats_per_minute);
-					} else {
-						assert(!"UNREACHABLE");
-					}
-					draw_list->AddText(
-						ImVec2(x0 + getsz(0.3), y0),
-						CCOL32(tempo_label_color),
-						buf);
-				}
+	struct note_render nr;
+	note_render_init(&nr, mid->end_of_song_pos, t0, t1, t0, t1);
 
+	*note_min = -1;
+	*note_max = -1;
+	const int n_tracks = mid_get_track_count(mid);
+	for (int track_index = 0; track_index < n_tracks; track_index++) {
+		if (!bitset_get(&st->track_select_set, track_index) && track_index != st->primary_track_select) continue;
+		struct trk* trk = mid_get_trk(mid, track_index);
+		const bool percussive = trk->percussive;
+		if (percussive && !percussion_visible) continue;
+		note_render_do_mevs(&nr, trk->mev_arr, arrlen(trk->mev_arr), percussive);
+		while (note_render_next(&nr)) {
+			const bool is_visible = percussive
+				? (nr.x0 >= t0 && nr.x0 <= t1)
+				: (nr.x1 > t0 && nr.x0 < t1);
+			if (!is_visible) continue;
+			const int note = nr.note;
+			if (*note_min == -1) {
+				*note_min = note;
+				*note_max = note;
+			} else {
+				if (note < *note_min) *note_min = note;
+				if (note > *note_max) *note_max = note;
+			}
+		}
+	}
+	return *note_min != -1;
+}
 
-				if (is_spanpos) {
-					last_spanpos = pos;
-					last_spanbx = bx;
-				}
-				pos += dshift(mid->division, flog2);
-				tickpos = (tickpos+1) % numerator;
-				if (tickpos == 0) bar++;
-				bx += tick_dx;
+static ImDrawList* layer_draw_list_begin(ImVec2 size)
+{
+	struct state* st = curstate();
+	if (st->layer_draw_list == NULL) {
+		st->layer_draw_list = IM_NEW(ImDrawList)(ImGui::GetDrawListSharedData());
+	}
+	ImDrawList* draw_list = st->layer_draw_list;
+	draw_list->_ResetForNewFrame();
+	draw_list->PushTextureID(ImGui::GetIO().Fonts->TexID);
+	draw_list->PushClipRect(ImVec2(0,0), size);
+	return draw_list;
+}
+
+static inline bool layer_cache_match(struct layer_cache* c, struct layer_cache* key)
+{
+	return c->valid
+		&& c->size.x == key->size.x
+		&& c->size.y == key->size.y
+		&& c->scale == key->scale
+		&& c->key127_y == key->key127_y
+		&& c->key_dy == key->key_dy
+		&& c->content_hash == key->content_hash
+		&& c->span == key->span;
+}
+
+static void layer_cache_key_init(struct layer_cache* key, ImVec2 p0, ImVec2 p1)
+{
+	struct state* st = curstate();
+	memset(key, 0, sizeof *key);
+	key->size = ImVec2(ceilf(p1.x - p0.x), ceilf(p1.y - p0.y));
+	key->scale = ImGui::GetIO().DisplayFramebufferScale.x;
+	key->key127_y = st->key127_y;
+	key->key_dy = st->key_dy;
+	key->content_hash = config_snapshot.hash;
+}
+
+static inline void draw_layer(ImDrawList* draw_list, ImTextureID tex, ImVec2 p0, ImVec2 size)
+{
+	draw_list->AddImage(tex, p0, ImVec2(p0.x + size.x, p0.y + size.y), ImVec2(0,1), ImVec2(1,0));
+}
+
+// keys column; cached in a layer since it only changes with vertical
+// pan/zoom
+static void g_pianoroll_keys(ImDrawList* draw_list, ImVec2 p0, ImVec2 p1, bool is_drum_track)
+{
+	struct state* st = curstate();
+	if (p1.x <= p0.x || p1.y <= p0.y) return;
+	const bool print_key_labels = st->key_dy > ImGui::GetTextLineHeight();
+	const ImU32 black = CCOL32(black_keys_color);
+	const ImU32 white = CCOL32(white_keys_color);
+
+	if (!st->no_layers) {
+		struct layer_cache key;
+		layer_cache_key_init(&key, p0, p1);
+		ImFont* font = ImGui::GetFont();
+		key.content_hash = fnv1a64(key.content_hash, &font, sizeof font);
+		key.content_hash = fnv1a64(key.content_hash, &is_drum_track, sizeof is_drum_track);
+		key.content_hash = fnv1a64(key.content_hash, &print_key_labels, sizeof print_key_labels);
+
+		struct layer_cache* c = &st->pianoroll.layers[LAYER_PIANOROLL_KEYS];
+		ImDrawList* ldl = NULL;
+		if (!layer_cache_match(c, &key)) {
+			ldl = layer_draw_list_begin(key.size);
+			draw_key_rows(ldl, 0, key.size.x, st->key127_y, black, white, print_key_labels, is_drum_track);
+		}
+		ImTextureID tex = miidhost_layer_draw(LAYER_PIANOROLL_KEYS, key.size, key.scale, ldl != NULL, 0, ldl);
+		if (tex != 0) {
+			*c = key;
+			c->valid = true;
+			draw_layer(draw_list, tex, p0, key.size);
+			return;
+		}
+		st->no_layers = true;
+	}
+
+	draw_key_rows(draw_list, p0.x, p1.x, p0.y + st->key127_y, black, white, print_key_labels, is_drum_track);
+}
+
+// notes column; cached in a layer that is reused as long as the view is
+// unchanged. when the timespan moves without changing its length, the layer
+// is scrolled and only the exposed strip is drawn.
+static void g_pianoroll_notes(ImDrawList* draw_list, ImVec2 p0, ImVec2 p1)
+{
+	struct state* st = curstate();
+	if (p1.x <= p0.x || p1.y <= p0.y) return;
+	const ImU32 black = CCOL32(black_pianoroll_color);
+	const ImU32 white = CCOL32(white_pianoroll_color);
+	const union timespan ts = st->selected_timespan;
+	const bool have_notes = ts.end > ts.start;
+
+	if (!st->no_layers) {
+		struct mid* mid = st->myd;
+		struct layer_cache key;
+		layer_cache_key_init(&key, p0, p1);
+		const int n_tracks = mid_get_track_count(mid);
+		key.content_hash = fnv1a64(key.content_hash, &mid->revision, sizeof mid->revision);
+		key.content_hash = fnv1a64(key.content_hash, &st->primary_track_select, sizeof st->primary_track_select);
+		key.content_hash = fnv1a64(key.content_hash, &n_tracks, sizeof n_tracks);
+		key.content_hash = bitset_hash(key.content_hash, &st->track_select_set, n_tracks);
+		key.span = ts.end - ts.start;
+		key.t0 = ts.start;
+
+		const float w = p1.x - p0.x;
+		const float px_per_tick = have_notes ? (w * key.scale) / (float)key.span : 0.0f;
+
+		struct layer_cache* c = &st->pianoroll.layers[LAYER_PIANOROLL_NOTES];
+		ImDrawList* ldl = NULL;
+		bool clear = false;
+		int scroll_px = 0;
+		if (!layer_cache_match(c, &key)) {
+			clear = true;
+		} else if (have_notes && c->t0 != key.t0) {
+			scroll_px = (int)round((c->t0 - key.t0) * px_per_tick);
+			if (scroll_px <= -(int)(w * key.scale) || scroll_px >= (int)(w * key.scale)) {
+				clear = true;
+				scroll_px = 0;
+			} else {
+				// keep the layer pixel-aligned; what's left is a
+				// sub-pixel offset when drawing it
+				key.t0 = c->t0 - (double)scroll_px / px_per_tick;
 			}
+		} else {
+			key.t0 = c->t0;
+		}
 
-			struct note_render nr;
-			const float t0 = (-state->beat0_x / state->beat_dx) * (float)mid->division;
-			const float t1 = t0 + ((clip1.x - clip0.x) / state->beat_dx) * (float)mid->division;
-			note_render_init(&nr, mid->end_of_song_pos, t0, t1, clip0.x, clip1.x);
-			const int nmod = 12; // FIXME?
-			const ImVec4 c0 = CCOL(pianoroll_note_color0);
-			const ImVec4 c1 = CCOL(pianoroll_note_color1);
-			for (int i0 = 1; i0 < n_rows; i0++) {
-				const float y0 = layout_y0s[i0];
-				const float y1 = layout_y0s[i0+1];
-				struct trk* trk = mid_get_trk(mid, must_map_row_to_track_index(i0));
-				const bool percussive = trk->percussive;
-				note_render_do_mevs(&nr, trk->mev_arr, arrlen(trk->mev_arr), percussive);
-				while (note_render_next(&nr)) {
-					const float x0 = nr.x0;
-					const float x1 = nr.x1;
-					const int note = (int)nr.note % nmod;
-					const float y = y0 + (nmod - 1 - note) + 0.5f*((y1-y0)-getsz(1)); // XXX scale?
-					ImVec4 cc = imvec4_lerp(c0, c1, (float)nr.velocity / 127.0f);
-					const ImU32 color = ImGui::GetColorU32(cc);
-					if (percussive) {
-						draw_list->AddCircleFilled(ImVec2(x0,y), 2, color);
-					} else {
-						draw_list->AddRectFilled(
-							ImVec2(x0, y-0.5),
-							ImVec2(x1, y+0.5),
-							color);
-					}
-				}
+		if (clear || scroll_px != 0) {
+			ldl = layer_draw_list_begin(key.size);
+			float cx0 = 0;
+			float cx1 = w;
+			if (scroll_px > 0) {
+				cx1 = ceilf((float)scroll_px / key.scale);
+			} else if (scroll_px < 0) {
+				cx0 = floorf(w + (float)scroll_px / key.scale);
+			}
+			ldl->PushClipRect(ImVec2(cx0, 0), ImVec2(cx1, key.size.y), true);
+			draw_key_rows(ldl, 0, key.size.x, st->key127_y, black, white, false, false);
+			if (have_notes) {
+				draw_notes(ldl, key.t0, key.t0 + key.span, 0, w, cx0, cx1, st->key127_y);
 			}
+			ldl->PopClipRect();
+		}
 
-			draw_list->PopClipRect();
-			ImGui::PopFont();
+		ImTextureID tex = miidhost_layer_draw(LAYER_PIANOROLL_NOTES, key.size, key.scale, clear, scroll_px, ldl);
+		if (tex != 0) {
+			*c = key;
+			c->valid = true;
+			const float dx = have_notes ? (float)((key.t0 - ts.start) * px_per_tick) / key.scale : 0.0f;
+			draw_layer(draw_list, tex, ImVec2(p0.x + dx, p0.y), key.size);
+			return;
 		}
+		st->no_layers = true;
 	}
 
-	state->header.hover_row_index = new_hover_row_index;
-
-	if (set_new_track_show_mode >= 0) {
-		state->header.track_show_mode = set_new_track_show_mode;
+	draw_key_rows(draw_list, p0.x, p1.x, p0.y + st->key127_y, black, white, false, false);
+	if (have_notes) {
+		draw_list->PushClipRect(p0, p1, true);
+		draw_notes(draw_list, ts.start, ts.end, p0.x, p1.x, p0.x, p1.x, p0.y + st->key127_y);
+		draw_list->PopClipRect();
 	}
 }
 
 static void g_pianoroll(void)
 {
 	struct state* st = curstate();
-	const int IDLE = 0, KEY_PAN = 1;
+	const int IDLE = 0, KEY_PAN = 1, NOTE_PAN = 2;
 
 	bool is_drum_track = false;
 
@@ -2003,17 +3275,18 @@ static void g_pianoroll(void)
 	const ImVec2 table_p1 = ImVec2(table_p0.x + avail.x, table_p0.y + table_height);
 	if (ImGui::BeginTable("pianoroll", n_columns, table_flags)) {
 		//ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, ImGui::GetColorU32(c));
-		ImGui::TableSetupColumn("keys",  ImGuiTableColumnFlags_WidthFixed);
+		ImGui::TableSetupColumn("keys",  ImGuiTableColumnFlags_WidthFixed, getsz(4));
 		ImGui::TableSetupColumn("notes", ImGuiTableColumnFlags_WidthStretch);
 		ImGui::TableNextRow();
 
-		const char* KEYS = "C#D#EF#G#A#B";
-		assert(strlen(KEYS) == 12);
-		//const int C4 = 60;
-
 		ImGuiIO& io = ImGui::GetIO();
 
+		const float table_separator = 20;
 		bool try_note_fit = false;
+		bool notes_hovered = false;
+		bool notes_active = false;
+		int notes_click = 0;
+		float notes_wheel = 0;
 
 		float w0 = 0, w1 = 0;
 		ImGui::TableSetColumnIndex(0);
@@ -2041,7 +3314,7 @@ static void g_pianoroll(void)
 				st->key127_y = -((my - st->key127_y) / st->key_dy) * new_key_dy + my;
 				st->key_dy = new_key_dy;
 			}
-			if (!is_drag && st->pianoroll.drag_state > IDLE) {
+			if (!is_drag && st->pianoroll.drag_state == KEY_PAN) {
 				st->pianoroll.drag_state = IDLE;
 			} else if (st->pianoroll.drag_state == KEY_PAN) {
 				const float y = ImGui::GetMouseDragDelta(1).y;
@@ -2055,11 +3328,45 @@ static void g_pianoroll(void)
 		{
 			w1 = ImGui::GetColumnWidth();
 			const ImVec2 sz(w1, table_height);
-			ImGui::InvisibleButton("pianoroll", sz, ImGuiButtonFlags_MouseButtonLeft | ImGuiButtonFlags_MouseButtonRight);
-			MaybeSetItemTooltip("Current tool: TODO: Left-click: TODO"); // TODO
+			ImGui::InvisibleButton("pianoroll", sz, ImGuiButtonFlags_MouseButtonLeft | ImGuiButtonFlags_MouseButtonRight | ImGuiButtonFlags_MouseButtonMiddle);
+			if (st->tool == TOOL_NOTE) {
+				MaybeSetItemTooltip("Note tool. Left-click: paint. Right-click: erase (bbox). Wheel: velocity. Middle-click: pan");
+			} else if (st->tool == TOOL_CURV) {
+				MaybeSetItemTooltip("Curve tool. Left-click: paint. Right-click: zero. Wheel: curve lane height. Middle-click: pan");
+			} else if (st->tool == TOOL_SEQ) {
+				MaybeSetItemTooltip("Sequencer. Left-click: place cursor. Right-click: erase (bbox). Wheel: velocity. Middle-click: pan");
+			}
 			ImGui::SetItemKeyOwner(ImGuiKey_MouseWheelY); // grab mouse wheel
-			//const bool is_drag = ImGui::IsItemActive();
-			//const bool is_hover = ImGui::IsItemHovered();
+			const bool is_drag = ImGui::IsItemActive();
+			const bool is_hover = ImGui::IsItemHovered();
+			notes_hovered = is_hover && st->pianoroll.drag_state == IDLE && st->note_tool.stroke_button == 0 && st->curve_tool.stroke_button == 0;
+			// tools run once the notes rect is known, below
+			notes_active = is_drag;
+			if (is_hover && st->pianoroll.drag_state == IDLE) {
+				if (ImGui::IsMouseClicked(0)) notes_click = 1;
+				if (ImGui::IsMouseClicked(1)) notes_click = 2;
+				notes_wheel = io.MouseWheel;
+			}
+			const bool click_mmb = is_hover && ImGui::IsMouseClicked(2);
+			if (click_mmb) {
+				st->pianoroll.drag_state = NOTE_PAN;
+				st->pianoroll.pan_last_y = 0;
+				st->pianoroll.pan_timespan0 = st->selected_timespan;
+			}
+			if (!is_drag && st->pianoroll.drag_state == NOTE_PAN) {
+				st->pianoroll.drag_state = IDLE;
+			} else if (st->pianoroll.drag_state == NOTE_PAN) {
+				const ImVec2 d = ImGui::GetMouseDragDelta(2);
+				const union timespan ts0 = st->pianoroll.pan_timespan0;
+				const float notes_width = w1 - table_separator;
+				if (ts0.end > ts0.start && notes_width > 0) {
+					const int dt = (int)roundf(d.x * (float)(ts0.end - ts0.start) / notes_width);
+					st->selected_timespan.start = ts0.start - dt;
+					st->selected_timespan.end   = ts0.end   - dt;
+				}
+				st->key127_y += d.y - st->pianoroll.pan_last_y;
+				st->pianoroll.pan_last_y = d.y;
+			}
 		}
 
 		ImGui::EndTable();
@@ -2068,158 +3375,62 @@ static void g_pianoroll(void)
 
 		ImGui::PushFont(g.fonts[1]);
 
-		const float line_height = ImGui::GetTextLineHeight();
-		const bool print_key_labels = st->key_dy > line_height;
-		const float key_size = st->key_dy;
-
-		const float table_separator = 20;
-
-		{
-			draw_list->PushClipRect(table_p0, table_p1);
-
-			const ImU32 key_label_color = CCOL32(key_label_color);
-
-			for (int col = 0; col < 2; col++) {
-				float x0=0,x1=0;
-				ImU32 black, white;
-				if (col == 0) {
-					x0 = table_p0.x;
-					x1 = x0 + w0;
-					black = CCOL32(black_keys_color);
-					white = CCOL32(white_keys_color);
-				} else if (col == 1) {
-					x0 = table_p0.x + w0 + table_separator;
-					x1 = x0 + w1 - table_separator;
-					black = CCOL32(black_pianoroll_color);
-					white = CCOL32(white_pianoroll_color);
-				} else {
-					assert(!"UNREACHABLE");
-				}
-
-				const float y0 = table_p0.y + st->key127_y;
-				draw_list->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y0 + 128*key_size), white);
-
-				float y = y0;
-				char prev_key = 0;
-				for (int note = 127; note >= 0; note--, y += key_size) {
-					char key = KEYS[note % 12];
-					if (key == '#') {
-						const float y0 = y;
-						const float y1 = y + key_size;
-						draw_list->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y1), black);
-					}
-					if ((key == '#') == (prev_key == '#')) {
-						const float y0 = y - 0.5;
-						const float y1 = y + 0.5;
-						draw_list->AddRectFilled( ImVec2(x0, y0), ImVec2(x1, y1), black);
-					}
-					if (col == 0 && print_key_labels) {
-						char buf[1<<10];
-						const char* key_label = NULL;
-						if (is_drum_track) {
-							key_label = get_drum_key(note);
-						}
-						if (key_label == NULL) {
-							const char* sep = "";
-							char k = key;
-							if (k == '#') {
-								sep = "#";
-								assert(note > 0);
-								k = KEYS[(note+11) % 12];
-							}
-							const int octave = (note/12)-1;
-							snprintf(buf, sizeof buf, "%c%s%d", k, sep, octave);
-							key_label = buf;
-						}
-						draw_list->AddText(ImVec2(x0 + getsz(0.3), y + key_size/2 - line_height/2), key_label_color, key_label);
-					}
-					prev_key = key;
-				}
+		const ImVec2 clip0(table_p0.x + w0 + table_separator, table_p0.y);
+		const ImVec2 clip1(clip0.x + w1 - table_separator,    table_p1.y);
+
+		st->frame_stats.pianoroll_keys_p0 = table_p0;
+		st->frame_stats.pianoroll_keys_p1 = ImVec2(table_p0.x + w0, table_p1.y);
+		st->frame_stats.pianoroll_notes_p0 = clip0;
+		st->frame_stats.pianoroll_notes_p1 = clip1;
+
+		draw_list->PushClipRect(table_p0, table_p1);
+		g_pianoroll_keys(draw_list, table_p0, ImVec2(table_p0.x + w0, table_p1.y), is_drum_track);
+		g_pianoroll_notes(draw_list, clip0, clip1);
+		draw_list->PopClipRect();
+
+		if (st->tool == TOOL_NOTE) {
+			g_note_tool(draw_list, clip0, clip1, notes_click, notes_active, notes_wheel);
+		} else if (st->tool == TOOL_CURV) {
+			g_curve_tool(draw_list, clip0, clip1, notes_click, notes_active, notes_wheel);
+		} else if (st->tool == TOOL_SEQ) {
+			g_seq_tool(draw_list, clip0, clip1, notes_click, notes_active, notes_wheel);
+		}
+
+		st->pianoroll.hover_track_index = -1;
+		if (notes_hovered && have_selected_timespan && clip1.x > clip0.x) {
+			const float px_per_tick = (clip1.x - clip0.x) / (float)(selected_timespan.end - selected_timespan.start);
+			const float mx = io.MousePos.x - clip0.x;
+			const float my = io.MousePos.y - clip0.y;
+			const int pos = selected_timespan.start + (int)floorf(mx / px_per_tick);
+			const int key = 127 - (int)floorf((my - st->key127_y) / st->key_dy);
+			const float r = fmaxf(CFLOAT(percussion_line_width), CFLOAT(percussion_dot_radius));
+			st->pianoroll.hover_track_index = hit_test_note(pos, key, (int)ceilf(r / px_per_tick), &st->pianoroll.hover);
+		}
+		if (st->pianoroll.hover_track_index >= 0) {
+			const struct note_hit* h = &st->pianoroll.hover;
+			const float px_per_tick = (clip1.x - clip0.x) / (float)(selected_timespan.end - selected_timespan.start);
+			float x0 = clip0.x + (float)(h->start - selected_timespan.start) * px_per_tick;
+			float x1 = clip0.x + (float)(h->end   - selected_timespan.start) * px_per_tick;
+			if (mid_get_trk(mid, st->pianoroll.hover_track_index)->percussive) {
+				const float r = fmaxf(CFLOAT(percussion_line_width), CFLOAT(percussion_dot_radius));
+				x1 = x0 + r;
+				x0 = x0 - r;
 			}
-
+			const float y0 = clip0.y + st->key127_y + (float)(127 - h->key) * st->key_dy;
+			draw_list->PushClipRect(clip0, clip1, true);
+			draw_list->AddRect(ImVec2(x0, y0), ImVec2(x1, y0 + st->key_dy), CCOL32(pianoroll_note_hover_color), 0, 0, getsz(0.1f));
 			draw_list->PopClipRect();
 		}
 
-		if (have_selected_timespan) {
-			const ImVec2 clip0(table_p0.x + w0 + table_separator, table_p0.y);
-			const ImVec2 clip1(clip0.x + w1 - table_separator,    table_p1.y);
-			draw_list->PushClipRect(clip0, clip1);
-
-			const int t0 = selected_timespan.start;
-			const int t1 = selected_timespan.end;
-
-			const ImVec4 c0 = CCOL(pianoroll_note_color0);
-			const ImVec4 c1 = CCOL(pianoroll_note_color1);
-			const ImU32 border_color = CCOL32(pianoroll_note_border_color);
-			const float border_size = CFLOAT(pianoroll_note_border_size);
-
-			struct note_render nr;
-			note_render_init(&nr, mid->end_of_song_pos, t0, t1, clip0.x, clip1.x);
-
-			int note_min = -1;
-			int note_max = -1;
-			const int n_tracks = mid_get_track_count(mid);
-			for (int pass = 0; pass < 2; pass++) {
-				if (pass == 1 && st->primary_track_select < 0) break;
-				for (int track_index = 0; track_index < n_tracks; track_index++) {
-					if (pass == 0 && st->track_select_set[track_index] == 0) continue;
-					if (pass == 0 && track_index == st->primary_track_select) continue;
-					if (pass == 1 && track_index != st->primary_track_select) continue;
-					//const bool is_primary = (pass == 1);
-					const bool is_other = (pass == 0);
-
-					struct trk* trk = mid_get_trk(mid, track_index);
-					const bool percussive = trk->percussive;
-					note_render_do_mevs(&nr, trk->mev_arr, arrlen(trk->mev_arr), percussive);
-
-					while (note_render_next(&nr)) {
-						const float x0 = nr.x0;
-						const float x1 = nr.x1;
-						const int note = nr.note;
-						const float y0 = clip0.y + st->key127_y + (float)(127-note) * st->key_dy;
-						const float y1 = y0 + st->key_dy;
-						ImVec4 cc = imvec4_lerp(c0, c1, (float)nr.velocity / 127.0f);
-						if (is_other) cc = CCOLTX(cc, pianoroll_note_other_track_coltx);
-						const ImU32 color = ImGui::GetColorU32(cc);
-						bool is_visible = false;
-						if (!percussive) {
-							if (x1 > clip0.x && x0 < clip1.x) {
-								draw_list->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y1), color);
-								if (border_size > 0 && border_color > 0) {
-									draw_list->AddRect(ImVec2(x0, y0), ImVec2(x1, y1), border_color, 0, 0, border_size);
-								}
-								is_visible = true;
-							}
-						} else {
-							if (x0 >= clip0.x && x0 <= clip1.x) {
-								const float m = CFLOAT(percussion_line_width);
-								if (m > 0) {
-									draw_list->AddRectFilled(ImVec2(x0-m, y0), ImVec2(x0+m, y1), color);
-									is_visible = true;
-								}
-								const float r = CFLOAT(percussion_dot_radius);
-								if (r > 0) {
-									draw_list->AddCircleFilled(ImVec2(x0, (y0+y1)*0.5f), r, color);
-									is_visible = true;
-								}
-							}
-						}
-						if (is_visible) {
-							if (note_min == -1) {
-								note_min = note;
-								note_max = note;
-							}  else {
-								if (note < note_min) note_min = note;
-								if (note > note_max) note_max = note;
-							}
-						}
-					}
-				}
-			}
-
-			draw_list->PopClipRect();
+		if (have_selected_timespan && st->play.have_tick && selected_timespan.start <= st->play.tick && st->play.tick < selected_timespan.end) {
+			const float px_per_tick = (clip1.x - clip0.x) / (float)(selected_timespan.end - selected_timespan.start);
+			const float x = clip0.x + (float)(st->play.tick - selected_timespan.start) * px_per_tick;
+			draw_list->AddLine(ImVec2(x, clip0.y), ImVec2(x, clip1.y), CCOL32(play_cursor_color), CFLOAT(play_cursor_size));
+		}
 
-			if (try_note_fit && note_min != -1) {
+		if (have_selected_timespan && try_note_fit) {
+			int note_min, note_max;
+			if (get_note_range(selected_timespan.start, selected_timespan.end, &note_min, &note_max)) {
 				const float s = lerp(0.0f, 0.4f, CFLOAT(note_fit_padding));
 				const float vy0 = lerp(clip0.y, clip1.y, s);
 				const float vy1 = lerp(clip0.y, clip1.y, 1-s);
@@ -2326,94 +3537,93 @@ static void g_pianoroll(void)
 	#endif
 
 	// bottom toolbar
-	#if 0
 	{
-		enum {
-			TOOL_NOTE,
-			TOOL_CURV,
-			TOOL_SEQ,
-			TOOL_VIEW,
-			TOOL_ART,
-		};
-		static int e2 = TOOL_NOTE;
-		static bool brushen = false;
+		int* tool = &st->tool;
 
-		if (RadiaButton("Note", &e2, TOOL_NOTE)) {
-			brushen = false;
+		if (RadiaButton("Note", tool, TOOL_NOTE)) {
+			st->brushen = false;
 		}
-		MaybeSetItemTooltip("Paint notes\nLeft-click to paint\nRight-click to erase (bbox)\nWheel changes velocity\nPage up/down navigates brush history");
+		MaybeSetItemTooltip("Paint notes\nLeft-click to paint\nRight-click to erase (bbox)\nWheel changes velocity");
 
 		ImGui::SameLine();
 
-		//ImGui::BeginDisabled();
-		if (RadiaButton("Curv", &e2, TOOL_CURV)) {
-			brushen = false;
+		if (RadiaButton("Curv", tool, TOOL_CURV)) {
+			st->brushen = false;
 		}
-		//ImGui::EndDisabled();
-		MaybeSetItemTooltip("Paint curves (pitchbend/CC)\nLeft-click to paint\nRight-click to zero\nWheel changes curve view height\nPage up/down navigates brush history");
+		MaybeSetItemTooltip("Paint curves (pitchbend/CC)\nLeft-click to paint\nRight-click to zero\nWheel changes curve view height");
 
 		ImGui::SameLine();
-		if (RadiaButton("Seq", &e2, TOOL_SEQ)) {
-			brushen = false;
+		if (RadiaButton("Seq", tool, TOOL_SEQ)) {
+			st->brushen = false;
 		}
-		MaybeSetItemTooltip("Sequencer: enter note sequences using keyboard\nLeft-click to place cursor\nRight-click to erase(bbox)\nWheel changes velocity");
+		MaybeSetItemTooltip("Sequencer: enter note sequences using keyboard\nLeft-click to place cursor\nRight-click to erase(bbox)\nWheel changes velocity\nSpace enters a rest, Backspace undoes a step");
 
 		ImGui::SameLine();
-		if (RadiaButton("View", &e2, TOOL_VIEW)) {
-			brushen = false;
+		ImGui::BeginDisabled(); // TODO
+		if (RadiaButton("View", tool, TOOL_VIEW)) {
+			st->brushen = false;
 		}
+		ImGui::EndDisabled();
 		MaybeSetItemTooltip("Change view (/time-selction)\nLeft-click to center\nRight-click to pan\nWheel for zoom\n");
 
 		ImGui::SameLine();
-		if (RadiaButton("Art", &e2, TOOL_ART)) {
-			brushen = false;
+		ImGui::BeginDisabled(); // TODO
+		if (RadiaButton("Art", tool, TOOL_ART)) {
+			st->brushen = false;
 		}
+		ImGui::EndDisabled();
 		MaybeSetItemTooltip("Artistic brushes; tool with configurable area effects\nLeft/right-click to use tool A/B\nWheel changes radius\nManage brushes with [Configure]");
 
 		bool do_open_art_configure_popup = false;
 
-		if (e2 == TOOL_NOTE || e2 == TOOL_CURV) {
+		if (*tool == TOOL_NOTE || *tool == TOOL_CURV) {
 			ImGui::SameLine();
-			Blinkbox("BrushDef", &brushen);
+			ImGui::BeginDisabled(); // TODO brushes
+			Blinkbox("BrushDef", &st->brushen);
+			ImGui::EndDisabled();
 			MaybeSetItemTooltip("Define a brush for the current tool.");
 
-			if (e2 == TOOL_NOTE) {
-				static int velocity = 127;
+			if (*tool == TOOL_NOTE) {
 				ImGui::SameLine();
 				ImGui::SetNextItemWidth(getsz(10));
-				ImGui::SliderInt("##velocity", &velocity, 1, 127, "velocity=%d", ImGuiSliderFlags_AlwaysClamp);
-			} else if (e2 == TOOL_CURV) {
-				static int curve_type_index = 0;
-				const char* curve_types[] = {
-					"Pitch Bend",
-					"(CC1) Modulation Wheel",
-					"(CC7) Volume",
-					"(CC10) Pan",
-					"(CC64) Damper Pedal",
-					"(CC91/FX1) Reverb",
-					"(CC93/FX3) Chorus",
-				};
+				ImGui::SliderInt("##velocity", &st->note_tool.velocity, 1, 127, "velocity=%d", ImGuiSliderFlags_AlwaysClamp);
+			} else if (*tool == TOOL_CURV) {
+				int* curve_index = &st->curve_tool.curve_index;
 				ImGui::SameLine();
-				if (ImGui::BeginCombo("##curvetypecombo", curve_types[curve_type_index], ImGuiComboFlags_WidthFitPreview)) {
+				if (ImGui::BeginCombo("##curvetypecombo", curve_types[*curve_index].label, ImGuiComboFlags_WidthFitPreview)) {
 					for (int i = 0; i < ARRAY_LENGTH(curve_types); i++) {
-						if (ImGui::Selectable(curve_types[i], i == curve_type_index)) {
-							curve_type_index = i;
+						if (ImGui::Selectable(curve_types[i].label, i == *curve_index)) {
+							*curve_index = i;
 						}
 					}
 					ImGui::EndCombo();
 				}
 				MaybeSetItemTooltip("Select type of curve (Pitch Bend / Control Change)");
+				ImGui::SameLine();
+				ImGui::SetNextItemWidth(getsz(8));
+				ImGui::SliderInt("##steps", &st->curve_tool.steps_per_qn, 1, 64, "%d/qn", ImGuiSliderFlags_AlwaysClamp);
+				MaybeSetItemTooltip("Curve resolution: at most this many events per quarter note");
+				ImGui::SameLine();
+				ImGui::SetNextItemWidth(getsz(8));
+				ImGui::SliderFloat("##tolerance", &st->curve_tool.tolerance, 0.0f, 8.0f, "tolerance=%.1f", ImGuiSliderFlags_AlwaysClamp);
+				MaybeSetItemTooltip("Curve simplification: a new event is only added when the value has moved this much (0-127 units)");
 			}
-		} else if (e2 == TOOL_ART) {
+		} else if (*tool == TOOL_ART) {
 			ImGui::SameLine();
 			if (ImGui::Button("Configure")) {
 				do_open_art_configure_popup = true;
 			}
-		} else if (e2 == TOOL_SEQ) {
-			static int velocity = 127;
+		} else if (*tool == TOOL_SEQ) {
 			ImGui::SameLine();
 			ImGui::SetNextItemWidth(getsz(10));
-			ImGui::SliderInt("##velocity2", &velocity, 1, 127, "velocity=%d", ImGuiSliderFlags_AlwaysClamp);
+			ImGui::SliderInt("##velocity2", &st->seq_tool.velocity, 1, 127, "velocity=%d", ImGuiSliderFlags_AlwaysClamp);
+			ImGui::SameLine();
+			ImGui::SetNextItemWidth(getsz(6));
+			ImGui::SliderInt("##octave", &st->seq_tool.octave, -1, 8, "octave=%d", ImGuiSliderFlags_AlwaysClamp);
+			ImGui::SameLine();
+			ImGui::SetNextItemWidth(getsz(6));
+			ImGui::SliderInt("##steps", &st->seq_tool.steps_per_beat, 1, 8, "%d/beat", ImGuiSliderFlags_AlwaysClamp);
+			MaybeSetItemTooltip("Step length, in steps per beat");
 		}
 
 		if (do_open_art_configure_popup) {
@@ -2426,7 +3636,6 @@ static void g_pianoroll(void)
 			ImGui::EndPopup();
 		}
 	}
-	#endif
 }
 
 static void g_edit(void)
@@ -2461,23 +3670,31 @@ static void g_edit(void)
 	} else {
 	}
 
+	st->play.have_tick = play_get_tick(st, &st->play.tick);
+
+	struct miid_frame_stats* fs = &st->frame_stats;
+	ImDrawList* dl = ImGui::GetWindowDrawList();
+	double t = get_time();
+	int vtx = dl->VtxBuffer.Size, idx = dl->IdxBuffer.Size;
+
 	g_header();
+
+	double t1 = get_time();
+	fs->header_seconds = t1 - t;
+	fs->header_vtx = dl->VtxBuffer.Size - vtx;
+	fs->header_idx = dl->IdxBuffer.Size - idx;
+	t = t1;
+	vtx = dl->VtxBuffer.Size;
+	idx = dl->IdxBuffer.Size;
+
 	g_pianoroll();
-}
 
-static struct mid* mid_new(void)
-{
-	struct mid* m = new mid();
-	m->text = alloc_text_field();
-	strncpy(m->text, "TODO your song title", TEXT_FIELD_SIZE);
-	m->division = 480;
-	struct trk* trk = arraddnptr(m->_trk_arr, 1);
-	memset(trk, 0, sizeof *trk);
-	trk->midi_channel = -1;
-	trk->name = alloc_text_field();
-	return m;
+	fs->pianoroll_seconds = get_time() - t;
+	fs->pianoroll_vtx = dl->VtxBuffer.Size - vtx;
+	fs->pianoroll_idx = dl->IdxBuffer.Size - idx;
 }
 
+
 static void state_new_song(struct state* st)
 {
 	assert((st->myd == NULL) && "is myd free()'d? why is it not NULL?");
@@ -2525,30 +3742,117 @@ static struct state* new_state(void)
 	return st;
 }
 
-ImFontAtlas* shared_font_atlas = NULL;
-static void state_common_init(struct state* st, int mode0)
+thread_local ImGuiContext* MiidImGuiTLS = NULL; // see imconfig.h
+
+// rasterises font_sizes[] at gui_size=size. runs on the font worker thread,
+// so it must not read config or touch ImGui contexts
+static ImFontAtlas* font_atlas_build(float size)
 {
-	if (shared_font_atlas == NULL) {
-		shared_font_atlas = new ImFontAtlas();
-		char* MIID_TTF = getenv("MIID_TTF");
-		for (int i = 0; i < ARRAY_LENGTH(font_sizes); i++) {
-			const float sz = getsz(font_sizes[i]);
-			if (MIID_TTF != NULL && strlen(MIID_TTF) > 0) {
-				g.fonts[i] = shared_font_atlas->AddFontFromFileTTF(MIID_TTF, sz);
-			} else {
-				#ifdef C_TTF
-				g.fonts[i] = shared_font_atlas->AddFontFromFileTTF(C_TTF, sz);
-				#else
-				ImFontConfig cfg;
-				cfg.FontDataOwnedByAtlas = false; // memory is static
-				g.fonts[i] = shared_font_atlas->AddFontFromMemoryTTF(font_ttf, font_ttf_len, sz, &cfg);
-				#endif
+	ImFontAtlas* atlas = new ImFontAtlas();
+	char* MIID_TTF = getenv("MIID_TTF");
+	for (int i = 0; i < ARRAY_LENGTH(font_sizes); i++) {
+		const float sz = size * font_sizes[i];
+		if (MIID_TTF != NULL && strlen(MIID_TTF) > 0) {
+			atlas->AddFontFromFileTTF(MIID_TTF, sz);
+		} else {
+			#ifdef C_TTF
+			atlas->AddFontFromFileTTF(C_TTF, sz);
+			#else
+			ImFontConfig cfg;
+			cfg.FontDataOwnedByAtlas = false; // memory is static
+			atlas->AddFontFromMemoryTTF(font_ttf, font_ttf_len, sz, &cfg);
+			#endif
+		}
+	}
+	// also convert to what the host uploads, so that the main thread only
+	// has to copy it
+	unsigned char* pixels;
+	int width, height;
+	atlas->GetTexDataAsRGBA32(&pixels, &width, &height);
+	return atlas;
+}
+
+static void* font_worker(void* usr)
+{
+	const float size = *(float*)usr;
+	g.font.build_result.store(font_atlas_build(size));
+	return NULL;
+}
+
+static void font_atlas_install(ImFontAtlas* atlas)
+{
+	if (g.font.atlas != NULL) arrput(g.font.retired_arr, g.font.atlas);
+	g.font.atlas = atlas;
+	for (int i = 0; i < ARRAY_LENGTH(font_sizes); i++) {
+		g.fonts[i] = atlas->Fonts[i];
+	}
+}
+
+// starts rebuilding the atlas in the background when gui_size has changed.
+// one build at a time; if gui_size moves on while building (e.g. dragging
+// the slider) the next build starts when this one is done
+static void font_atlas_update(void)
+{
+	const float size = CFLOAT(gui_size);
+	if (g.font.building || size == g.font.size) return;
+	g.font.size = size;
+	g.font.build_size = size;
+	const int err = pthread_create(&g.font.thread, NULL, font_worker, &g.font.build_size);
+	g.font.threaded = err == 0;
+	if (!g.font.threaded) {
+		// installed in miid_new_frame() like a background build; io.Fonts
+		// must not change in the middle of a frame
+		fprintf(stderr, "WARNING: pthread_create: %s; rebuilding fonts synchronously\n", strerror(err));
+		g.font.build_result.store(font_atlas_build(size));
+	}
+	g.font.building = true;
+}
+
+bool miid_new_frame(void* usr)
+{
+	if (g.font.building) {
+		ImFontAtlas* atlas = g.font.build_result.load();
+		if (atlas != NULL) {
+			if (g.font.threaded) pthread_join(g.font.thread, NULL);
+			g.font.build_result.store(NULL);
+			g.font.building = false;
+			font_atlas_install(atlas);
+		}
+	}
+
+	ImGuiIO& io = ImGui::GetIO();
+	if (io.Fonts == g.font.atlas) return false;
+	io.Fonts = g.font.atlas;
+	((struct state*)usr)->font_atlas = g.font.atlas;
+
+	// free atlases no longer used by any (open) window
+	for (int i = 0; i < arrlen(g.font.retired_arr); i++) {
+		ImFontAtlas* atlas = g.font.retired_arr[i];
+		bool in_use = false;
+		for (int j = 0; j < arrlen(g.state_arr); j++) {
+			struct state* st = g.state_arr[j];
+			if (st->mode0 != MODE0_DO_CLOSE && st->font_atlas == atlas) {
+				in_use = true;
+				break;
 			}
 		}
-		shared_font_atlas->Build();
+		if (in_use) continue;
+		delete atlas;
+		arrdel(g.font.retired_arr, i);
+		i--;
+	}
+	return true;
+}
+
+static void state_common_init(struct state* st, int mode0)
+{
+	if (g.font.atlas == NULL) {
+		g.font.size = CFLOAT(gui_size);
+		font_atlas_install(font_atlas_build(g.font.size));
 	}
-	assert(shared_font_atlas != NULL);
-	miidhost_create_window(st, shared_font_atlas);
+	st->font_atlas = g.font.atlas;
+	arrput(g.state_arr, st);
+	miidhost_create_window(st, g.font.atlas);
 
 	ImGuiIO& io = ImGui::GetIO();
 	io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;
@@ -2570,25 +3874,22 @@ static void push_state_create(const char* path)
 	state_common_init(st, MODE0_CREATE);
 }
 
-static bool push_state_from_mid_blob(struct blob blob)
+static void push_state_from_mid(struct mid* mid)
 {
 	struct state* st = new_state();
-	st->myd = mid_unmarshal_blob(blob);
-	if (st->myd == NULL) {
-		return false;
-	}
+	st->myd = mid;
 	state_common_init(st, MODE0_EDIT);
 	#if 1
 	// XXX remove me eventually. currently it's pretty cool though
 	uint8_t* out_arr = mid_marshal_arr(st->myd);
 	write_file_from_arr(out_arr, "_.mid");
 	#endif
-	return true;
 }
 
 void miid_init(int argc, char** argv, float sample_rate)
 {
 	g.using_audio = sample_rate > 0;
+	g.sample_rate = sample_rate;
 
 	fluid_settings_t* fs = new_fluid_settings();
 	assert(fluid_settings_setnum(fs, "synth.sample-rate", sample_rate) != FLUID_FAILED);
@@ -2607,23 +3908,43 @@ void miid_init(int argc, char** argv, float sample_rate)
 	} else {
 		for (int ai = 1; ai < argc; ai++) {
 			char* mid_path = argv[ai];
+			struct mid* mid = mid_load_miidc(mid_path);
+			if (mid != NULL) {
+				push_state_from_mid(mid);
+				continue;
+			}
 			struct blob mid_blob = blob_load(mid_path);
 			if (mid_blob.data == NULL) {
 				push_state_create(mid_path);
 			} else {
-				if (!push_state_from_mid_blob(mid_blob)) {
+				mid = mid_unmarshal_blob(mid_blob);
+				if (mid == NULL) {
 					fprintf(stderr, "ERROR: %s: bad MIDI file\n", mid_path);
 					exit(EXIT_FAILURE);
 				}
+				mid_normalise(mid);
+				mid_save_miidc(mid_path, mid, mid_blob);
+				free(mid_blob.data);
+				push_state_from_mid(mid);
 			}
 		}
 	}
 }
 
+void miid_get_frame_stats(void* usr, struct miid_frame_stats* stats)
+{
+	struct state* st = (struct state*)usr;
+	*stats = st->frame_stats;
+}
+
 bool miid_frame(void* usr, bool request_close)
 {
 	struct state* st = (struct state*)usr;
 	g.curstate = st;
+	config_snapshot_update();
+	font_atlas_update();
+	play_collect();
+	assert(ImGui::GetIO().Fonts == g.font.atlas && "host did not call miid_new_frame()");
 
 	ImGuiIO& io = ImGui::GetIO();
 	const ImGuiWindowFlags root_window_flags = ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoBackground;
@@ -6,7 +6,41 @@ void miid_init(int argc, char** argv, float sample_rate);
 void miid_audio_callback(float* stream, int n_frames);
 bool miid_frame(void* usr, bool request_close);
 
+// call with the window's context current before ImGui::NewFrame(). when
+// gui_size changes the font atlas is rebuilt in the background and swapped
+// in here; returns true if it was, and the host must then re-upload the font
+// texture (io.Fonts is already the new atlas)
+bool miid_new_frame(void* usr);
+
+// what the last miid_frame() spent on the header and the pianoroll: CPU time
+// and vertices/indices added to the window draw list (popups and layer
+// contents not included). also where things were, so that scripted input
+// (miid-benchgui) can aim at them. only updated in edit mode
+struct miid_frame_stats {
+	double header_seconds;
+	double pianoroll_seconds;
+	int header_vtx, header_idx;
+	int pianoroll_vtx, pianoroll_idx;
+	ImVec2 header_timeline_p0, header_timeline_p1; // time row + track rows
+	float header_time_row_y1; // time row ends, track rows begin
+	ImVec2 pianoroll_keys_p0, pianoroll_keys_p1;
+	ImVec2 pianoroll_notes_p0, pianoroll_notes_p1;
+};
+void miid_get_frame_stats(void* usr, struct miid_frame_stats* stats);
+
 void miidhost_create_window(void* usr, ImFontAtlas* shared_font_atlas);
 
+// offscreen layers: the host keeps MIID_MAX_LAYERS textures per window that
+// draw lists can be rendered into and reused across frames. size is in
+// points, and draw_list coordinates are relative to the layer's top-left
+// corner. clear=true clears the layer (to opaque black) before drawing.
+// scroll_px!=0 shifts the existing content horizontally by that many pixels
+// (positive is right), and draw_list should then fill the exposed strip.
+// draw_list==NULL leaves the content as is. returns 0 if the host cannot
+// render offscreen; the caller must then draw directly. the returned texture
+// is upside down (use uv0=(0,1), uv1=(1,0)).
+#define MIID_MAX_LAYERS (4)
+ImTextureID miidhost_layer_draw(int layer, ImVec2 size, float scale, bool clear, int scroll_px, ImDrawList* draw_list);
+
 #define MIID_H
 #endif
@@ -0,0 +1,241 @@
+// miid-batch: parses, validates, normalises and re-marshals .mid files
+// without a window. runs across all cores; meant for preprocessing big
+// libraries (e.g. building .miidc caches overnight)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <atomic>
+
+#include "stb_ds.h"
+
+#include "util.h"
+#include "mid.h"
+
+struct job {
+	char* path;
+	int root_len; // path+root_len is the path relative to the walked root
+};
+
+// one per worker, written on every file; aligned so that workers don't
+// share cache lines
+struct alignas(64) stats {
+	int n_files;
+	int n_failed;
+	int n_normalised;
+	int n_invalid;
+	int64_t n_events;
+	int64_t bytes_in;
+	int64_t bytes_out;
+};
+
+static struct {
+	struct job* job_arr;
+	std::atomic<int> next_job;
+	const char* out_dir;
+	bool write_cache;
+	bool verbose;
+	int walk_root_len;
+} g;
+
+static bool has_mid_ext(const char* path)
+{
+	const char* ext = strrchr(path, '.');
+	if (ext == NULL) return false;
+	return strcasecmp(ext, ".mid") == 0 || strcasecmp(ext, ".midi") == 0;
+}
+
+static int walk_fn(const char* path, const struct stat* sb, int type, struct FTW* ftw)
+{
+	(void)sb;
+	(void)ftw;
+	if (type != FTW_F || !has_mid_ext(path)) return 0;
+	arrput(g.job_arr, ((struct job) {
+		.path = strdup(path),
+		.root_len = g.walk_root_len,
+	}));
+	return 0;
+}
+
+static bool mkdirs(char* path)
+{
+	for (char* p = path+1; *p; p++) {
+		if (*p != '/') continue;
+		*p = 0;
+		const bool ok = mkdir(path, 0777) == 0 || errno == EEXIST;
+		*p = '/';
+		if (!ok) return false;
+	}
+	return true;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void process(struct job* job, struct stats* stats)
+{
+	stats->n_files++;
+	struct blob blob = blob_load(job->path);
+	if (blob.data == NULL) {
+		fprintf(stderr, "FAIL %s: %s\n", job->path, mid_last_error);
+		stats->n_failed++;
+		return;
+	}
+	stats->bytes_in += blob.size;
+
+	struct mid* mid = mid_unmarshal_blob(blob);
+	if (mid == NULL) {
+		fprintf(stderr, "FAIL %s: %s\n", job->path, mid_last_error);
+		stats->n_failed++;
+		free(blob.data);
+		return;
+	}
+
+	const int n_trks = arrlen(mid->_trk_arr);
+	for (int i = 0; i < n_trks; i++) stats->n_events += arrlen(mid->_trk_arr[i].mev_arr);
+
+	if (mid_normalise(mid) > 0) stats->n_normalised++;
+	if (mid_validate(mid, job->path) > 0) stats->n_invalid++;
+
+	if (g.write_cache) mid_save_miidc(job->path, mid, blob);
+
+	uint8_t* out_arr = mid_marshal_arr(mid);
+	stats->bytes_out += arrlen(out_arr);
+	if (g.out_dir != NULL) {
+		char path[1<<12];
+		const char* rel = job->path + job->root_len;
+		while (*rel == '/') rel++;
+		snprintf(path, sizeof path, "%s/%s", g.out_dir, rel);
+		if (!mkdirs(path) || !write_file_from_arr(out_arr, path)) {
+			fprintf(stderr, "FAIL %s: cannot write %s\n", job->path, path);
+			stats->n_failed++;
+		}
+	}
+	arrfree(out_arr);
+
+	if (g.verbose) printf("OK %s\n", job->path);
+
+	mid_free(mid);
+	free(blob.data);
+}
+
+static void* worker(void* usr)
+{
+	struct stats* stats = (struct stats*)usr;
+	const int n_jobs = arrlen(g.job_arr);
+	for (;;) {
+		const int i = g.next_job.fetch_add(1);
+		if (i >= n_jobs) break;
+		process(&g.job_arr[i], stats);
+	}
+	return NULL;
+}
+
+static void usage(const char* prg)
+{
+	fprintf(stderr, "Usage: %s [-j N] [-c] [-o DIR] [-v] <file.mid|dir>...\n", prg);
+	fprintf(stderr, "  -j N    number of worker threads (default: number of cores)\n");
+	fprintf(stderr, "  -c      write .miidc cache next to each .mid\n");
+	fprintf(stderr, "  -o DIR  write normalised .mid files to DIR (mirroring the input tree)\n");
+	fprintf(stderr, "  -v      print parser warnings and every processed file\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+	int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "j:co:v")) != -1) {
+		switch (opt) {
+		case 'j': n_threads = atoi(optarg); break;
+		case 'c': g.write_cache = true; break;
+		case 'o': g.out_dir = optarg; break;
+		case 'v': g.verbose = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc || n_threads < 1) usage(argv[0]);
+	mid_quiet = !g.verbose;
+
+	for (int ai = optind; ai < argc; ai++) {
+		const char* root = argv[ai];
+		struct stat sb;
+		if (stat(root, &sb) != 0) {
+			fprintf(stderr, "%s: %s\n", root, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (S_ISDIR(sb.st_mode)) {
+			g.walk_root_len = strlen(root);
+			if (nftw(root, walk_fn, 64, FTW_PHYS) != 0) {
+				fprintf(stderr, "%s: %s\n", root, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			const char* base = strrchr(root, '/');
+			arrput(g.job_arr, ((struct job) {
+				.path = strdup(root),
+				.root_len = base != NULL ? (int)(base - root) : 0,
+			}));
+		}
+	}
+
+	const int n_jobs = arrlen(g.job_arr);
+	if (n_threads > n_jobs) n_threads = n_jobs > 0 ? n_jobs : 1;
+
+	const double t0 = now();
+	pthread_t* threads = (pthread_t*)calloc(n_threads, sizeof *threads);
+	struct stats* stats = NULL;
+	if (posix_memalign((void**)&stats, alignof(struct stats), n_threads * sizeof *stats) != 0) {
+		fprintf(stderr, "posix_memalign: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(stats, 0, n_threads * sizeof *stats);
+	for (int i = 0; i < n_threads; i++) {
+		const int err = pthread_create(&threads[i], NULL, worker, &stats[i]);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+	struct stats total = {0};
+	for (int i = 0; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
+		struct stats* s = &stats[i];
+		total.n_files      += s->n_files;
+		total.n_failed     += s->n_failed;
+		total.n_normalised += s->n_normalised;
+		total.n_invalid    += s->n_invalid;
+		total.n_events     += s->n_events;
+		total.bytes_in     += s->bytes_in;
+		total.bytes_out    += s->bytes_out;
+	}
+	const double dt = now() - t0;
+	free(stats);
+	free(threads);
+
+	printf("%d files (%d failed, %d normalised, %d invalid) in %.3fs using %d threads\n",
+		total.n_files, total.n_failed, total.n_normalised, total.n_invalid, dt, n_threads);
+	if (dt > 0) {
+		printf("%.1f files/s, %.2f MB/s in, %.2f MB/s out, %.0f events/s\n",
+			(double)total.n_files / dt,
+			(double)total.bytes_in / dt * 1e-6,
+			(double)total.bytes_out / dt * 1e-6,
+			(double)total.n_events / dt);
+	}
+
+	for (int i = 0; i < n_jobs; i++) free(g.job_arr[i].path);
+	arrfree(g.job_arr);
+
+	return total.n_failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
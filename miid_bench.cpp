@@ -0,0 +1,407 @@
+// miid-bench: micro-benchmarks for the .mid I/O path (blob_load,
+// mid_unmarshal_blob, mid_marshal_arr and a round-trip) on synthetic songs
+// from a seeded generator. also writes the generated songs as a corpus
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "stb_ds.h"
+
+#include "generalmidi.h"
+#include "util.h"
+#include "mid.h"
+
+// PRESET(NAME, N_TRACKS, N_BEATS, NOTES_PER_BEAT, CTRLS_PER_BEAT, TEMPO_EVERY, RUNNING_STATUS)
+//  NOTES_PER_BEAT: NOTE ON/OFF pairs per beat per track
+//  CTRLS_PER_BEAT: CC/pitch bend events per beat per track
+//  TEMPO_EVERY:    beats between tempo changes (0=one tempo)
+//  RUNNING_STATUS: use running status and NOTE ON/velocity 0 for NOTE OFF
+#define EMIT_PRESETS \
+	PRESET( small             ,   4 ,  256 , 2 , 1 , 0 , 1 ) \
+	PRESET( dense             ,  16 , 2048 , 8 , 4 , 0 , 1 ) \
+	PRESET( many_tracks       , 200 ,  512 , 2 , 1 , 0 , 1 ) \
+	PRESET( tempo_heavy       ,   8 , 2048 , 2 , 0 , 1 , 1 ) \
+	PRESET( no_running_status ,  16 , 2048 , 8 , 4 , 0 , 0 )
+
+struct preset {
+	const char* name;
+	int n_tracks;
+	int n_beats;
+	int notes_per_beat;
+	int ctrls_per_beat;
+	int tempo_every;
+	bool running_status;
+};
+
+static struct preset presets[] = {
+	#define PRESET(NAME,NT,NB,NPB,CPB,TE,RS) { #NAME, NT, NB, NPB, CPB, TE, RS },
+	EMIT_PRESETS
+	#undef PRESET
+};
+
+#define DIVISION (480)
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+	// xorshift32
+	uint32_t x = rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return rng_state = x;
+}
+
+static int rng_range(int a, int b)
+{
+	return a + (int)(rng() % (uint32_t)(b-a+1));
+}
+
+struct gen_ev {
+	int pos;
+	int seq; // tie breaker; keeps qsort() stable
+	int n;
+	uint8_t b[3];
+};
+
+static int gen_ev_compar(const void* va, const void* vb)
+{
+	const struct gen_ev* a = (const struct gen_ev*)va;
+	const struct gen_ev* b = (const struct gen_ev*)vb;
+	if (a->pos != b->pos) return a->pos - b->pos;
+	return a->seq - b->seq;
+}
+
+static void put_u8(uint8_t** arr, int v)
+{
+	arrput(*arr, (uint8_t)v);
+}
+
+static void put_be(uint8_t** arr, unsigned v, int n)
+{
+	for (int i = n-1; i >= 0; i--) put_u8(arr, (v >> (i*8)) & 0xff);
+}
+
+static void put_varuint(uint8_t** arr, unsigned v)
+{
+	uint8_t tmp[5];
+	int n = 0;
+	do {
+		tmp[n++] = v & 0x7f;
+		v >>= 7;
+	} while (v > 0);
+	while (n > 1) put_u8(arr, tmp[--n] | 0x80);
+	put_u8(arr, tmp[0]);
+}
+
+static void put_track(uint8_t** arr, struct gen_ev* ev_arr, int end_pos, bool running_status)
+{
+	qsort(ev_arr, arrlen(ev_arr), sizeof *ev_arr, gen_ev_compar);
+	put_be(arr, 0x4d54726b, 4); // MTrk
+	const int size_offset = arrlen(*arr);
+	put_be(arr, 0, 4);
+	int cursor = 0;
+	int last_status = -1;
+	for (int i = 0; i < arrlen(ev_arr); i++) {
+		struct gen_ev* ev = &ev_arr[i];
+		put_varuint(arr, ev->pos - cursor);
+		cursor = ev->pos;
+		const int i0 = (running_status && ev->b[0] == last_status) ? 1 : 0;
+		last_status = ev->b[0];
+		for (int j = i0; j < ev->n; j++) put_u8(arr, ev->b[j]);
+	}
+	put_varuint(arr, end_pos - cursor);
+	put_u8(arr, META);
+	put_u8(arr, END_OF_TRACK);
+	put_u8(arr, 0);
+	const unsigned size = arrlen(*arr) - (size_offset + 4);
+	for (int i = 0; i < 4; i++) (*arr)[size_offset+i] = (size >> ((3-i)*8)) & 0xff;
+}
+
+static void add_ev(struct gen_ev** ev_arr, int pos, int n, int b0, int b1, int b2)
+{
+	const int seq = arrlen(*ev_arr);
+	arrput(*ev_arr, ((struct gen_ev) {
+		.pos = pos,
+		.seq = seq,
+		.n = n,
+		.b = {(uint8_t)b0, (uint8_t)b1, (uint8_t)b2},
+	}));
+}
+
+// returns .mid as stb_ds array
+static uint8_t* generate(struct preset* p, uint32_t seed)
+{
+	rng_state = seed != 0 ? seed : 1;
+	const int end_pos = p->n_beats * DIVISION;
+
+	uint8_t* out = NULL;
+	put_be(&out, 0x4d546864, 4); // MThd
+	put_be(&out, 6, 4);
+	put_be(&out, 1, 2);
+	put_be(&out, 1 + p->n_tracks, 2);
+	put_be(&out, DIVISION, 2);
+
+	// time track
+	{
+		uint8_t* trk = NULL;
+		int cursor = 0;
+		put_varuint(&trk, 0);
+		put_u8(&trk, META); put_u8(&trk, TIME_SIGNATURE); put_u8(&trk, 4);
+		put_u8(&trk, 4); put_u8(&trk, 2); put_u8(&trk, 0x18); put_u8(&trk, 0x08);
+		int beat = 0;
+		do {
+			const int pos = beat * DIVISION;
+			const unsigned uspq = 300000 + (rng() % 700000);
+			put_varuint(&trk, pos - cursor);
+			cursor = pos;
+			put_u8(&trk, META); put_u8(&trk, SET_TEMPO); put_u8(&trk, 3);
+			put_be(&trk, uspq, 3);
+			beat += p->tempo_every;
+		} while (p->tempo_every > 0 && beat < p->n_beats);
+		put_varuint(&trk, end_pos - cursor);
+		put_u8(&trk, META); put_u8(&trk, END_OF_TRACK); put_u8(&trk, 0);
+		put_be(&out, 0x4d54726b, 4); // MTrk
+		put_be(&out, arrlen(trk), 4);
+		for (int i = 0; i < arrlen(trk); i++) put_u8(&out, trk[i]);
+		arrfree(trk);
+	}
+
+	static const int ctrls[] = { VOLUME, PAN, MODULATION_WHEEL, -1 /* pitch bend */ };
+	struct gen_ev* ev_arr = NULL;
+	for (int ti = 0; ti < p->n_tracks; ti++) {
+		arrsetlen(ev_arr, 0);
+		const int ch = ti % 16;
+		add_ev(&ev_arr, 0, 2, PROGRAM_CHANGE | ch, rng_range(0, 127), 0);
+		for (int beat = 0; beat < p->n_beats; beat++) {
+			const int pos0 = beat * DIVISION;
+			for (int i = 0; i < p->notes_per_beat; i++) {
+				const int pos = pos0 + (i * DIVISION) / p->notes_per_beat;
+				const int len = rng_range(DIVISION/8, DIVISION*2);
+				const int key = rng_range(24, 107);
+				add_ev(&ev_arr, pos, 3, NOTE_ON | ch, key, rng_range(1, 127));
+				const int off_pos = (pos + len) < end_pos ? (pos + len) : end_pos;
+				if (p->running_status) {
+					add_ev(&ev_arr, off_pos, 3, NOTE_ON | ch, key, 0);
+				} else {
+					add_ev(&ev_arr, off_pos, 3, NOTE_OFF | ch, key, 0x40);
+				}
+			}
+			for (int i = 0; i < p->ctrls_per_beat; i++) {
+				const int pos = pos0 + (i * DIVISION) / p->ctrls_per_beat;
+				const int c = ctrls[rng() % ARRAY_LENGTH(ctrls)];
+				if (c >= 0) {
+					add_ev(&ev_arr, pos, 3, CONTROL_CHANGE | ch, c, rng_range(0, 127));
+				} else {
+					add_ev(&ev_arr, pos, 3, PITCH_BEND | ch, rng_range(0, 127), rng_range(0, 127));
+				}
+			}
+		}
+		put_track(&out, ev_arr, end_pos, p->running_status);
+	}
+	arrfree(ev_arr);
+	return out;
+}
+
+// allocation counting by wrapping the allocator; glibc only
+static long n_allocs;
+#ifdef __GLIBC__
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* malloc(size_t n) { n_allocs++; return __libc_malloc(n); }
+void* calloc(size_t n, size_t m) { n_allocs++; return __libc_calloc(n, m); }
+void* realloc(void* p, size_t n) { n_allocs++; return __libc_realloc(p, n); }
+}
+#define HAVE_ALLOC_COUNT (1)
+#else
+#define HAVE_ALLOC_COUNT (0)
+#endif
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+struct ctx {
+	const char* path;
+	struct blob blob;
+	struct mid* mid;
+};
+
+static void op_load(struct ctx* ctx)
+{
+	struct blob blob = blob_load(ctx->path);
+	assert(blob.data != NULL);
+	free(blob.data);
+}
+
+// includes mid_free(); there's no way to unmarshal without eventually
+// freeing, and it keeps memory flat across iterations
+static void op_unmarshal(struct ctx* ctx)
+{
+	struct mid* mid = mid_unmarshal_blob(ctx->blob);
+	assert(mid != NULL);
+	mid_free(mid);
+}
+
+static void op_marshal(struct ctx* ctx)
+{
+	uint8_t* out = mid_marshal_arr(ctx->mid);
+	arrfree(out);
+}
+
+static void op_roundtrip(struct ctx* ctx)
+{
+	struct mid* mid = mid_unmarshal_blob(ctx->blob);
+	assert(mid != NULL);
+	uint8_t* out = mid_marshal_arr(mid);
+	struct mid* mid2 = mid_unmarshal_blob(arrblob(out));
+	assert(mid2 != NULL);
+	mid_free(mid2);
+	arrfree(out);
+	mid_free(mid);
+}
+
+static double min_time = 0.5;
+
+static void measure(const char* what, void(*op)(struct ctx*), struct ctx* ctx, double n_bytes, double n_events)
+{
+	op(ctx); // warm up
+
+	int n_iter = 0;
+	long allocs = 0;
+	const double t0 = now();
+	double dt;
+	do {
+		const long a0 = n_allocs;
+		op(ctx);
+		allocs += n_allocs - a0;
+		n_iter++;
+		dt = now() - t0;
+	} while (dt < min_time || n_iter < 3);
+
+	const double t = dt / n_iter;
+	printf("  %-10s %9.3f ms %9.2f MB/s %9.2f Mev/s", what, t*1e3, n_bytes / t * 1e-6, n_events / t * 1e-6);
+	if (HAVE_ALLOC_COUNT) {
+		printf(" %8.4f allocs/ev", (double)allocs / n_iter / n_events);
+	}
+	printf("\n");
+}
+
+static void bench_preset(struct preset* p, uint32_t seed)
+{
+	uint8_t* data_arr = generate(p, seed);
+
+	char path[] = "/tmp/miid-bench-XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd == -1) {
+		fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	if (!write_file_from_arr(data_arr, path)) exit(EXIT_FAILURE);
+
+	struct ctx ctx;
+	ctx.path = path;
+	ctx.blob = arrblob(data_arr);
+	ctx.mid = mid_unmarshal_blob(ctx.blob);
+	if (ctx.mid == NULL) {
+		fprintf(stderr, "%s: generated song does not parse: %s\n", p->name, mid_last_error);
+		exit(EXIT_FAILURE);
+	}
+	int64_t n_events = 0;
+	for (int i = 0; i < arrlen(ctx.mid->_trk_arr); i++) n_events += arrlen(ctx.mid->_trk_arr[i].mev_arr);
+
+	const double n_bytes = arrlen(data_arr);
+	printf("%s: %d tracks, %.0f bytes, %lld events\n", p->name, p->n_tracks, n_bytes, (long long)n_events);
+	measure("blob_load", op_load,      &ctx, n_bytes, n_events);
+	measure("unmarshal", op_unmarshal, &ctx, n_bytes, n_events);
+	measure("marshal",   op_marshal,   &ctx, n_bytes, n_events);
+	measure("roundtrip", op_roundtrip, &ctx, n_bytes, n_events);
+
+	mid_free(ctx.mid);
+	remove(path);
+	arrfree(data_arr);
+}
+
+static struct preset* find_preset(const char* name)
+{
+	for (int i = 0; i < (int)ARRAY_LENGTH(presets); i++) {
+		if (strcmp(presets[i].name, name) == 0) return &presets[i];
+	}
+	return NULL;
+}
+
+static void usage(const char* prg)
+{
+	fprintf(stderr, "Usage: %s [-p PRESET] [-s SEED] [-t SECONDS] [-g DIR [-n COUNT]]\n", prg);
+	fprintf(stderr, "  -p PRESET   only run PRESET (default: all)\n");
+	fprintf(stderr, "  -s SEED     generator seed (default: 1)\n");
+	fprintf(stderr, "  -t SECONDS  minimum time per measurement (default: %g)\n", min_time);
+	fprintf(stderr, "  -g DIR      don't benchmark; write COUNT songs per preset to DIR\n");
+	fprintf(stderr, "  -n COUNT    songs per preset for -g (default: 1)\n");
+	fprintf(stderr, "presets:\n");
+	for (int i = 0; i < (int)ARRAY_LENGTH(presets); i++) {
+		struct preset* p = &presets[i];
+		fprintf(stderr, "  %-18s %3d tracks, %4d beats, %d notes/beat, %d ctrls/beat, tempo every %d beats%s\n",
+			p->name, p->n_tracks, p->n_beats, p->notes_per_beat, p->ctrls_per_beat, p->tempo_every,
+			p->running_status ? "" : ", no running status");
+	}
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+	struct preset* only = NULL;
+	uint32_t seed = 1;
+	const char* gen_dir = NULL;
+	int gen_count = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:s:t:g:n:")) != -1) {
+		switch (opt) {
+		case 'p':
+			only = find_preset(optarg);
+			if (only == NULL) usage(argv[0]);
+			break;
+		case 's': seed = strtoul(optarg, NULL, 0); break;
+		case 't': min_time = atof(optarg); break;
+		case 'g': gen_dir = optarg; break;
+		case 'n': gen_count = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc) usage(argv[0]);
+	mid_quiet = true;
+
+	for (int i = 0; i < (int)ARRAY_LENGTH(presets); i++) {
+		struct preset* p = &presets[i];
+		if (only != NULL && p != only) continue;
+		if (gen_dir == NULL) {
+			bench_preset(p, seed);
+			continue;
+		}
+		if (mkdir(gen_dir, 0777) != 0 && errno != EEXIST) {
+			fprintf(stderr, "%s: %s\n", gen_dir, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		for (int j = 0; j < gen_count; j++) {
+			char path[1<<12];
+			snprintf(path, sizeof path, "%s/%s-%04d.mid", gen_dir, p->name, j);
+			uint8_t* data_arr = generate(p, seed + j);
+			if (!write_file_from_arr(data_arr, path)) exit(EXIT_FAILURE);
+			arrfree(data_arr);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+// miid-benchgui: runs the editor without a display (null renderer; draw
+// data is only counted) and replays a scripted sequence of selections, zooms
+// and pans on a song, reporting CPU time per frame and vertex/index counts
+// for g_header() and g_pianoroll()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "imgui.h"
+
+#include "stb_ds.h"
+
+#include "config.h"
+#include "util.h"
+#include "miid.h"
+
+static struct {
+	ImVec2 display_size;
+	bool fake_layers;
+	int frames_per_step;
+	void* usr;
+	ImGuiContext* imctx;
+	int layer_vtx;
+} g;
+
+void miidhost_create_window(void* usr, ImFontAtlas* shared_font_atlas)
+{
+	if (g.usr != NULL) {
+		fprintf(stderr, "ERROR: only one song at a time, please\n");
+		exit(EXIT_FAILURE);
+	}
+	g.usr = usr;
+	g.imctx = ImGui::CreateContext(shared_font_atlas);
+	ImGui::SetCurrentContext(g.imctx);
+	ImGuiIO& io = ImGui::GetIO();
+	io.DisplaySize = g.display_size;
+	io.IniFilename = NULL;
+	// nothing is uploaded, but the atlas must be built
+	unsigned char* pixels;
+	int width, height;
+	io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
+}
+
+ImTextureID miidhost_layer_draw(int layer, ImVec2 size, float scale, bool clear, int scroll_px, ImDrawList* draw_list)
+{
+	(void)size;
+	(void)scale;
+	(void)clear;
+	(void)scroll_px;
+	if (!g.fake_layers) return 0;
+	if (draw_list != NULL) {
+		g.layer_vtx += draw_list->VtxBuffer.Size;
+	}
+	return (ImTextureID)(intptr_t)(1 + layer);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static ImVec2 at(ImVec2 p0, ImVec2 p1, float fx, float fy)
+{
+	return ImVec2(p0.x + (p1.x-p0.x)*fx, p0.y + (p1.y-p0.y)*fy);
+}
+
+static ImVec2 time_row_at(struct miid_frame_stats* fs, float fx)
+{
+	ImVec2 p1 = fs->header_timeline_p1;
+	p1.y = fs->header_time_row_y1;
+	return at(fs->header_timeline_p0, p1, fx, 0.5f);
+}
+
+static ImVec2 track_rows_at(struct miid_frame_stats* fs, float fx, float fy)
+{
+	ImVec2 p0 = fs->header_timeline_p0;
+	p0.y = fs->header_time_row_y1;
+	return at(p0, fs->header_timeline_p1, fx, fy);
+}
+
+// press button at p0 on frame 1, drag towards p1, release on frame n-2
+static void drag(ImGuiIO& io, int i, int n, int button, ImVec2 p0, ImVec2 p1)
+{
+	if (i == 0) {
+		io.AddMousePosEvent(p0.x, p0.y);
+	} else if (i == 1) {
+		io.AddMouseButtonEvent(button, true);
+	} else if (i < n-2) {
+		const float t = (float)(i-1) / (float)(n-4);
+		io.AddMousePosEvent(p0.x + (p1.x-p0.x)*t, p0.y + (p1.y-p0.y)*t);
+	} else if (i == n-2) {
+		io.AddMouseButtonEvent(button, false);
+	}
+}
+
+static void double_click(ImGuiIO& io, int i, int button, ImVec2 p)
+{
+	switch (i) {
+	case 0: io.AddMousePosEvent(p.x, p.y); break;
+	case 1: case 3: io.AddMouseButtonEvent(button, true); break;
+	case 2: case 4: io.AddMouseButtonEvent(button, false); break;
+	}
+}
+
+// wheel up for the first half, down for the second
+static void wheel(ImGuiIO& io, int i, int n, ImVec2 p)
+{
+	if (i == 0) {
+		io.AddMousePosEvent(p.x, p.y);
+	} else {
+		io.AddMouseWheelEvent(0, i < n/2 ? 1 : -1);
+	}
+}
+
+static void step_idle(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	(void)io; (void)i; (void)n; (void)fs;
+}
+
+static void step_select_time(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	drag(io, i, n, 0, time_row_at(fs, 0.1f), time_row_at(fs, 0.4f));
+}
+
+static void step_select_tracks(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	if (fs->header_timeline_p1.y <= fs->header_time_row_y1) return; // no track rows
+	drag(io, i, n, 0, track_rows_at(fs, 0.2f, 0.0f), track_rows_at(fs, 0.6f, 0.5f));
+}
+
+static void step_fit_time(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	(void)n;
+	double_click(io, i, 1, time_row_at(fs, 0.5f));
+}
+
+static void step_fit_keys(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	(void)n;
+	double_click(io, i, 1, at(fs->pianoroll_keys_p0, fs->pianoroll_keys_p1, 0.5f, 0.5f));
+}
+
+static void step_zoom_time(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	wheel(io, i, n, time_row_at(fs, 0.5f));
+}
+
+static void step_pan_time(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	drag(io, i, n, 1, time_row_at(fs, 0.7f), time_row_at(fs, 0.3f));
+}
+
+static void step_zoom_keys(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	wheel(io, i, n, at(fs->pianoroll_keys_p0, fs->pianoroll_keys_p1, 0.5f, 0.5f));
+}
+
+static void step_pan_notes(ImGuiIO& io, int i, int n, struct miid_frame_stats* fs)
+{
+	const ImVec2 p0 = fs->pianoroll_notes_p0, p1 = fs->pianoroll_notes_p1;
+	drag(io, i, n, 2, at(p0, p1, 0.8f, 0.4f), at(p0, p1, 0.2f, 0.6f));
+}
+
+// STEP(NAME, N_FRAMES) (N_FRAMES=0: -n frames)
+#define EMIT_STEPS \
+	STEP( idle          , 0  ) \
+	STEP( select_tracks , 0  ) \
+	STEP( select_time   , 0  ) \
+	STEP( fit_time      , 10 ) \
+	STEP( fit_keys      , 10 ) \
+	STEP( zoom_time     , 0  ) \
+	STEP( pan_time      , 0  ) \
+	STEP( zoom_keys     , 0  ) \
+	STEP( pan_notes     , 0  ) \
+	STEP( idle          , 0  )
+
+struct step {
+	const char* name;
+	int n_frames;
+	void(*fn)(ImGuiIO&, int, int, struct miid_frame_stats*);
+};
+
+static struct step steps[] = {
+	#define STEP(NAME,N) { #NAME, N, step_##NAME },
+	EMIT_STEPS
+	#undef STEP
+};
+
+struct acc {
+	int n_frames;
+	double frame_seconds, max_frame_seconds;
+	double header_seconds, pianoroll_seconds;
+	double header_vtx, header_idx;
+	double pianoroll_vtx, pianoroll_idx;
+	double total_vtx, total_idx;
+	double layer_vtx;
+};
+
+static void acc_add(struct acc* a, double frame_seconds, struct miid_frame_stats* fs, ImDrawData* dd, int layer_vtx)
+{
+	a->n_frames++;
+	a->frame_seconds += frame_seconds;
+	if (frame_seconds > a->max_frame_seconds) a->max_frame_seconds = frame_seconds;
+	a->header_seconds += fs->header_seconds;
+	a->pianoroll_seconds += fs->pianoroll_seconds;
+	a->header_vtx += fs->header_vtx;
+	a->header_idx += fs->header_idx;
+	a->pianoroll_vtx += fs->pianoroll_vtx;
+	a->pianoroll_idx += fs->pianoroll_idx;
+	a->total_vtx += dd->TotalVtxCount;
+	a->total_idx += dd->TotalIdxCount;
+	a->layer_vtx += layer_vtx;
+}
+
+static void acc_print(const char* name, struct acc* a)
+{
+	const double n = a->n_frames > 0 ? a->n_frames : 1;
+	printf("%-14s %6d %8.3f %8.3f %8.3f %8.3f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n",
+		name,
+		a->n_frames,
+		a->frame_seconds / n * 1e3,
+		a->max_frame_seconds * 1e3,
+		a->header_seconds / n * 1e3,
+		a->pianoroll_seconds / n * 1e3,
+		a->header_vtx / n,
+		a->header_idx / n,
+		a->pianoroll_vtx / n,
+		a->pianoroll_idx / n,
+		a->total_vtx / n,
+		a->total_idx / n,
+		a->layer_vtx / n);
+}
+
+static void usage(const char* prg)
+{
+	fprintf(stderr, "Usage: %s [-W WIDTH] [-H HEIGHT] [-n FRAMES] [-l] <song.mid>\n", prg);
+	fprintf(stderr, "  -W, -H     display size (default: 1920x1080)\n");
+	fprintf(stderr, "  -n FRAMES  frames per scripted step (default: 120)\n");
+	fprintf(stderr, "  -l         pretend the host supports offscreen layers (default: direct drawing)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+	g.display_size = ImVec2(1920, 1080);
+	g.frames_per_step = 120;
+	int opt;
+	while ((opt = getopt(argc, argv, "W:H:n:l")) != -1) {
+		switch (opt) {
+		case 'W': g.display_size.x = atoi(optarg); break;
+		case 'H': g.display_size.y = atoi(optarg); break;
+		case 'n': g.frames_per_step = atoi(optarg); break;
+		case 'l': g.fake_layers = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc-1 || g.frames_per_step < 8) usage(argv[0]);
+
+	char* path = argv[optind];
+	struct stat sb;
+	if (stat(path, &sb) != 0) {
+		fprintf(stderr, "%s: no such file\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	config_init();
+	char* init_argv[] = { argv[0], path, NULL };
+	miid_init(2, init_argv, 0);
+	if (g.usr == NULL) {
+		fprintf(stderr, "ERROR: %s: no window\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	ImGui::SetCurrentContext(g.imctx);
+	ImGuiIO& io = ImGui::GetIO();
+	struct miid_frame_stats fs;
+	memset(&fs, 0, sizeof fs);
+
+	printf("%-14s %6s %8s %8s %8s %8s %9s %9s %9s %9s %9s %9s %9s\n",
+		"step", "frames", "avg ms", "max ms", "hdr ms", "roll ms",
+		"hdr vtx", "hdr idx", "roll vtx", "roll idx", "vtx", "idx", "layer vtx");
+
+	struct acc total;
+	memset(&total, 0, sizeof total);
+	for (int si = 0; si < (int)ARRAY_LENGTH(steps); si++) {
+		struct step* step = &steps[si];
+		const int n = step->n_frames > 0 ? step->n_frames : g.frames_per_step;
+		struct acc acc;
+		memset(&acc, 0, sizeof acc);
+		for (int i = 0; i < n; i++) {
+			io.DeltaTime = 1.0f / 60.0f;
+			step->fn(io, i, n, &fs);
+			g.layer_vtx = 0;
+
+			const double t0 = now();
+			miid_new_frame(g.usr); // nothing to re-upload
+			ImGui::NewFrame();
+			miid_frame(g.usr, false);
+			ImGui::Render();
+			const double dt = now() - t0;
+
+			miid_get_frame_stats(g.usr, &fs);
+			acc_add(&acc, dt, &fs, ImGui::GetDrawData(), g.layer_vtx);
+			acc_add(&total, dt, &fs, ImGui::GetDrawData(), g.layer_vtx);
+		}
+		acc_print(step->name, &acc);
+	}
+	acc_print("TOTAL", &total);
+
+	return EXIT_SUCCESS;
+}
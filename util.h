@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "imgui.h"
 
@@ -86,5 +87,79 @@ static inline void order_3f32(float* f0, float* f1, float* f2)
 	order_2f32(f0, f1);
 }
 
+#define FNV1A64_INIT (0xcbf29ce484222325ull)
+
+static inline uint64_t fnv1a64(uint64_t h, const void* data, size_t n)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	for (size_t i = 0; i < n; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+// growable bit set; bits beyond the allocated words read as 0
+struct bitset {
+	uint64_t* words;
+	int n_words;
+};
+
+static inline bool bitset_get(const struct bitset* bs, int i)
+{
+	const int w = i >> 6;
+	if (w >= bs->n_words) return false;
+	return (bs->words[w] >> (i & 63)) & 1;
+}
+
+static inline void bitset_grow(struct bitset* bs, int n_words)
+{
+	if (n_words <= bs->n_words) return;
+	bs->words = (uint64_t*)realloc(bs->words, n_words * sizeof bs->words[0]);
+	memset(bs->words + bs->n_words, 0, (n_words - bs->n_words) * sizeof bs->words[0]);
+	bs->n_words = n_words;
+}
+
+static inline void bitset_put(struct bitset* bs, int i, bool v)
+{
+	const int w = i >> 6;
+	const uint64_t m = 1ull << (i & 63);
+	if (v) {
+		bitset_grow(bs, w+1);
+		bs->words[w] |= m;
+	} else if (w < bs->n_words) {
+		bs->words[w] &= ~m;
+	}
+}
+
+static inline void bitset_clear(struct bitset* bs)
+{
+	if (bs->n_words > 0) memset(bs->words, 0, bs->n_words * sizeof bs->words[0]);
+}
+
+static inline void bitset_copy(struct bitset* dst, const struct bitset* src)
+{
+	bitset_grow(dst, src->n_words);
+	bitset_clear(dst);
+	if (src->n_words > 0) memcpy(dst->words, src->words, src->n_words * sizeof src->words[0]);
+}
+
+static inline int bitset_count(const struct bitset* bs)
+{
+	int n = 0;
+	for (int w = 0; w < bs->n_words; w++) n += __builtin_popcountll(bs->words[w]);
+	return n;
+}
+
+static inline uint64_t bitset_hash(uint64_t h, const struct bitset* bs, int n_bits)
+{
+	const int n = (n_bits + 63) >> 6;
+	for (int w = 0; w < n; w++) {
+		const uint64_t x = w < bs->n_words ? bs->words[w] : 0;
+		h = fnv1a64(h, &x, sizeof x);
+	}
+	return h;
+}
+
 #define UTIL_H
 #endif